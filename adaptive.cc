@@ -0,0 +1,232 @@
+#include <algorithm>
+#include <cmath>
+#include "adaptive.h"
+
+/*
+ * A migration must be expected to save this fraction of the cost per
+ * operation, so that a workload near the boundary between two backends does
+ * not move back and forth between them.
+ */
+static const double hysteresis = 0.25;
+
+/*
+ * The shortest period over which the workload is measured, in estimated
+ * nanoseconds, about a thousand operations on small inputs.
+ */
+static const double min_period = 50000;
+
+/*
+ * The number of times a structure of the given size overflows a cache of
+ * 1 MiB, on a log scale, which approximates the cache misses added to each
+ * random access once it no longer fits.
+ */
+static double overflow(double bytes) {
+  return std::log2(std::max(bytes / (1 << 20), 1.0));
+}
+
+template<class URBG, class Weight, class Index>
+basic_adaptive<URBG, Weight, Index>::basic_adaptive(const std::vector<Weight>& dist): basic_adaptive(dist, random_seed()) {
+}
+
+template<class URBG, class Weight, class Index>
+basic_adaptive<URBG, Weight, Index>::basic_adaptive(const std::vector<Weight>& dist, uint64_t seed): basic_adaptive(dist, URBG(seed)) {
+}
+
+/*
+ * The costs are fitted to measurements of each backend from 10 to 10^6
+ * items: a tree operation walks log2(k) levels, MVN takes near constant
+ * time, and the alias table samples in constant time but is rebuilt in O(k)
+ * by the first sample after an update. Each pays for cache misses in
+ * proportion to its size. The sampler starts on the tree, which is the
+ * cheapest to build and has no bad case.
+ */
+template<class URBG, class Weight, class Index>
+basic_adaptive<URBG, Weight, Index>::basic_adaptive(const std::vector<Weight>& dist, const URBG& engine):
+  weights(dist), active(adaptive_backend::we), gen(engine), samples(0), updates(0), rebuilds(0), changed(false),
+  spent(0), sample_rate(0), update_rate(0), rebuild_rate(0), observed(false) {
+  double k = dist.size();
+  double depth = std::log2(std::max(k, 2.0));
+  double tree_misses = 20 * overflow(2 * k * sizeof(Weight));
+  double mvn_misses = 60 * overflow(64 * k);
+  double table_misses = 8 * overflow(k * (sizeof(Weight) + 8));
+  costs[(int) adaptive_backend::we] = { 10 * depth + tree_misses, 5 + 3 * depth + tree_misses, 0, 12 * k };
+  costs[(int) adaptive_backend::mvn] = { 50 + mvn_misses, 110 + mvn_misses, 0, 45 * k };
+  costs[(int) adaptive_backend::vose] = { 30 + table_misses, 5, 500 + 25 * k, 500 + 25 * k };
+
+  budget = min_period;
+  for (const op_costs &c : costs)
+    budget = std::max(budget, c.build);
+
+  migrate(adaptive_backend::we);
+}
+
+/*
+ * Replaces the backend with a new one of the target kind, built from the
+ * copy of the weights. The old backend is released first, so that both are
+ * never held at once.
+ */
+template<class URBG, class Weight, class Index>
+void basic_adaptive<URBG, Weight, Index>::migrate(adaptive_backend target) {
+  uint64_t seed = gen();
+  we_backend.reset();
+  mvn_backend.reset();
+  vose_backend.reset();
+
+  switch (target) {
+    case adaptive_backend::we:
+      we_backend.reset(new basic_we<URBG, Weight, Index>(weights, seed));
+      break;
+    case adaptive_backend::mvn:
+      mvn_backend.reset(new basic_mvn<URBG, Weight, Index>(weights, seed));
+      break;
+    case adaptive_backend::vose:
+      vose_backend.reset(new basic_vose<URBG, Weight, Index>(weights, seed));
+      break;
+  }
+  active = target;
+}
+
+/*
+ * Returns the estimated cost per operation of a backend under the measured
+ * mix of operations.
+ */
+template<class URBG, class Weight, class Index>
+double basic_adaptive<URBG, Weight, Index>::estimate(adaptive_backend backend) const {
+  const op_costs &c = costs[(int) backend];
+  return sample_rate * c.sample + update_rate * c.update + rebuild_rate * c.rebuild;
+}
+
+/*
+ * Closes a period of measurement, once the active backend has done about as
+ * much work as building the costliest backend. The rates of the period are
+ * averaged with those before it, halving the weight of older periods, and
+ * the cheapest backend is adopted if it clears the hysteresis margin.
+ */
+template<class URBG, class Weight, class Index>
+void basic_adaptive<URBG, Weight, Index>::end_period() {
+  double ops = samples + updates;
+  double s = samples / ops;
+  double u = updates / ops;
+  double r = rebuilds / ops;
+  if (observed) {
+    sample_rate = (sample_rate + s) / 2;
+    update_rate = (update_rate + u) / 2;
+    rebuild_rate = (rebuild_rate + r) / 2;
+  } else {
+    sample_rate = s;
+    update_rate = u;
+    rebuild_rate = r;
+    observed = true;
+  }
+  samples = 0;
+  updates = 0;
+  rebuilds = 0;
+  spent = 0;
+
+  adaptive_backend best = active;
+  for (adaptive_backend b : { adaptive_backend::we, adaptive_backend::mvn, adaptive_backend::vose }) {
+    if (estimate(b) < estimate(best))
+      best = b;
+  }
+  if (best != active && estimate(best) < (1 - hysteresis) * estimate(active))
+    migrate(best);
+}
+
+template<class URBG, class Weight, class Index>
+adaptive_backend basic_adaptive<URBG, Weight, Index>::backend() const {
+  return active;
+}
+
+template<class URBG, class Weight, class Index>
+Index basic_adaptive<URBG, Weight, Index>::sample() {
+  const op_costs &c = costs[(int) active];
+  Index r;
+  switch (active) {
+    case adaptive_backend::we:
+      r = we_backend->sample();
+      break;
+    case adaptive_backend::mvn:
+      r = mvn_backend->sample();
+      break;
+    default:
+      r = vose_backend->sample();
+      break;
+  }
+
+  samples ++;
+  spent += c.sample;
+  if (changed) {
+    rebuilds ++;
+    spent += c.rebuild;
+    changed = false;
+  }
+  if (spent >= budget)
+    end_period();
+  return r;
+}
+
+template<class URBG, class Weight, class Index>
+void basic_adaptive<URBG, Weight, Index>::update(Index idx, Weight value) {
+  weights[idx] = value;
+  switch (active) {
+    case adaptive_backend::we:
+      we_backend->update(idx, value);
+      break;
+    case adaptive_backend::mvn:
+      mvn_backend->update(idx, value);
+      break;
+    default:
+      vose_backend->update(idx, value);
+      break;
+  }
+
+  updates ++;
+  changed = true;
+  spent += costs[(int) active].update;
+  if (spent >= budget)
+    end_period();
+}
+
+template<class URBG, class Weight, class Index>
+void basic_adaptive<URBG, Weight, Index>::delta_update(Index idx, Weight delta) {
+  weights[idx] += delta;
+  switch (active) {
+    case adaptive_backend::we:
+      we_backend->delta_update(idx, delta);
+      break;
+    case adaptive_backend::mvn:
+      mvn_backend->delta_update(idx, delta);
+      break;
+    default:
+      vose_backend->delta_update(idx, delta);
+      break;
+  }
+
+  updates ++;
+  changed = true;
+  spent += costs[(int) active].update;
+  if (spent >= budget)
+    end_period();
+}
+
+/*
+ * Draws m distinct items with the active backend, which leaves the weights
+ * as they were. The draws are not counted towards the workload.
+ */
+template<class URBG, class Weight, class Index>
+std::vector<Index> basic_adaptive<URBG, Weight, Index>::sample_without_replacement(int m) {
+  switch (active) {
+    case adaptive_backend::we:
+      return we_backend->sample_without_replacement(m);
+    case adaptive_backend::mvn:
+      return mvn_backend->sample_without_replacement(m);
+    default:
+      return vose_backend->sample_without_replacement(m);
+  }
+}
+
+#define INSTANTIATE(URBG) template class basic_adaptive<URBG>;
+SAMPLING_ENGINES(INSTANTIATE)
+
+#define INSTANTIATE_WEIGHTS(Weight, Index) template class basic_adaptive<default_engine, Weight, Index>;
+SAMPLING_INTEGER_WEIGHT_TYPES(INSTANTIATE_WEIGHTS)
@@ -0,0 +1,90 @@
+/*
+ * A categorical sampler that chooses between WE, MVN and Vose's alias table
+ * from the workload it observes. No one of them is fastest everywhere: the
+ * alias table wins when the weights rarely change, the tree when updates are
+ * frequent and k is small, and MVN, whose operations take near constant
+ * time, when both are frequent and k is large.
+ *
+ * The sampler keeps a copy of the weights and one backend. It counts the
+ * samples, the updates and the samples that follow an update, which the
+ * alias table would pay for with a rebuild, and estimates the cost of each
+ * backend from them. The estimate is refreshed once the active backend has
+ * done about a rebuild's worth of work, and the sampler migrates only when
+ * another backend would be cheaper by a clear margin. A migration builds the
+ * new backend from the copy in one step, so it costs one rebuild, and its
+ * cost is amortized over the period of work before it.
+ *
+ * Weights must be unsigned integers, as for MVN, and indices 32 bit integers,
+ * as for Vose.
+ */
+#ifndef ADAPTIVE_H
+#define ADAPTIVE_H
+
+#include <memory>
+#include <random>
+#include <type_traits>
+#include <vector>
+#include "mvn.h"
+#include "rng.h"
+#include "vose.h"
+#include "we.h"
+#include "weights.h"
+
+enum class adaptive_backend { we, mvn, vose };
+
+template<class URBG = default_engine, class Weight = uint64_t, class Index = int>
+class basic_adaptive {
+  static_assert(std::is_unsigned<Weight>::value, "weights must be unsigned integers");
+  static_assert(std::is_integral<Index>::value && sizeof(Index) == 4, "indices must be 32 bit integers");
+
+  private:
+    /*
+     * Estimated nanoseconds for each operation of a backend over k items.
+     */
+    struct op_costs {
+      double sample;
+      double update;
+      double rebuild;
+      double build;
+    };
+
+    std::vector<Weight> weights;
+    adaptive_backend active;
+    std::unique_ptr<basic_we<URBG, Weight, Index>> we_backend;
+    std::unique_ptr<basic_mvn<URBG, Weight, Index>> mvn_backend;
+    std::unique_ptr<basic_vose<URBG, Weight, Index>> vose_backend;
+    op_costs costs[3];
+    URBG gen;
+
+    uint64_t samples;
+    uint64_t updates;
+    uint64_t rebuilds;
+    bool changed;
+    double spent;
+    double budget;
+    double sample_rate;
+    double update_rate;
+    double rebuild_rate;
+    bool observed;
+
+    void migrate(adaptive_backend target);
+    void end_period();
+    double estimate(adaptive_backend backend) const;
+
+  public:
+    typedef Weight weight_type;
+    typedef Index index_type;
+
+    basic_adaptive(const std::vector<Weight>& dist);
+    basic_adaptive(const std::vector<Weight>& dist, uint64_t seed);
+    basic_adaptive(const std::vector<Weight>& dist, const URBG& engine);
+    adaptive_backend backend() const;
+    Index sample();
+    void update(Index idx, Weight value);
+    void delta_update(Index idx, Weight delta);
+    std::vector<Index> sample_without_replacement(int m);
+};
+
+typedef basic_adaptive<> adaptive;
+
+#endif
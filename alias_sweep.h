@@ -0,0 +1,199 @@
+/*
+ * The sweep that fills an alias table, shared by vose and exact_vose.
+ */
+#ifndef ALIAS_SWEEP_H
+#define ALIAS_SWEEP_H
+
+#include <algorithm>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+#include "thread_pool.h"
+
+/*
+ * The table is built by the sweep of Hübschle-Schneider and Sanders'
+ * "Parallel Weighted Random Sampling", which pairs the light items, those
+ * below the slot size, in order with the heavy items in order. Write A(i)
+ * for the deficit of the first i light items below their slots and B(j) for
+ * the excess of the first j + 1 heavy items over theirs. The sweep is then a
+ * merge of the two sequences: light item i is filled before heavy item j
+ * exactly when A(i) <= B(j), and is aliased to the heavy item current at
+ * that point, while a heavy item is filled with what remains of it and
+ * aliased to the next. The last heavy item is filled after every light one.
+ *
+ * As the keys and the remainders come from prefix sums, the sweep can start
+ * anywhere. The slots are cut into parts of a fixed size, the state of the
+ * merge at each cut is found by binary search, and the parts are filled
+ * independently, in parallel when a pool is given. Keys of integer weights
+ * are exact, in units of 1 / k, and the prefix sums are taken over blocks of
+ * a fixed size, so the table does not depend on the number of threads.
+ */
+static const size_t alias_block = 1 << 16;
+
+template<class Weight>
+class alias_sweep {
+  private:
+    typedef typename std::conditional<std::is_integral<Weight>::value, uint64_t, double>::type sum_type;
+    typedef typename std::conditional<std::is_integral<Weight>::value, __int128, double>::type key_type;
+
+    const Weight *w;
+    size_t k;
+    sum_type total;
+    std::vector<uint32_t> light;
+    std::vector<uint32_t> heavy;
+    std::vector<sum_type> light_sum;
+    std::vector<sum_type> heavy_sum;
+
+    bool is_light(Weight x) const {
+      return (key_type) x * k < total;
+    }
+
+    key_type light_key(size_t i) const {
+      return (key_type) i * total - (key_type) k * light_sum[i];
+    }
+
+    key_type heavy_key(size_t j) const {
+      return (key_type) k * heavy_sum[j + 1] - (key_type) (j + 1) * total;
+    }
+
+    /*
+     * Stores a threshold given both exactly, in units of 1 / k, and as a
+     * weight. Floating point tables take the weight, and integer tables the
+     * exact value, which lies in [0, total].
+     */
+    template<class T>
+    static typename std::enable_if<std::is_floating_point<T>::value>::type set_threshold(T& p, key_type scaled, double value) {
+      p = value;
+    }
+
+    template<class T>
+    static typename std::enable_if<std::is_integral<T>::value>::type set_threshold(T& p, key_type scaled, double value) {
+      p = scaled;
+    }
+
+    bool light_first(size_t i, size_t j) const {
+      return j + 1 >= heavy.size() || light_key(i) <= heavy_key(j);
+    }
+
+    /*
+     * Returns the number of light items among the first m slots filled.
+     */
+    size_t light_count(size_t m) const {
+      size_t lo = m > heavy.size() ? m - heavy.size() : 0;
+      size_t hi = std::min(m, light.size());
+      while (lo < hi) {
+        size_t i = (lo + hi) / 2;
+        if (light_first(i, m - i - 1))
+          lo = i + 1;
+        else
+          hi = i;
+      }
+      return lo;
+    }
+
+  public:
+    alias_sweep(const Weight *w, size_t k, thread_pool *pool): w(w), k(k), total(0) {
+      size_t blocks = (k + alias_block - 1) / alias_block;
+      std::vector<sum_type> block_total(blocks), block_light(blocks);
+      std::vector<size_t> block_lights(blocks);
+
+      parallel_for(pool, 0, k, alias_block, [&](size_t lo, size_t hi) {
+        sum_type sum = 0;
+        for (size_t a = lo; a < hi; a ++)
+          sum += w[a];
+        block_total[lo / alias_block] = sum;
+      });
+      for (size_t b = 0; b < blocks; b ++)
+        total += block_total[b];
+
+      parallel_for(pool, 0, k, alias_block, [&](size_t lo, size_t hi) {
+        sum_type sum = 0;
+        size_t count = 0;
+        for (size_t a = lo; a < hi; a ++) {
+          if (is_light(w[a])) {
+            sum += w[a];
+            count ++;
+          }
+        }
+        block_light[lo / alias_block] = sum;
+        block_lights[lo / alias_block] = count;
+      });
+
+      std::vector<sum_type> light_start(blocks + 1, 0), heavy_start(blocks + 1, 0);
+      std::vector<size_t> light_index(blocks + 1, 0);
+      for (size_t b = 0; b < blocks; b ++) {
+        light_start[b + 1] = light_start[b] + block_light[b];
+        heavy_start[b + 1] = heavy_start[b] + (block_total[b] - block_light[b]);
+        light_index[b + 1] = light_index[b] + block_lights[b];
+      }
+
+      size_t lights = light_index[blocks];
+      light.resize(lights);
+      heavy.resize(k - lights);
+      light_sum.resize(lights + 1);
+      heavy_sum.resize(k - lights + 1);
+      light_sum[lights] = light_start[blocks];
+      heavy_sum[k - lights] = heavy_start[blocks];
+
+      parallel_for(pool, 0, k, alias_block, [&](size_t lo, size_t hi) {
+        size_t b = lo / alias_block;
+        size_t li = light_index[b];
+        size_t hj = lo - li;
+        sum_type ls = light_start[b];
+        sum_type hs = heavy_start[b];
+        for (size_t a = lo; a < hi; a ++) {
+          if (is_light(w[a])) {
+            light[li] = a;
+            light_sum[li ++] = ls;
+            ls += w[a];
+          } else {
+            heavy[hj] = a;
+            heavy_sum[hj ++] = hs;
+            hs += w[a];
+          }
+        }
+      });
+    }
+
+    sum_type sum() const {
+      return total;
+    }
+
+    /*
+     * Fills the slots from m to n of the merge. The keys are carried along
+     * from the state at m, and the remainder of the current heavy item is
+     * the excess of the heavy items so far less the deficit of the light
+     * ones. Thresholds are stored by set_threshold, in the units of the
+     * entry.
+     */
+    template<class Entry>
+    void fill(size_t m, size_t n, Entry *table) const {
+      size_t i = light_count(m);
+      size_t j = m - i;
+      key_type a_key = light_key(i);
+      key_type b_key = j < heavy.size() ? heavy_key(j) : 0;
+      const double slot = (double) total / k;
+
+      for (; m < n; m ++) {
+        bool last = j + 1 >= heavy.size();
+        if (i < light.size() && (last || a_key <= b_key)) {
+          uint32_t a = light[i ++];
+          set_threshold(table[a].main_p, (key_type) k * w[a], w[a]);
+          table[a].alt_i = heavy.empty() ? a : heavy[j];
+          a_key += (key_type) total - (key_type) k * w[a];
+        } else if (!last) {
+          uint32_t a = heavy[j ++];
+          key_type rest = b_key - a_key + total;
+          set_threshold(table[a].main_p, rest, (double) rest / k);
+          table[a].alt_i = heavy[j];
+          b_key += (key_type) k * w[heavy[j]] - total;
+        } else {
+          uint32_t a = heavy[j ++];
+          set_threshold(table[a].main_p, (key_type) total, slot);
+          table[a].alt_i = a;
+        }
+      }
+    }
+};
+
+#endif
@@ -0,0 +1,47 @@
+/*
+ * A minimal allocator returning storage aligned to a fixed boundary, used to
+ * place tree nodes and tables on cache line boundaries.
+ */
+#ifndef ALIGNED_H
+#define ALIGNED_H
+
+#include <cstdlib>
+#include <new>
+
+template<class T, size_t Align>
+struct aligned_allocator {
+  typedef T value_type;
+
+  template<class U>
+  struct rebind {
+    typedef aligned_allocator<U, Align> other;
+  };
+
+  aligned_allocator() {}
+
+  template<class U>
+  aligned_allocator(const aligned_allocator<U, Align>&) {}
+
+  T *allocate(size_t n) {
+    void *ptr;
+    if (posix_memalign(&ptr, Align, n * sizeof(T)) != 0)
+      throw std::bad_alloc();
+    return static_cast<T*>(ptr);
+  }
+
+  void deallocate(T *ptr, size_t) {
+    free(ptr);
+  }
+};
+
+template<class T, class U, size_t Align>
+bool operator==(const aligned_allocator<T, Align>&, const aligned_allocator<U, Align>&) {
+  return true;
+}
+
+template<class T, class U, size_t Align>
+bool operator!=(const aligned_allocator<T, Align>&, const aligned_allocator<U, Align>&) {
+  return false;
+}
+
+#endif
@@ -0,0 +1,430 @@
+#include <algorithm>
+#include <cstring>
+#include "batch_vose.h"
+#include "cpu.h"
+
+#ifdef SAMPLING_X86
+#include <immintrin.h>
+#endif
+
+/*
+ * Rows are built in groups of this many, one per lane. The work arrays of a
+ * group interleave its rows, so item a of lane l is at a * build_lanes + l.
+ */
+static const int build_lanes = 8;
+
+struct build_group {
+  std::vector<double> w;
+  std::vector<int> light;
+  std::vector<int> heavy;
+  int light_count[build_lanes];
+  int heavy_count[build_lanes];
+
+  explicit build_group(int k): w(k * build_lanes), light(k * build_lanes), heavy(k * build_lanes) {}
+};
+
+typedef void (*build_kernel)(build_group& group, int k, int lanes, float *main_p, int *alt_i);
+
+/*
+ * Loads a group of rows into the work arrays as doubles. Lanes beyond the
+ * given rows are filled with uniform rows.
+ */
+template<class Weight>
+static void load_group(const Weight *rows, int lanes, int k, build_group& group) {
+  for (int l = 0; l < build_lanes; l ++) {
+    for (int a = 0; a < k; a ++)
+      group.w[a * build_lanes + l] = l < lanes ? rows[(size_t) l * k + a] : 1.0;
+  }
+}
+
+/*
+ * Scales each row to a mean weight of one and lists its light and heavy
+ * items. The heaviest item is always listed as heavy, so that rounding cannot
+ * leave a row without one, and a row whose weights are all zero is taken to
+ * be uniform. Both lists are written at every item and only the count of the
+ * matching one advanced, so the unpredictable comparisons do not branch.
+ */
+static void partition_scalar(build_group& group, int k) {
+  for (int l = 0; l < build_lanes; l ++) {
+    double *w = group.w.data() + l;
+    double total = 0;
+    double max = 0;
+    int heaviest = 0;
+    for (int a = 0; a < k; a ++) {
+      total += w[a * build_lanes];
+      bool more = w[a * build_lanes] > max;
+      heaviest = more ? a : heaviest;
+      max = more ? w[a * build_lanes] : max;
+    }
+
+    const double scale = total > 0 ? k / total : 0;
+    int lights = 0;
+    int heavies = 0;
+    for (int a = 0; a < k; a ++) {
+      double x = total > 0 ? w[a * build_lanes] * scale : 1.0;
+      int light = (x < 1) & (a != heaviest);
+      w[a * build_lanes] = x;
+      group.light[lights * build_lanes + l] = a;
+      group.heavy[heavies * build_lanes + l] = a;
+      lights += light;
+      heavies += 1 - light;
+    }
+    group.light_count[l] = lights;
+    group.heavy_count[l] = heavies;
+  }
+}
+
+/*
+ * Each step fills one slot. While light items remain, the next one is
+ * aliased to the current heavy item, whose residual weight drops by what the
+ * light item leaves of its slot. Once the residual falls below one and
+ * another heavy item remains, the current heavy item is instead filled with
+ * its residual and aliased to the next, which takes over the shortfall.
+ * Heavy items with a residual of one fill their own slots.
+ */
+static void sweep_scalar(const build_group& group, int k, int lanes, float *main_p, int *alt_i) {
+  for (int l = 0; l < lanes; l ++) {
+    const double *w = group.w.data() + l;
+    const int *light = group.light.data() + l;
+    const int *heavy = group.heavy.data() + l;
+    float *p = main_p + (size_t) l * k;
+    int *alt = alt_i + (size_t) l * k;
+
+    int li = 0;
+    int hi = 0;
+    int j = heavy[0];
+    double r = w[j * build_lanes];
+
+    for (int step = 0; step < k; step ++) {
+      bool have_light = li < group.light_count[l];
+      bool more_heavy = hi + 1 < group.heavy_count[l];
+      if (have_light && (r >= 1 || !more_heavy)) {
+        int i = light[li * build_lanes];
+        p[i] = w[i * build_lanes];
+        alt[i] = j;
+        r -= 1 - w[i * build_lanes];
+        li ++;
+      } else {
+        bool split = r < 1 && more_heavy;
+        int next = more_heavy ? heavy[(hi + 1) * build_lanes] : j;
+        p[j] = split ? r : 1;
+        alt[j] = split ? next : j;
+        r = w[next * build_lanes] - (1 - r);
+        j = next;
+        hi ++;
+      }
+    }
+  }
+}
+
+static void build_scalar(build_group& group, int k, int lanes, float *main_p, int *alt_i) {
+  partition_scalar(group, k);
+  sweep_scalar(group, k, lanes, main_p, alt_i);
+}
+
+/*
+ * Draws are resolved in the same way as vose::sample_n, with the slot found
+ * from the row and the high bits of the word.
+ */
+static const size_t sample_block = 256;
+
+typedef void (*sample_kernel)(const float *main_p, const int *alt_i, int k, const int *rows, const uint64_t *bits, int *out, size_t n);
+
+static void sample_block_scalar(const float *main_p, const int *alt_i, int k, const int *rows, const uint64_t *bits, int *out, size_t n) {
+  for (size_t i = 0; i < n; i ++) {
+    uint64_t mantissa = (bits[i] >> 12) | 0x3FF0000000000000ULL;
+    double u;
+    std::memcpy(&u, &mantissa, sizeof(u));
+    double x = (u - 1.0) * k;
+    int a = x;
+    size_t e = (size_t) rows[i] * k + a;
+
+    out[i] = x - a < main_p[e] ? a : alt_i[e];
+  }
+}
+
+#ifdef SAMPLING_X86
+/*
+ * The lanes of a vector index the interleaved work arrays at
+ * item * build_lanes + lane.
+ */
+__attribute__((target("avx2,avx512f,avx512vl")))
+static inline __m256i lane_index(__m256i item, __m256i lane) {
+  return _mm256_add_epi32(_mm256_slli_epi32(item, 3), lane);
+}
+
+/*
+ * The scalar partition, with the lists written by masked scatters.
+ */
+__attribute__((target("avx2,avx512f,avx512vl")))
+static void partition_avx512(build_group& group, int k) {
+  static_assert(build_lanes == 8, "kernel builds eight rows at once");
+  double *w = group.w.data();
+
+  const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  const __m256i one_i = _mm256_set1_epi32(1);
+  const __m512d one = _mm512_set1_pd(1.0);
+
+  __m512d total = _mm512_setzero_pd();
+  __m512d max = _mm512_setzero_pd();
+  __m256i heaviest = _mm256_setzero_si256();
+  for (int a = 0; a < k; a ++) {
+    __m512d x = _mm512_loadu_pd(w + a * build_lanes);
+    total = _mm512_add_pd(total, x);
+    __mmask8 more = _mm512_cmp_pd_mask(x, max, _CMP_GT_OQ);
+    heaviest = _mm256_mask_blend_epi32(more, heaviest, _mm256_set1_epi32(a));
+    max = _mm512_mask_blend_pd(more, max, x);
+  }
+
+  __mmask8 positive = _mm512_cmp_pd_mask(total, _mm512_setzero_pd(), _CMP_GT_OQ);
+  __m512d scale = _mm512_maskz_div_pd(positive, _mm512_set1_pd(k), total);
+  __m256i lights = _mm256_setzero_si256();
+  __m256i heavies = _mm256_setzero_si256();
+  for (int a = 0; a < k; a ++) {
+    __m512d x = _mm512_mask_blend_pd(positive, one, _mm512_mul_pd(_mm512_loadu_pd(w + a * build_lanes), scale));
+    __m256i item = _mm256_set1_epi32(a);
+    __mmask8 light = _mm512_cmp_pd_mask(x, one, _CMP_LT_OQ) & ~_mm256_cmpeq_epi32_mask(item, heaviest);
+    _mm512_storeu_pd(w + a * build_lanes, x);
+    _mm256_mask_i32scatter_epi32(group.light.data(), light, lane_index(lights, lane), item, 4);
+    _mm256_mask_i32scatter_epi32(group.heavy.data(), ~light, lane_index(heavies, lane), item, 4);
+    lights = _mm256_mask_add_epi32(lights, light, lights, one_i);
+    heavies = _mm256_mask_add_epi32(heavies, ~light, heavies, one_i);
+  }
+  _mm256_storeu_si256((__m256i*) group.light_count, lights);
+  _mm256_storeu_si256((__m256i*) group.heavy_count, heavies);
+}
+
+/*
+ * The scalar sweep, with the branches replaced by masks. Lanes beyond the
+ * group's rows hold uniform rows and are masked out of the stores.
+ */
+__attribute__((target("avx2,avx512f,avx512vl")))
+static void sweep_avx512(const build_group& group, int k, int lanes, float *main_p, int *alt_i) {
+  const double *w = group.w.data();
+  const int *light = group.light.data();
+  const int *heavy = group.heavy.data();
+
+  const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  const __m256i one_i = _mm256_set1_epi32(1);
+  const __m512d one = _mm512_set1_pd(1.0);
+  const __m256i light_count = _mm256_loadu_si256((const __m256i*) group.light_count);
+  const __m256i heavy_count = _mm256_loadu_si256((const __m256i*) group.heavy_count);
+  const __m256i row_start = _mm256_mullo_epi32(lane, _mm256_set1_epi32(k));
+  const __mmask8 active = (1 << lanes) - 1;
+
+  __m256i li = _mm256_setzero_si256();
+  __m256i hi = _mm256_setzero_si256();
+  __m256i j = _mm256_loadu_si256((const __m256i*) heavy);
+  __m512d r = _mm512_i32gather_pd(lane_index(j, lane), w, 8);
+
+  for (int step = 0; step < k; step ++) {
+    __m256i hi_next = _mm256_add_epi32(hi, one_i);
+    __mmask8 have_light = _mm256_cmplt_epi32_mask(li, light_count);
+    __mmask8 more_heavy = _mm256_cmplt_epi32_mask(hi_next, heavy_count);
+    __mmask8 full = _mm512_cmp_pd_mask(r, one, _CMP_GE_OQ);
+    __mmask8 take_light = have_light & (full | ~more_heavy);
+    __mmask8 split = ~take_light & ~full & more_heavy;
+
+    __m256i i = _mm256_mmask_i32gather_epi32(_mm256_setzero_si256(), have_light, lane_index(li, lane), light, 4);
+    __m512d wi = _mm512_mask_i32gather_pd(_mm512_setzero_pd(), have_light, lane_index(i, lane), w, 8);
+    __m256i next = _mm256_mmask_i32gather_epi32(j, more_heavy, lane_index(hi_next, lane), heavy, 4);
+    __m512d wn = _mm512_i32gather_pd(lane_index(next, lane), w, 8);
+
+    __m256i slot = _mm256_add_epi32(row_start, _mm256_mask_blend_epi32(take_light, j, i));
+    __m512d p = _mm512_mask_blend_pd(take_light, _mm512_mask_blend_pd(split, one, r), wi);
+    __m256i alt = _mm256_mask_blend_epi32(split, j, next);
+    _mm256_mask_i32scatter_ps(main_p, active, slot, _mm512_cvtpd_ps(p), 4);
+    _mm256_mask_i32scatter_epi32(alt_i, active, slot, alt, 4);
+
+    r = _mm512_mask_blend_pd(take_light, _mm512_sub_pd(wn, _mm512_sub_pd(one, r)), _mm512_sub_pd(r, _mm512_sub_pd(one, wi)));
+    li = _mm256_mask_add_epi32(li, take_light, li, one_i);
+    hi = _mm256_mask_add_epi32(hi, ~take_light, hi, one_i);
+    j = _mm256_mask_blend_epi32(take_light, next, j);
+  }
+}
+
+__attribute__((target("avx2,avx512f,avx512vl")))
+static void build_avx512(build_group& group, int k, int lanes, float *main_p, int *alt_i) {
+  partition_avx512(group, k);
+  sweep_avx512(group, k, lanes, main_p, alt_i);
+}
+
+__attribute__((target("avx2")))
+static void sample_block_avx2(const float *main_p, const int *alt_i, int k, const int *rows, const uint64_t *bits, int *out, size_t n) {
+  const __m256i exponent = _mm256_set1_epi64x(0x3FF0000000000000LL);
+  const __m256d one = _mm256_set1_pd(1.0);
+  const __m256d kd = _mm256_set1_pd(k);
+  const __m128i ki = _mm_set1_epi32(k);
+  const __m256i pack = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i r = _mm256_loadu_si256((const __m256i*) (bits + i));
+    __m256d u = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(_mm256_srli_epi64(r, 12), exponent)), one);
+    __m256d x = _mm256_mul_pd(u, kd);
+    __m128i a = _mm256_cvttpd_epi32(x);
+    __m256d b = _mm256_sub_pd(x, _mm256_cvtepi32_pd(a));
+    __m128i e = _mm_add_epi32(_mm_mullo_epi32(_mm_loadu_si128((const __m128i*) (rows + i)), ki), a);
+
+    __m256d p = _mm256_cvtps_pd(_mm_i32gather_ps(main_p, e, 4));
+    __m128i alt = _mm_i32gather_epi32(alt_i, e, 4);
+    __m256i keep = _mm256_castpd_si256(_mm256_cmp_pd(b, p, _CMP_LT_OQ));
+    __m128i keep32 = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(keep, pack));
+
+    _mm_storeu_si128((__m128i*) (out + i), _mm_blendv_epi8(alt, a, keep32));
+  }
+
+  sample_block_scalar(main_p, alt_i, k, rows + i, bits + i, out + i, n - i);
+}
+
+__attribute__((target("avx2,avx512f,avx512vl")))
+static void sample_block_avx512(const float *main_p, const int *alt_i, int k, const int *rows, const uint64_t *bits, int *out, size_t n) {
+  const __m512i exponent = _mm512_set1_epi64(0x3FF0000000000000LL);
+  const __m512d one = _mm512_set1_pd(1.0);
+  const __m512d kd = _mm512_set1_pd(k);
+  const __m256i ki = _mm256_set1_epi32(k);
+
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m512i r = _mm512_loadu_si512((const void*) (bits + i));
+    __m512d u = _mm512_sub_pd(_mm512_castsi512_pd(_mm512_or_si512(_mm512_srli_epi64(r, 12), exponent)), one);
+    __m512d x = _mm512_mul_pd(u, kd);
+    __m256i a = _mm512_cvttpd_epi32(x);
+    __m512d b = _mm512_sub_pd(x, _mm512_cvtepi32_pd(a));
+    __m256i e = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_loadu_si256((const __m256i*) (rows + i)), ki), a);
+
+    __m512d p = _mm512_cvtps_pd(_mm256_i32gather_ps(main_p, e, 4));
+    __m256i alt = _mm256_i32gather_epi32(alt_i, e, 4);
+    __mmask8 keep = _mm512_cmp_pd_mask(b, p, _CMP_LT_OQ);
+
+    _mm256_storeu_si256((__m256i*) (out + i), _mm256_mask_blend_epi32(keep, alt, a));
+  }
+
+  sample_block_scalar(main_p, alt_i, k, rows + i, bits + i, out + i, n - i);
+}
+#endif
+
+static build_kernel select_build_kernel() {
+#ifdef SAMPLING_X86
+  if (cpu_has_avx512())
+    return build_avx512;
+#endif
+  return build_scalar;
+}
+
+static sample_kernel select_sample_kernel() {
+#ifdef SAMPLING_X86
+  if (cpu_has_avx512())
+    return sample_block_avx512;
+  if (cpu_has_avx2())
+    return sample_block_avx2;
+#endif
+  return sample_block_scalar;
+}
+
+template<class URBG, class Weight, class Index>
+basic_batch_vose<URBG, Weight, Index>::basic_batch_vose(const std::vector<Weight>& weights, int k): basic_batch_vose(weights, k, random_seed()) {
+}
+
+template<class URBG, class Weight, class Index>
+basic_batch_vose<URBG, Weight, Index>::basic_batch_vose(const std::vector<Weight>& weights, int k, uint64_t seed): basic_batch_vose(weights, k, URBG(seed)) {
+}
+
+/*
+ * Builds the tables of weights.size() / k rows, given one after another.
+ */
+template<class URBG, class Weight, class Index>
+basic_batch_vose<URBG, Weight, Index>::basic_batch_vose(const std::vector<Weight>& weights, int k, const URBG& engine):
+  row_count(weights.size() / k), k(k), main_p(row_count * k), alt_i(row_count * k), gen(engine) {
+  build(weights);
+}
+
+/*
+ * Builds the tables of weights.size() / k rows, a group of lanes at a time.
+ */
+template<class Weight>
+static void build_rows(build_kernel kernel, const std::vector<Weight>& weights, int k, float *main_p, int *alt_i) {
+  const size_t rows = weights.size() / k;
+  build_group group(k);
+
+  for (size_t first = 0; first < rows; first += build_lanes) {
+    int lanes = std::min<size_t>(build_lanes, rows - first);
+    load_group(weights.data() + first * k, lanes, k, group);
+    kernel(group, k, lanes, main_p + first * k, alt_i + first * k);
+  }
+}
+
+template<class URBG, class Weight, class Index>
+void basic_batch_vose<URBG, Weight, Index>::build(const std::vector<Weight>& weights) {
+  static const build_kernel kernel = select_build_kernel();
+  build_rows(kernel, weights, k, main_p.data(), reinterpret_cast<int*>(alt_i.data()));
+}
+
+template<class URBG, class Weight, class Index>
+bool basic_batch_vose<URBG, Weight, Index>::build_with(const std::vector<Weight>& weights, int k, bool vector, float *main_p, Index *alt_i) {
+  build_kernel kernel = build_scalar;
+  if (vector) {
+#ifdef SAMPLING_X86
+    if (!cpu_has_avx512())
+      return false;
+    kernel = build_avx512;
+#else
+    return false;
+#endif
+  }
+  build_rows(kernel, weights, k, main_p, reinterpret_cast<int*>(alt_i));
+  return true;
+}
+
+template<class URBG, class Weight, class Index>
+size_t basic_batch_vose<URBG, Weight, Index>::rows() const {
+  return row_count;
+}
+
+template<class URBG, class Weight, class Index>
+int basic_batch_vose<URBG, Weight, Index>::size() const {
+  return k;
+}
+
+template<class URBG, class Weight, class Index>
+Index basic_batch_vose<URBG, Weight, Index>::sample(Index row) {
+  Index out;
+  sample(&row, &out, 1);
+  return out;
+}
+
+/*
+ * Draws one item from each of the n given rows.
+ */
+template<class URBG, class Weight, class Index>
+void basic_batch_vose<URBG, Weight, Index>::sample(const Index *rows, Index *out, size_t n) {
+  static_assert(URBG::min() == 0 && URBG::max() == UINT64_MAX, "batched sampling requires a 64 bit engine");
+  static const sample_kernel kernel = select_sample_kernel();
+
+  const int *alt = reinterpret_cast<const int*>(alt_i.data());
+  uint64_t bits[sample_block];
+
+  while (n > 0) {
+    size_t block = std::min(n, sample_block);
+    for (size_t i = 0; i < block; i ++)
+      bits[i] = gen();
+
+    kernel(main_p.data(), alt, k, reinterpret_cast<const int*>(rows), bits, reinterpret_cast<int*>(out), block);
+    rows += block;
+    out += block;
+    n -= block;
+  }
+}
+
+template<class URBG, class Weight, class Index>
+std::vector<Index> basic_batch_vose<URBG, Weight, Index>::sample(const std::vector<Index>& rows) {
+  std::vector<Index> out(rows.size());
+  sample(rows.data(), out.data(), rows.size());
+  return out;
+}
+
+#define INSTANTIATE(URBG) template class basic_batch_vose<URBG>;
+SAMPLING_ENGINES(INSTANTIATE)
+
+#define INSTANTIATE_WEIGHTS(Weight, Index) template class basic_batch_vose<default_engine, Weight, Index>;
+SAMPLING_WEIGHT_TYPES(INSTANTIATE_WEIGHTS)
@@ -0,0 +1,75 @@
+/*
+ * Alias tables for many small distributions of the same size k, built and
+ * sampled together. This suits workloads that draw once or a few times from
+ * each of many rows, where constructing a vose per row would cost more in
+ * seeding its engine and allocating its table than in sampling.
+ *
+ * The tables are held as two arrays, thresholds and aliases, in which row r
+ * occupies entries r * k to r * k + k - 1. Thresholds are stored relative to
+ * the slot size of their row, so drawing needs no per-row total.
+ *
+ * Construction uses the sweeping form of Vose's method from Hübschle-Schneider
+ * and Sanders' "Parallel Weighted Random Sampling": the light and heavy items
+ * are listed, then a single pass fills one slot per step, either a light item
+ * aliased to the current heavy item or a heavy item that has become light.
+ * Every row takes exactly k steps without branching on the weights, so eight
+ * rows are built in lockstep in the lanes of a vector. Sampling takes a batch
+ * of row indices and resolves one draw per row with gathers, like
+ * vose::sample_n.
+ *
+ * A row whose weights are all zero is sampled uniformly. The number of rows
+ * times k must be below 2^31.
+ */
+#ifndef BATCH_VOSE_H
+#define BATCH_VOSE_H
+
+#include <random>
+#include <type_traits>
+#include <vector>
+#include "aligned.h"
+#include "rng.h"
+#include "weights.h"
+
+template<class URBG = default_engine, class Weight = uint64_t, class Index = int>
+class basic_batch_vose {
+  static_assert(std::is_unsigned<Weight>::value || std::is_floating_point<Weight>::value,
+                "weights must be unsigned integers or floating point");
+  static_assert(std::is_integral<Index>::value && sizeof(Index) == 4, "indices must be 32 bit integers");
+
+  private:
+    size_t row_count;
+    int k;
+    std::vector<float, aligned_allocator<float, 64>> main_p;
+    std::vector<Index, aligned_allocator<Index, 64>> alt_i;
+    URBG gen;
+
+    void build(const std::vector<Weight>& weights);
+
+  public:
+    typedef Weight weight_type;
+    typedef Index index_type;
+
+    basic_batch_vose(const std::vector<Weight>& weights, int k);
+    basic_batch_vose(const std::vector<Weight>& weights, int k, uint64_t seed);
+    basic_batch_vose(const std::vector<Weight>& weights, int k, const URBG& engine);
+
+    size_t rows() const;
+    int size() const;
+
+    /*
+     * Builds the tables of the given rows into main_p and alt_i with the
+     * scalar kernel, or with the vector kernel, which must give the same
+     * tables, rather than the one selected for the CPU. Returns false when
+     * the CPU lacks the vector kernel. Used to test the kernels against
+     * each other.
+     */
+    static bool build_with(const std::vector<Weight>& weights, int k, bool vector, float *main_p, Index *alt_i);
+
+    Index sample(Index row);
+    void sample(const Index *rows, Index *out, size_t n);
+    std::vector<Index> sample(const std::vector<Index>& rows);
+};
+
+typedef basic_batch_vose<> batch_vose;
+
+#endif
@@ -1,12 +1,32 @@
+#include <algorithm>
 #include <cassert>
 #include <chrono>
+#include <cstdio>
 #include <functional>
 #include <iostream>
+#include <malloc.h>
+#include <map>
+#include <memory>
 #include <random>
+#include <sstream>
+#include <string>
+#include <thread>
 #include <vector>
+#include "adaptive.h"
+#include "batch_vose.h"
+#include "bucket_sampler.h"
+#include "bwe.h"
+#include "concurrent_we.h"
+#include "dynamic_vose.h"
+#include "exact_vose.h"
+#include "fixed.h"
 #include "multi.h"
 #include "mvn.h"
+#include "perf_counters.h"
 #include "relles.h"
+#include "reservoir.h"
+#include "sharded.h"
+#include "thread_pool.h"
 #include "vose.h"
 #include "we.h"
 
@@ -21,6 +41,49 @@ static void polya_test(int n, int m) {
   }
 }
 
+/*
+ * Alternates between a static and a Polya workload, switching every quarter
+ * of the operations, as a workload whose update rate drifts over time.
+ */
+template<class C>
+static void drifting_test(int n, int m) {
+  std::vector<uint64_t> dist(m, 1);
+  C generator(dist);
+
+  for (int i = 0; i < n; i ++) {
+    int r = generator.sample();
+    if (i / (n / 4) % 2 == 1)
+      generator.delta_update(r, 1);
+  }
+}
+
+/*
+ * Sets n random weights in groups of b, one at a time or as batches.
+ */
+template<class C>
+static void update_test(int n, int m, int b) {
+  std::vector<uint64_t> dist(m, 1);
+  C generator(dist);
+  default_engine gen(1);
+
+  for (int i = 0; i < n; i ++)
+    generator.update(gen() % m, gen() % 1000);
+}
+
+template<class C>
+static void batch_update_test(int n, int m, int b) {
+  std::vector<uint64_t> dist(m, 1);
+  C generator(dist);
+  default_engine gen(1);
+  std::vector<std::pair<int, uint64_t>> batch(b);
+
+  for (int i = 0; i < n; i += b) {
+    for (auto &entry : batch)
+      entry = std::make_pair((int) (gen() % m), gen() % 1000);
+    generator.update_batch(batch);
+  }
+}
+
 template<class C>
 static void static_test(int n, int m) {
   std::vector<uint64_t> dist(m);
@@ -37,6 +100,99 @@ static void static_test(int n, int m) {
   }
 }
 
+template<class C>
+static void construction_test(int m) {
+  std::vector<typename C::weight_type> dist(m);
+  for (int i = 0; i < m; i ++)
+    dist[i] = i % 1000;
+
+  C generator(dist);
+}
+
+/*
+ * Returns the number of bytes a sampler holds on the heap once constructed.
+ */
+template<class C>
+static size_t footprint(int m) {
+  std::vector<typename C::weight_type> dist(m);
+  for (int i = 0; i < m; i ++)
+    dist[i] = i % 1000;
+
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 33)
+  struct mallinfo2 before = mallinfo2();
+  C *generator = new C(dist);
+  struct mallinfo2 after = mallinfo2();
+  delete generator;
+
+  return (after.uordblks + after.hblkhd) - (before.uordblks + before.hblkhd);
+#else
+  return 0;
+#endif
+}
+
+/*
+ * Builds a sampler and saves it as an image at the given path.
+ */
+template<class C>
+static void save_image(int m, const std::string& path) {
+  std::vector<typename C::weight_type> dist(m);
+  for (int i = 0; i < m; i ++)
+    dist[i] = i % 1000;
+
+  C(dist).save(path);
+}
+
+/*
+ * Maps a saved image and draws one sample, which faults in only the pages on
+ * its path.
+ */
+template<class C>
+static void map_test(const std::string& path) {
+  C generator(std::make_shared<mapped_image>(path));
+  generator.sample();
+}
+
+template<class C>
+static void static_batch_test(int n, int m) {
+  std::vector<uint64_t> dist(m);
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_int_distribution<> intd(0, m - 1);
+  for (int i = 0; i < m; i ++)
+    dist[i] = intd(mt);
+
+  C generator(dist);
+  std::vector<int> out(4096);
+
+  for (int i = 0; i < n; i += out.size()) {
+    generator.sample_n(out.data(), std::min<size_t>(out.size(), n - i));
+  }
+}
+
+/*
+ * Builds alias tables for rows of k weights, given one after another, and
+ * draws once from each row, either with a vose per row or with one
+ * batch_vose.
+ */
+static void per_row_vose_test(const std::vector<uint64_t>& weights, int k) {
+  uint64_t sum = 0;
+  for (size_t r = 0; r < weights.size() / k; r ++) {
+    vose generator(std::vector<uint64_t>(weights.begin() + r * k, weights.begin() + (r + 1) * k));
+    sum += generator.sample();
+  }
+
+  volatile uint64_t sink = sum;
+  (void) sink;
+}
+
+static void batch_vose_test(const std::vector<uint64_t>& weights, int k) {
+  batch_vose generator(weights, k);
+  std::vector<int> rows(weights.size() / k);
+  for (size_t r = 0; r < rows.size(); r ++)
+    rows[r] = r;
+  generator.sample(rows);
+}
+
 template<class C>
 static void without_replacement_test(int n, int m) {
   assert(n / m * m == n);
@@ -50,6 +206,41 @@ static void without_replacement_test(int n, int m) {
   }
 }
 
+/*
+ * Draws n items in total as groups of m distinct items from a distribution
+ * of size k, one at a time with each drawn item zeroed, then restored.
+ */
+template<class C>
+static void draw_distinct_test(int n, int m, int k) {
+  std::vector<uint64_t> dist(k);
+  for (int i = 0; i < k; i ++)
+    dist[i] = 1 + i % 1000;
+
+  C generator(dist);
+  std::vector<int> drawn(m);
+
+  for (int i = 0; i < n; i += m) {
+    for (int j = 0; j < m; j ++) {
+      drawn[j] = generator.sample();
+      generator.update(drawn[j], 0);
+    }
+    for (int j = 0; j < m; j ++)
+      generator.update(drawn[j], dist[drawn[j]]);
+  }
+}
+
+template<class C>
+static void sample_without_replacement_test(int n, int m, int k) {
+  std::vector<uint64_t> dist(k);
+  for (int i = 0; i < k; i ++)
+    dist[i] = 1 + i % 1000;
+
+  C generator(dist);
+
+  for (int i = 0; i < n; i += m)
+    generator.sample_without_replacement(m);
+}
+
 template<class C>
 static void random_test(int n, int m, double k) {
   std::vector<uint64_t> dist(m, 1);
@@ -69,6 +260,48 @@ static void random_test(int n, int m, double k) {
   }
 }
 
+static void concurrent_polya_test(int n, int m, int threads) {
+  std::vector<uint64_t> dist(m, 1);
+  concurrent_we generator(dist);
+  std::vector<std::thread> workers;
+
+  for (int t = 0; t < threads; t ++) {
+    workers.emplace_back([&generator, n, threads]() {
+      for (int i = 0; i < n / threads; i ++) {
+        int r = generator.sample();
+        generator.delta_update(r, 1);
+      }
+    });
+  }
+
+  for (auto &worker : workers)
+    worker.join();
+}
+
+/*
+ * The same workload on a sampler split into 64 shards, whose updates are
+ * applied on the shared pool. The time includes applying every update.
+ */
+template<class C>
+static void sharded_polya_test(int n, int m, int threads) {
+  std::vector<typename C::weight_type> dist(m, 1);
+  C generator(dist, 64);
+  std::vector<std::thread> workers;
+
+  for (int t = 0; t < threads; t ++) {
+    workers.emplace_back([&generator, n, threads]() {
+      for (int i = 0; i < n / threads; i ++) {
+        auto r = generator.sample();
+        generator.delta_update(r, 1);
+      }
+    });
+  }
+
+  for (auto &worker : workers)
+    worker.join();
+  generator.flush();
+}
+
 static void multinomial_test(int n, int k, std::function<std::vector<uint64_t>(uint64_t n, const std::vector<long double>&)> func) {
   std::vector<long double> dist(k);
   std::random_device rd;
@@ -87,6 +320,20 @@ static void multinomial_test(int n, int k, std::function<std::vector<uint64_t>(u
   func(n, dist);
 }
 
+static void dense_multinomial_test(uint64_t n, int k, std::function<std::vector<uint64_t>(uint64_t n, const std::vector<long double>&)> func) {
+  std::vector<long double> dist(k, 1.0L / k);
+  func(n, dist);
+}
+
+static void stream_multinomial_test(uint64_t n, int k) {
+  uint64_t nonzero = 0;
+  btpe_stream(n, k, [k](uint64_t i) { return 1.0L / k; }, [&nonzero](uint64_t i, uint64_t count) { nonzero ++; }, thread_engine());
+}
+
+static void parallel_multinomial_test(uint64_t n, const std::vector<long double>& dist, thread_pool& pool) {
+  parallel_btpe(n, dist, random_seed(), pool);
+}
+
 template<class F, class ...Args>
 static double benchmark(int n, F& func, Args&& ...args) {
   auto begin = std::chrono::high_resolution_clock::now();
@@ -99,21 +346,93 @@ static double benchmark(int n, F& func, Args&& ...args) {
   return secs.count() / n;
 }
 
+/*
+ * Streams n items through a weighted reservoir of m, in batches of 4096
+ * weights, and through one reservoir per thread of the pool, each fed an
+ * equal part of the stream, merged at the end.
+ */
+static const size_t reservoir_batch = 4096;
+
+static std::vector<uint64_t> reservoir_weights() {
+  std::vector<uint64_t> weights(reservoir_batch);
+  for (size_t i = 0; i < weights.size(); i ++)
+    weights[i] = 1 + (i * 7919) % 1000;
+  return weights;
+}
+
+static void reservoir_test(uint64_t n, int m) {
+  static const std::vector<uint64_t> weights = reservoir_weights();
+  reservoir sample(m);
+  for (uint64_t first = 0; first < n; first += reservoir_batch)
+    sample.add_batch(first, weights.data(), reservoir_batch);
+}
+
+static void parallel_reservoir_test(uint64_t n, int m, thread_pool& pool) {
+  static const std::vector<uint64_t> weights = reservoir_weights();
+  uint64_t batches = n / reservoir_batch;
+  std::vector<reservoir> parts;
+  for (unsigned t = 0; t < pool.size(); t ++)
+    parts.emplace_back(m);
+  parallel_for(pool, 0, parts.size(), 1, [&](size_t lo, size_t hi) {
+    for (uint64_t b = batches * lo / parts.size(); b < batches * hi / parts.size(); b ++)
+      parts[lo].add_batch(b * reservoir_batch, weights.data(), reservoir_batch);
+  });
+
+  reservoir merged(m);
+  for (const reservoir &part : parts)
+    merged.merge(part);
+}
+
+template<class URBG>
+static void rng_test(int n) {
+  URBG gen(random_seed());
+  uint64_t sum = 0;
+  for (int i = 0; i < n; i ++)
+    sum += gen();
+
+  volatile uint64_t sink = sum;
+  (void) sink;
+}
+
 static void multinomial_battery() {
   int a = 10;
   std::vector<int> ks = { 10, 100000 };
+  default_engine gen(random_seed());
+  auto btpe_gen = [&gen](uint64_t n, const std::vector<long double>& dist) { return btpe(n, dist, gen); };
+  auto relles_gen = [&gen](uint64_t n, const std::vector<long double>& dist) { return relles(n, dist, gen); };
+  auto relles_enhanced_gen = [&gen](uint64_t n, const std::vector<long double>& dist) { return relles_enhanced(n, dist, gen); };
 
   for (int k : ks) {
     for (uint64_t n = 10; n <= 100000000000; n *= 10) {
       std::cout << "k = " << k << ", n = " << n << "\n";
-      std::cout << "  BTPE " << benchmark(a, multinomial_test, n, k, btpe) << "\n";
-      std::cout << "  Relles " << benchmark(a, multinomial_test, n, k, relles) << "\n";
-      std::cout << "  Relles enhanced " << benchmark(a, multinomial_test, n, k, relles_enhanced) << "\n";
+      std::cout << "  BTPE " << benchmark(a, multinomial_test, n, k, btpe_gen) << "\n";
+      std::cout << "  Relles " << benchmark(a, multinomial_test, n, k, relles_gen) << "\n";
+      std::cout << "  Relles enhanced " << benchmark(a, multinomial_test, n, k, relles_enhanced_gen) << "\n";
     }
   }
   std::cout <<  "" << "\n";
 }
 
+/*
+ * Compares the vector returning multinomial samplers with the streaming
+ * interface at large k, where most counts are zero.
+ */
+static void stream_battery() {
+  int a = 3;
+  int k = 10000000;
+  default_engine gen(random_seed());
+  auto btpe_gen = [&gen](uint64_t n, const std::vector<long double>& dist) { return btpe(n, dist, gen); };
+  auto relles_gen = [&gen](uint64_t n, const std::vector<long double>& dist) { return relles(n, dist, gen); };
+
+  for (uint64_t n = 10; n <= 1000000; n *= 100) {
+    std::cout << "k = " << k << ", n = " << n << "\n";
+    std::cout << "  BTPE " << benchmark(a, dense_multinomial_test, n, k, btpe_gen) << "\n";
+    std::cout << "  Relles " << benchmark(a, dense_multinomial_test, n, k, relles_gen) << "\n";
+    std::cout << "  BTPE (streaming) " << benchmark(a, stream_multinomial_test, n, k) << "\n";
+  }
+  std::cout <<  "" << "\n";
+}
+
 static void categorical_battery() {
   int n = 50;
 
@@ -121,16 +440,36 @@ static void categorical_battery() {
     int m = i;
     std::cout << m << ":\n";
     std::cout << "  Static WE " << benchmark(n, static_test<we>, 1000000, m) << "\n";
+    std::cout << "  Static BWE " << benchmark(n, static_test<bwe>, 1000000, m) << "\n";
     std::cout << "  Static MVN " << benchmark(n, static_test<mvn>, 1000000, m) << "\n";
+    std::cout << "  Static Bucket " << benchmark(n, static_test<bucket_sampler>, 1000000, m) << "\n";
+    std::cout << "  Static Adaptive " << benchmark(n, static_test<adaptive>, 1000000, m) << "\n";
     std::cout << "  Static Vose " << benchmark(n, static_test<vose>, 1000000, m) << "\n";
+    std::cout << "  Static Vose (batched) " << benchmark(n, static_batch_test<vose>, 1000000, m) << "\n";
+    std::cout << "  Static Exact Vose " << benchmark(n, static_test<exact_vose>, 1000000, m) << "\n";
   }
 
   for (int i = 10; i <= 1000; i *= 10) {
     int m = i;
     std::cout << m << ":\n";
     std::cout << "  Polya WE " << benchmark(n, polya_test<we>, 1000000, m) << "\n";
+    std::cout << "  Polya BWE " << benchmark(n, polya_test<bwe>, 1000000, m) << "\n";
     std::cout << "  Polya MVN " << benchmark(n, polya_test<mvn>, 1000000, m) << "\n";
+    std::cout << "  Polya Bucket " << benchmark(n, polya_test<bucket_sampler>, 1000000, m) << "\n";
+    std::cout << "  Polya Adaptive " << benchmark(n, polya_test<adaptive>, 1000000, m) << "\n";
     std::cout << "  Polya Vose " << benchmark(5, polya_test<vose>, 1000000, m) << "\n";
+    std::cout << "  Polya Dynamic Vose " << benchmark(n, polya_test<dynamic_vose>, 1000000, m) << "\n";
+  }
+
+  for (int i = 1000000; i <= 10000000; i *= 10) {
+    int m = i;
+    std::cout << m << ":\n";
+    std::cout << "  Static WE " << benchmark(5, static_test<we>, 10000000, m) << "\n";
+    std::cout << "  Static BWE " << benchmark(5, static_test<bwe>, 10000000, m) << "\n";
+    std::cout << "  Polya WE " << benchmark(5, polya_test<we>, 10000000, m) << "\n";
+    std::cout << "  Polya BWE " << benchmark(5, polya_test<bwe>, 10000000, m) << "\n";
+    std::cout << "  Static Bucket " << benchmark(5, static_test<bucket_sampler>, 10000000, m) << "\n";
+    std::cout << "  Polya Bucket " << benchmark(5, polya_test<bucket_sampler>, 10000000, m) << "\n";
   }
 
   for (int i = 10; i <= 1000; i *= 10) {
@@ -138,7 +477,21 @@ static void categorical_battery() {
     std::cout << m << ":\n";
     std::cout << "  Without Replacement WE " << benchmark(n, without_replacement_test<we>, 1000000, m) << "\n";
     std::cout << "  Without Replacement MVN " << benchmark(n, without_replacement_test<mvn>, 1000000, m) << "\n";
+    std::cout << "  Without Replacement Bucket " << benchmark(n, without_replacement_test<bucket_sampler>, 1000000, m) << "\n";
     std::cout << "  Without Replacement Vose " << benchmark(5, without_replacement_test<vose>, 1000000, m) << "\n";
+    std::cout << "  Without Replacement Dynamic Vose " << benchmark(n, without_replacement_test<dynamic_vose>, 1000000, m) << "\n";
+  }
+
+  for (int m = 10; m <= 100000; m *= 100) {
+    int k = 1000000;
+    std::cout << k << ", " << m << " distinct:\n";
+    std::cout << "  Sample and Zero WE " << benchmark(5, draw_distinct_test<we>, 1000000, m, k) << "\n";
+    std::cout << "  Sample Without Replacement WE " << benchmark(5, sample_without_replacement_test<we>, 1000000, m, k) << "\n";
+    std::cout << "  Sample Without Replacement BWE " << benchmark(5, sample_without_replacement_test<bwe>, 1000000, m, k) << "\n";
+    std::cout << "  Sample Without Replacement MVN " << benchmark(5, sample_without_replacement_test<mvn>, 1000000, m, k) << "\n";
+    std::cout << "  Sample Without Replacement Bucket " << benchmark(5, sample_without_replacement_test<bucket_sampler>, 1000000, m, k) << "\n";
+    std::cout << "  Sample Without Replacement Vose " << benchmark(5, sample_without_replacement_test<vose>, 1000000, m, k) << "\n";
+    std::cout << "  Sample Without Replacement Dynamic Vose " << benchmark(5, sample_without_replacement_test<dynamic_vose>, 1000000, m, k) << "\n";
   }
 
   for (int i = 10; i <= 1000; i *= 10) {
@@ -146,13 +499,714 @@ static void categorical_battery() {
     std::cout << m << ":\n";
     std::cout << "  Random (k = 0.1) WE " << benchmark(n, random_test<we>, 1000000, m, 0.1) << "\n";
     std::cout << "  Random (k = 0.1) MVN " << benchmark(n, random_test<mvn>, 1000000, m, 0.1) << "\n";
+    std::cout << "  Random (k = 0.1) Bucket " << benchmark(n, random_test<bucket_sampler>, 1000000, m, 0.1) << "\n";
     std::cout << "  Random (k = 0.1) Vose " << benchmark(5, random_test<vose>, 1000000, m, 0.1) << "\n";
+    std::cout << "  Random (k = 0.1) Dynamic Vose " << benchmark(n, random_test<dynamic_vose>, 1000000, m, 0.1) << "\n";
   }
 }
 
+static void drifting_battery() {
+  int n = 10;
+
+  for (int m = 100; m <= 1000000; m *= 100) {
+    std::cout << m << " drifting:\n";
+    std::cout << "  Drifting WE " << benchmark(n, drifting_test<we>, 4000000, m) << "\n";
+    std::cout << "  Drifting MVN " << benchmark(n, drifting_test<mvn>, 4000000, m) << "\n";
+    std::cout << "  Drifting Adaptive " << benchmark(n, drifting_test<adaptive>, 4000000, m) << "\n";
+  }
+}
+
+static void batch_update_battery() {
+  int n = 5;
+
+  for (int m = 1000; m <= 1000000; m *= 1000) {
+    for (int b = 16; b <= m; b *= 16) {
+      std::cout << m << ", batches of " << b << ":\n";
+      std::cout << "  Updates WE " << benchmark(n, update_test<we>, 4000000, m, b) << "\n";
+      std::cout << "  Batched Updates WE " << benchmark(n, batch_update_test<we>, 4000000, m, b) << "\n";
+      std::cout << "  Updates MVN " << benchmark(n, update_test<mvn>, 4000000, m, b) << "\n";
+      std::cout << "  Batched Updates MVN " << benchmark(n, batch_update_test<mvn>, 4000000, m, b) << "\n";
+    }
+  }
+}
+
+static void construction_battery() {
+  int n = 10;
+
+  for (int i = 1000; i <= 1000000; i *= 10) {
+    int m = i;
+    std::cout << m << ":\n";
+    std::cout << "  Construction WE " << benchmark(n, construction_test<we>, m) << " (" << footprint<we>(m) << " bytes)\n";
+    std::cout << "  Construction WE (uint32_t) " << benchmark(n, construction_test<we32>, m) << " (" << footprint<we32>(m) << " bytes)\n";
+    save_image<we>(m, "benchmark_we.img");
+    std::cout << "  Mapped WE image " << benchmark(n, map_test<we>, "benchmark_we.img") << "\n";
+    std::cout << "  Construction BWE " << benchmark(n, construction_test<bwe>, m) << " (" << footprint<bwe>(m) << " bytes)\n";
+    std::cout << "  Construction MVN " << benchmark(n, construction_test<mvn>, m) << " (" << footprint<mvn>(m) << " bytes)\n";
+    std::cout << "  Construction Bucket " << benchmark(n, construction_test<bucket_sampler>, m) << " (" << footprint<bucket_sampler>(m) << " bytes)\n";
+    std::cout << "  Construction Vose " << benchmark(n, construction_test<vose>, m) << " (" << footprint<vose>(m) << " bytes)\n";
+    std::cout << "  Construction Vose (uint32_t) " << benchmark(n, construction_test<vose32>, m) << " (" << footprint<vose32>(m) << " bytes)\n";
+    std::cout << "  Construction Exact Vose " << benchmark(n, construction_test<exact_vose>, m) << " (" << footprint<exact_vose>(m) << " bytes)\n";
+    save_image<vose>(m, "benchmark_vose.img");
+    std::cout << "  Mapped Vose image " << benchmark(n, map_test<vose>, "benchmark_vose.img") << "\n";
+  }
+  std::remove("benchmark_we.img");
+  std::remove("benchmark_vose.img");
+  std::cout << "" << "\n";
+}
+
+/*
+ * Scaling of parallel WE and Vose construction with the number of pool
+ * threads, against the serial constructors.
+ */
+template<class C>
+static void parallel_construction_test(const std::vector<uint64_t>& dist, thread_pool& pool) {
+  C generator(dist, 1, pool);
+}
+
+template<class C>
+static void serial_construction_test(const std::vector<uint64_t>& dist) {
+  C generator(dist, 1);
+}
+
+static void parallel_construction_battery() {
+  int n = 3;
+  int max_threads = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<int> thread_counts;
+  for (int threads = 1; threads < max_threads; threads *= 2)
+    thread_counts.push_back(threads);
+  thread_counts.push_back(max_threads);
+
+  for (int m = 1000000; m <= 100000000; m *= 10) {
+    std::vector<uint64_t> dist(m);
+    for (int i = 0; i < m; i ++)
+      dist[i] = i % 1000;
+
+    std::cout << m << ":\n";
+    double we_base = benchmark(n, serial_construction_test<we>, dist);
+    double vose_base = benchmark(n, serial_construction_test<vose>, dist);
+    std::cout << "  Construction WE " << we_base << "\n";
+    for (int threads : thread_counts) {
+      thread_pool pool(threads);
+      double secs = benchmark(n, parallel_construction_test<we>, dist, pool);
+      std::cout << "  Parallel construction WE (" << threads << " threads) " << secs << " (" << we_base / secs << "x)\n";
+    }
+    std::cout << "  Construction Vose " << vose_base << "\n";
+    for (int threads : thread_counts) {
+      thread_pool pool(threads);
+      double secs = benchmark(n, parallel_construction_test<vose>, dist, pool);
+      std::cout << "  Parallel construction Vose (" << threads << " threads) " << secs << " (" << vose_base / secs << "x)\n";
+    }
+  }
+  std::cout << "" << "\n";
+}
+
+/*
+ * Per-row costs of building and drawing once from many small distributions.
+ */
+static void small_rows_battery() {
+  int n = 3;
+  int rows = 100000;
+
+  for (int k : { 8, 32, 256 }) {
+    std::vector<uint64_t> weights(rows * k);
+    for (size_t i = 0; i < weights.size(); i ++)
+      weights[i] = (i * 7919) % 1000;
+
+    std::cout << rows << " rows of " << k << ":\n";
+    std::cout << "  Per-row Vose build and sample " << benchmark(n, per_row_vose_test, weights, k) / rows << " per row\n";
+    std::cout << "  Batched Vose build and sample " << benchmark(n, batch_vose_test, weights, k) / rows << " per row\n";
+  }
+  std::cout << "" << "\n";
+}
+
+/*
+ * Throughput of the weighted reservoir, against the cost of the engine it
+ * draws from.
+ */
+static void reservoir_battery() {
+  int n = 5;
+  uint64_t items = 1ULL << 28;
+  int max_threads = std::max(1u, std::thread::hardware_concurrency());
+
+  std::cout << "Reservoir (" << items << " items):\n";
+  std::cout << "  xoshiro256++ per call " << benchmark(n, rng_test<xoshiro256pp>, 1000000) / 1000000 << "\n";
+  for (int m : { 100, 10000, 1000000 }) {
+    double secs = benchmark(n, reservoir_test, items, m);
+    std::cout << "  Reservoir (m = " << m << ") " << secs << " (" << secs / items << " per item)\n";
+    thread_pool pool(max_threads);
+    secs = benchmark(n, parallel_reservoir_test, items, m, pool);
+    std::cout << "  Merged reservoir (m = " << m << ", " << max_threads << " threads) " << secs << " (" << secs / items << " per item)\n";
+  }
+  std::cout << "" << "\n";
+}
+
+/*
+ * Compares the samplers over a compile-time number of items with the
+ * dynamic ones they specialize.
+ */
+template<size_t K>
+static void fixed_sizes(int n) {
+  std::cout << K << ":\n";
+  std::cout << "  Static WE " << benchmark(n, static_test<we>, 1000000, K) << "\n";
+  std::cout << "  Static Fixed WE " << benchmark(n, static_test<fixed_we<K>>, 1000000, K) << "\n";
+  std::cout << "  Static Vose " << benchmark(n, static_test<vose>, 1000000, K) << "\n";
+  std::cout << "  Static Fixed Vose " << benchmark(n, static_test<fixed_vose<K>>, 1000000, K) << "\n";
+  std::cout << "  Polya WE " << benchmark(n, polya_test<we>, 1000000, K) << "\n";
+  std::cout << "  Polya Fixed WE " << benchmark(n, polya_test<fixed_we<K>>, 1000000, K) << "\n";
+  std::cout << "  Polya Vose " << benchmark(5, polya_test<vose>, 1000000, K) << "\n";
+  std::cout << "  Polya Fixed Vose " << benchmark(5, polya_test<fixed_vose<K>>, 1000000, K) << "\n";
+}
+
+static void fixed_battery() {
+  int n = 20;
+
+  fixed_sizes<10>(n);
+  fixed_sizes<100>(n);
+  std::cout << "" << "\n";
+}
+
+/*
+ * Separates the cost of the random engine from the cost of the sampling
+ * algorithms, by timing the raw engines and then each sampler under each
+ * engine.
+ */
+static void rng_battery() {
+  int n = 50;
+  int m = 1000;
+
+  std::cout << "RNG:\n";
+  std::cout << "  mt19937_64 " << benchmark(n, rng_test<std::mt19937_64>, 1000000) << "\n";
+  std::cout << "  xoshiro256++ " << benchmark(n, rng_test<xoshiro256pp>, 1000000) << "\n";
+  std::cout << "  wyrand " << benchmark(n, rng_test<wyrand>, 1000000) << "\n";
+
+  std::cout << m << ":\n";
+  std::cout << "  Static WE (mt19937_64) " << benchmark(n, static_test<basic_we<std::mt19937_64>>, 1000000, m) << "\n";
+  std::cout << "  Static WE (xoshiro256++) " << benchmark(n, static_test<basic_we<xoshiro256pp>>, 1000000, m) << "\n";
+  std::cout << "  Static WE (wyrand) " << benchmark(n, static_test<basic_we<wyrand>>, 1000000, m) << "\n";
+  std::cout << "  Static MVN (mt19937_64) " << benchmark(n, static_test<basic_mvn<std::mt19937_64>>, 1000000, m) << "\n";
+  std::cout << "  Static MVN (xoshiro256++) " << benchmark(n, static_test<basic_mvn<xoshiro256pp>>, 1000000, m) << "\n";
+  std::cout << "  Static MVN (wyrand) " << benchmark(n, static_test<basic_mvn<wyrand>>, 1000000, m) << "\n";
+  std::cout << "  Static Vose (mt19937_64) " << benchmark(n, static_test<basic_vose<std::mt19937_64>>, 1000000, m) << "\n";
+  std::cout << "  Static Vose (xoshiro256++) " << benchmark(n, static_test<basic_vose<xoshiro256pp>>, 1000000, m) << "\n";
+  std::cout << "  Static Vose (wyrand) " << benchmark(n, static_test<basic_vose<wyrand>>, 1000000, m) << "\n";
+  std::cout << "" << "\n";
+}
+
+static void concurrent_battery() {
+  int n = 5;
+  int max_threads = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<int> thread_counts;
+  for (int threads = 1; threads < max_threads; threads *= 2)
+    thread_counts.push_back(threads);
+  thread_counts.push_back(max_threads);
+
+  for (int i = 10; i <= 1000000; i *= 100) {
+    int m = i;
+    std::cout << m << ":\n";
+    double base = benchmark(n, concurrent_polya_test, 1000000, m, 1);
+    for (int threads : thread_counts) {
+      double secs = threads == 1 ? base : benchmark(n, concurrent_polya_test, 1000000, m, threads);
+      std::cout << "  Polya Concurrent WE (" << threads << " threads) " << secs << " (" << base / secs << "x)\n";
+    }
+    double sharded_base = benchmark(n, sharded_polya_test<sharded_we>, 1000000, m, 1);
+    for (int threads : thread_counts) {
+      double secs = threads == 1 ? sharded_base : benchmark(n, sharded_polya_test<sharded_we>, 1000000, m, threads);
+      std::cout << "  Polya Sharded WE (" << threads << " threads) " << secs << " (" << sharded_base / secs << "x)\n";
+    }
+    double mvn_base = benchmark(n, sharded_polya_test<sharded_mvn>, 1000000, m, 1);
+    for (int threads : thread_counts) {
+      double secs = threads == 1 ? mvn_base : benchmark(n, sharded_polya_test<sharded_mvn>, 1000000, m, threads);
+      std::cout << "  Polya Sharded MVN (" << threads << " threads) " << secs << " (" << mvn_base / secs << "x)\n";
+    }
+  }
+}
+
+/*
+ * Scaling of the parallel splitting tree multinomial sampler with the
+ * number of pool threads, against sequential BTPE.
+ */
+static void parallel_multinomial_battery() {
+  int a = 3;
+  int k = 10000000;
+  int max_threads = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<int> thread_counts;
+  for (int threads = 1; threads < max_threads; threads *= 2)
+    thread_counts.push_back(threads);
+  thread_counts.push_back(max_threads);
+
+  default_engine gen(random_seed());
+  std::vector<long double> dist(k);
+  long double total = 0;
+  for (int i = 0; i < k; i ++) {
+    dist[i] = uniform01(gen);
+    total += dist[i];
+  }
+  for (int i = 0; i < k; i ++)
+    dist[i] /= total;
+
+  auto btpe_gen = [&gen](uint64_t n, const std::vector<long double>& dist) { return btpe(n, dist, gen); };
+
+  for (uint64_t n = 1000; n <= 1000000000; n *= 1000) {
+    std::cout << "k = " << k << ", n = " << n << "\n";
+    double base = benchmark(a, btpe_gen, n, dist);
+    std::cout << "  BTPE " << base << "\n";
+    for (int threads : thread_counts) {
+      thread_pool pool(threads);
+      double secs = benchmark(a, parallel_multinomial_test, n, dist, pool);
+      std::cout << "  Parallel BTPE (" << threads << " threads) " << secs << " (" << base / secs << "x)\n";
+    }
+  }
+  std::cout << "" << "\n";
+}
+
+/*
+ * The configurable driver. A single run builds one sampler for one scenario
+ * reps times, timing construction and the n operations of the scenario
+ * separately while reading the hardware counters over the operations, and
+ * then times every operation of one further run individually for latency
+ * percentiles. For the multinomial scenario construction is the generation
+ * of the distribution and each repetition is a single call.
+ */
+struct bench_config {
+  std::string sampler;
+  std::string scenario;
+  uint64_t k;
+  uint64_t n;
+  int reps;
+  uint64_t seed;
+  double update_rate;
+  uint64_t latency_ops;
+  unsigned threads;
+  bool json;
+
+  bench_config(): sampler("we"), scenario("static"), k(1000), n(1000000), reps(5), seed(1),
+                  update_rate(0.1), latency_ops(100000), threads(0), json(false) {}
+};
+
+struct bench_result {
+  std::vector<double> construction;
+  std::vector<double> sampling;
+  std::vector<double> latencies;
+  uint64_t ops;
+  double counters[perf_counters::count];
+  bool counted[perf_counters::count];
+  bool has_mvn_stats;
+  mvn_stats mvn;
+};
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double seconds_since(bench_clock::time_point begin) {
+  return std::chrono::duration<double>(bench_clock::now() - begin).count();
+}
+
+template<class C>
+static C* build(const std::vector<typename C::weight_type>& dist, uint64_t seed) {
+  return new C(dist, seed);
+}
+
+template<>
+concurrent_we* build<concurrent_we>(const std::vector<uint64_t>& dist, uint64_t seed) {
+  return new concurrent_we(dist);
+}
+
+/*
+ * Adds the statistics a sampler keeps to the result; only mvn keeps any.
+ */
+template<class C>
+static void collect_stats(const C& generator, bench_result& result) {
+}
+
+template<class URBG, class Weight, class Index>
+static void collect_stats(const basic_mvn<URBG, Weight, Index>& generator, bench_result& result) {
+  result.mvn += generator.stats();
+  result.has_mvn_stats = true;
+}
+
+/*
+ * One operation of a categorical scenario. The static and random scenarios
+ * sample, the Polya and without replacement scenarios sample and add or
+ * remove a unit of weight, and the random scenario instead sets a random
+ * weight at the configured rate.
+ */
+template<class C>
+struct categorical_op {
+  C &generator;
+  const bench_config &cfg;
+  default_engine gen;
+  std::bernoulli_distribution action;
+  std::uniform_int_distribution<uint64_t> idx;
+  uint64_t sink;
+
+  categorical_op(C &generator, const bench_config &cfg):
+    generator(generator), cfg(cfg), gen(cfg.seed), action(cfg.update_rate), idx(0, cfg.k - 1), sink(0) {}
+
+  void operator()() {
+    if (cfg.scenario == "polya") {
+      int r = generator.sample();
+      generator.delta_update(r, 1);
+    } else if (cfg.scenario == "without_replacement") {
+      int r = generator.sample();
+      generator.delta_update(r, -1);
+    } else if (cfg.scenario == "random" && action(gen)) {
+      generator.update(idx(gen), idx(gen));
+    } else {
+      sink += generator.sample();
+    }
+  }
+};
+
+static std::vector<uint64_t> scenario_weights(const bench_config& cfg) {
+  default_engine gen(cfg.seed);
+  std::vector<uint64_t> dist(cfg.k, 1);
+  if (cfg.scenario == "static") {
+    for (uint64_t &w : dist)
+      w = gen() % cfg.k;
+  } else if (cfg.scenario == "without_replacement") {
+    for (uint64_t &w : dist)
+      w = (cfg.n + cfg.k - 1) / cfg.k;
+  }
+  return dist;
+}
+
+template<class C>
+static void run_categorical(const bench_config& cfg, bench_result& result) {
+  std::vector<uint64_t> weights = scenario_weights(cfg);
+  std::vector<typename C::weight_type> dist(weights.begin(), weights.end());
+  perf_counters counters;
+
+  for (int rep = 0; rep < cfg.reps; rep ++) {
+    bench_clock::time_point begin = bench_clock::now();
+    C *generator = build<C>(dist, cfg.seed + rep);
+    result.construction.push_back(seconds_since(begin));
+
+    categorical_op<C> op(*generator, cfg);
+    begin = bench_clock::now();
+    counters.start();
+    for (uint64_t i = 0; i < cfg.n; i ++)
+      op();
+    counters.stop();
+    result.sampling.push_back(seconds_since(begin));
+
+    for (int c = 0; c < perf_counters::count; c ++)
+      result.counters[c] += counters.value((perf_counters::counter) c);
+    collect_stats(*generator, result);
+    delete generator;
+  }
+
+  C *generator = build<C>(dist, cfg.seed);
+  categorical_op<C> op(*generator, cfg);
+  for (uint64_t i = 0; i < std::min(cfg.n, cfg.latency_ops); i ++) {
+    bench_clock::time_point begin = bench_clock::now();
+    op();
+    result.latencies.push_back(seconds_since(begin) * 1e9);
+  }
+  delete generator;
+
+  result.ops = cfg.n * cfg.reps;
+  for (int c = 0; c < perf_counters::count; c ++)
+    result.counted[c] = counters.available((perf_counters::counter) c);
+}
+
+typedef std::function<void(uint64_t n, const std::vector<long double>& dist, default_engine& gen, thread_pool& pool)> multinomial_sampler;
+
+static const std::map<std::string, multinomial_sampler> multinomial_samplers = {
+  { "btpe", [](uint64_t n, const std::vector<long double>& dist, default_engine& gen, thread_pool& pool) { btpe(n, dist, gen); } },
+  { "btpe_stream", [](uint64_t n, const std::vector<long double>& dist, default_engine& gen, thread_pool& pool) {
+    uint64_t nonzero = 0;
+    btpe_stream(n, dist.begin(), dist.end(), [&nonzero](uint64_t i, uint64_t count) { nonzero ++; }, gen);
+  } },
+  { "parallel_btpe", [](uint64_t n, const std::vector<long double>& dist, default_engine& gen, thread_pool& pool) { parallel_btpe(n, dist, gen(), pool); } },
+  { "relles", [](uint64_t n, const std::vector<long double>& dist, default_engine& gen, thread_pool& pool) { relles(n, dist, gen); } },
+  { "relles_enhanced", [](uint64_t n, const std::vector<long double>& dist, default_engine& gen, thread_pool& pool) { relles_enhanced(n, dist, gen); } },
+  { "full_uniform", [](uint64_t n, const std::vector<long double>& dist, default_engine& gen, thread_pool& pool) { full_uniform(n, dist, gen); } },
+  { "full_uniform_bin_search", [](uint64_t n, const std::vector<long double>& dist, default_engine& gen, thread_pool& pool) { full_uniform_bin_search(n, dist, gen); } },
+  { "reverse_bin_search", [](uint64_t n, const std::vector<long double>& dist, default_engine& gen, thread_pool& pool) { reverse_bin_search(n, dist, gen); } },
+};
+
+static void run_multinomial(const bench_config& cfg, bench_result& result) {
+  const multinomial_sampler &sampler = multinomial_samplers.at(cfg.sampler);
+  default_engine gen(cfg.seed);
+  thread_pool pool(cfg.threads);
+  perf_counters counters;
+
+  for (int rep = 0; rep < cfg.reps; rep ++) {
+    bench_clock::time_point begin = bench_clock::now();
+    std::vector<long double> dist(cfg.k);
+    long double total = 0;
+    for (long double &p : dist) {
+      p = uniform01(gen);
+      total += p;
+    }
+    for (long double &p : dist)
+      p /= total;
+    result.construction.push_back(seconds_since(begin));
+
+    begin = bench_clock::now();
+    counters.start();
+    sampler(cfg.n, dist, gen, pool);
+    counters.stop();
+    result.sampling.push_back(seconds_since(begin));
+    result.latencies.push_back(result.sampling.back() * 1e9);
+
+    for (int c = 0; c < perf_counters::count; c ++)
+      result.counters[c] += counters.value((perf_counters::counter) c);
+  }
+
+  result.ops = cfg.reps;
+  for (int c = 0; c < perf_counters::count; c ++)
+    result.counted[c] = counters.available((perf_counters::counter) c);
+}
+
+typedef void (*categorical_runner)(const bench_config& cfg, bench_result& result);
+
+static const std::map<std::string, categorical_runner> categorical_samplers = {
+  { "we", run_categorical<we> },
+  { "we32", run_categorical<we32> },
+  { "bwe", run_categorical<bwe> },
+  { "concurrent_we", run_categorical<concurrent_we> },
+  { "mvn", run_categorical<mvn> },
+  { "mvn32", run_categorical<mvn32> },
+  { "bucket", run_categorical<bucket_sampler> },
+  { "vose", run_categorical<vose> },
+  { "vose32", run_categorical<vose32> },
+  { "dynamic_vose", run_categorical<dynamic_vose> },
+  { "exact_vose", run_categorical<exact_vose> },
+  { "exact_vose32", run_categorical<exact_vose32> },
+  { "adaptive", run_categorical<adaptive> },
+};
+
+/*
+ * Returns the nearest-rank percentile of sorted values.
+ */
+static double percentile(const std::vector<double>& sorted, double q) {
+  if (sorted.empty())
+    return 0;
+  size_t rank = std::ceil(q / 100 * sorted.size());
+  return sorted[std::min(sorted.size(), std::max<size_t>(rank, 1)) - 1];
+}
+
+static double mean(const std::vector<double>& values) {
+  double total = 0;
+  for (double v : values)
+    total += v;
+  return values.empty() ? 0 : total / values.size();
+}
+
+static double minimum(const std::vector<double>& values) {
+  return values.empty() ? 0 : *std::min_element(values.begin(), values.end());
+}
+
+/*
+ * Writes an mvn step count as its mean per operation and its histogram, in
+ * text or as a JSON object.
+ */
+static void write_steps(std::ostream& out, const char *name, uint64_t total, const uint64_t *histogram, uint64_t ops, bool json) {
+  double per_op = ops ? (double) total / ops : 0;
+  if (json) {
+    out << "\"" << name << "\": {\"mean\": " << per_op << ", \"histogram\": [";
+    for (int i = 0; i < mvn_stats::bins; i ++)
+      out << (i ? ", " : "") << histogram[i];
+    out << "]}";
+    return;
+  }
+
+  out << "  " << name << " mean " << per_op << ", histogram";
+  for (int i = 0; i < mvn_stats::bins; i ++)
+    out << " " << histogram[i];
+  out << "\n";
+}
+
+static void write_mvn_stats(std::ostream& out, const mvn_stats& stats, bool json) {
+  if (json) {
+    out << ", \"mvn_stats\": {\"nodes\": " << stats.nodes << ", \"levels\": " << stats.levels << ", \"roots\": " << stats.roots;
+    if (stats.enabled) {
+      out << ", \"samples\": " << stats.samples << ", ";
+      write_steps(out, "level_steps", stats.level_steps, stats.level_histogram, stats.samples, true);
+      out << ", ";
+      write_steps(out, "root_steps", stats.root_steps, stats.root_histogram, stats.samples, true);
+      out << ", ";
+      write_steps(out, "rejections", stats.rejections, stats.rejection_histogram, stats.samples, true);
+      out << ", \"updates\": " << stats.updates << ", ";
+      write_steps(out, "queued", stats.queued, stats.queue_histogram, stats.updates, true);
+      out << ", ";
+      write_steps(out, "migrations", stats.migrations, stats.migration_histogram, stats.updates, true);
+    }
+    out << "}";
+    return;
+  }
+
+  out << "  mvn forest nodes " << stats.nodes << ", levels " << stats.levels << ", roots " << stats.roots << "\n";
+  if (!stats.enabled) {
+    out << "  mvn step counts not collected, build with CPPFLAGS=-DSAMPLING_MVN_STATS\n";
+    return;
+  }
+  out << "  mvn samples " << stats.samples << ", updates " << stats.updates << "\n";
+  write_steps(out, "level steps", stats.level_steps, stats.level_histogram, stats.samples, false);
+  write_steps(out, "root steps", stats.root_steps, stats.root_histogram, stats.samples, false);
+  write_steps(out, "rejections", stats.rejections, stats.rejection_histogram, stats.samples, false);
+  write_steps(out, "queued", stats.queued, stats.queue_histogram, stats.updates, false);
+  write_steps(out, "migrations", stats.migrations, stats.migration_histogram, stats.updates, false);
+}
+
+static void print_result(const bench_config& cfg, bench_result& result) {
+  static const double quantiles[] = { 50, 90, 99, 99.9, 100 };
+  static const char *quantile_names[] = { "p50", "p90", "p99", "p999", "max" };
+  std::sort(result.latencies.begin(), result.latencies.end());
+  double ops_per_rep = (double) result.ops / cfg.reps;
+
+  if (!cfg.json) {
+    std::cout << cfg.sampler << " " << cfg.scenario << " k = " << cfg.k << ", n = " << cfg.n << ", reps = " << cfg.reps << "\n";
+    std::cout << "  construction mean " << mean(result.construction) << " s, min " << minimum(result.construction) << " s\n";
+    std::cout << "  sampling mean " << mean(result.sampling) << " s, min " << minimum(result.sampling) << " s, "
+              << mean(result.sampling) / ops_per_rep * 1e9 << " ns/op\n";
+    std::cout << "  latency (ns)";
+    for (int q = 0; q < 5; q ++)
+      std::cout << " " << quantile_names[q] << " " << percentile(result.latencies, quantiles[q]);
+    std::cout << "\n  counters per op";
+    for (int c = 0; c < perf_counters::count; c ++) {
+      std::cout << " " << perf_counters::name((perf_counters::counter) c) << " ";
+      if (result.counted[c])
+        std::cout << result.counters[c] / result.ops;
+      else
+        std::cout << "n/a";
+    }
+    std::cout << "\n";
+    if (result.has_mvn_stats)
+      write_mvn_stats(std::cout, result.mvn, false);
+    return;
+  }
+
+  std::ostringstream out;
+  out << "{\"sampler\": \"" << cfg.sampler << "\", \"scenario\": \"" << cfg.scenario << "\", "
+      << "\"k\": " << cfg.k << ", \"n\": " << cfg.n << ", \"reps\": " << cfg.reps << ", \"seed\": " << cfg.seed << ", "
+      << "\"construction_seconds\": {\"mean\": " << mean(result.construction) << ", \"min\": " << minimum(result.construction) << "}, "
+      << "\"sampling_seconds\": {\"mean\": " << mean(result.sampling) << ", \"min\": " << minimum(result.sampling) << "}, "
+      << "\"ns_per_op\": " << mean(result.sampling) / ops_per_rep * 1e9 << ", \"latency_ns\": {";
+  for (int q = 0; q < 5; q ++)
+    out << (q ? ", " : "") << "\"" << quantile_names[q] << "\": " << percentile(result.latencies, quantiles[q]);
+  out << "}, \"counters_per_op\": {";
+  for (int c = 0; c < perf_counters::count; c ++) {
+    out << (c ? ", " : "") << "\"" << perf_counters::name((perf_counters::counter) c) << "\": ";
+    if (result.counted[c])
+      out << result.counters[c] / result.ops;
+    else
+      out << "null";
+  }
+  out << "}";
+  if (result.has_mvn_stats)
+    write_mvn_stats(out, result.mvn, true);
+  out << "}";
+  std::cout << out.str() << "\n";
+}
+
+static void usage(const char *program) {
+  std::cerr << "usage: " << program << " [options]\n"
+            << "With no options, runs the fixed benchmark batteries.\n"
+            << "  --sampler NAME      we, bwe, concurrent_we, mvn, bucket, vose, dynamic_vose,\n"
+            << "                      exact_vose, adaptive, the uint32_t weight variants we32,\n"
+            << "                      mvn32, vose32 and exact_vose32, or for the\n"
+            << "                      multinomial scenario btpe, btpe_stream, parallel_btpe, relles,\n"
+            << "                      relles_enhanced, full_uniform, full_uniform_bin_search,\n"
+            << "                      reverse_bin_search (default we)\n"
+            << "  --scenario NAME     static, polya, without_replacement, random or multinomial\n"
+            << "                      (default static)\n"
+            << "  -k K                number of categories (default 1000)\n"
+            << "  -n N                operations per repetition, or trials for multinomial\n"
+            << "                      (default 1000000)\n"
+            << "  --reps R            repetitions (default 5)\n"
+            << "  --seed S            seed for weights and engines (default 1)\n"
+            << "  --update-rate P     fraction of updates in the random scenario (default 0.1)\n"
+            << "  --latency-ops L     operations timed individually (default 100000)\n"
+            << "  --threads T         pool size for parallel_btpe (default all cores)\n"
+            << "  --json              print the result as a JSON object\n";
+}
+
+/*
+ * Parses the options into cfg, returning false on an unknown option, a
+ * missing value, or an unknown sampler or scenario.
+ */
+static bool parse_args(int argc, char **argv, bench_config& cfg) {
+  for (int i = 1; i < argc; i ++) {
+    std::string arg = argv[i];
+    if (arg == "--json") {
+      cfg.json = true;
+      continue;
+    }
+    if (i + 1 == argc)
+      return false;
+
+    std::string value = argv[++ i];
+    if (arg == "--sampler")
+      cfg.sampler = value;
+    else if (arg == "--scenario")
+      cfg.scenario = value;
+    else if (arg == "-k")
+      cfg.k = std::stoull(value);
+    else if (arg == "-n")
+      cfg.n = std::stoull(value);
+    else if (arg == "--reps")
+      cfg.reps = std::stoi(value);
+    else if (arg == "--seed")
+      cfg.seed = std::stoull(value);
+    else if (arg == "--update-rate")
+      cfg.update_rate = std::stod(value);
+    else if (arg == "--latency-ops")
+      cfg.latency_ops = std::stoull(value);
+    else if (arg == "--threads")
+      cfg.threads = std::stoul(value);
+    else
+      return false;
+  }
+
+  if (cfg.k == 0 || cfg.reps <= 0)
+    return false;
+  if (cfg.scenario == "multinomial")
+    return multinomial_samplers.count(cfg.sampler) > 0;
+  return categorical_samplers.count(cfg.sampler) > 0 &&
+         (cfg.scenario == "static" || cfg.scenario == "polya" || cfg.scenario == "without_replacement" || cfg.scenario == "random");
+}
+
+static int run_configured(int argc, char **argv) {
+  bench_config cfg;
+  bool ok;
+  try {
+    ok = parse_args(argc, argv, cfg);
+  } catch (const std::exception &e) {
+    ok = false;
+  }
+  if (!ok) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  bench_result result = bench_result();
+  if (cfg.scenario == "multinomial")
+    run_multinomial(cfg, result);
+  else
+    categorical_samplers.at(cfg.sampler)(cfg, result);
+  print_result(cfg, result);
+
+  return 0;
+}
+
 int main(int argc, char **argv) {
+  if (argc > 1)
+    return run_configured(argc, argv);
+
+  rng_battery();
+  construction_battery();
+  parallel_construction_battery();
+  small_rows_battery();
+  fixed_battery();
+  reservoir_battery();
   multinomial_battery();
+  stream_battery();
+  parallel_multinomial_battery();
   categorical_battery();
+  drifting_battery();
+  batch_update_battery();
+  concurrent_battery();
 
   return 0;
 }
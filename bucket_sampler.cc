@@ -0,0 +1,164 @@
+#include <algorithm>
+#include "bucket_sampler.h"
+#include "without_replacement.h"
+
+template<class URBG, class Weight, class Index>
+basic_bucket_sampler<URBG, Weight, Index>::basic_bucket_sampler(const std::vector<Weight>& dist): basic_bucket_sampler(dist, random_seed()) {
+}
+
+template<class URBG, class Weight, class Index>
+basic_bucket_sampler<URBG, Weight, Index>::basic_bucket_sampler(const std::vector<Weight>& dist, uint64_t seed): basic_bucket_sampler(dist, URBG(seed)) {
+}
+
+template<class URBG, class Weight, class Index>
+basic_bucket_sampler<URBG, Weight, Index>::basic_bucket_sampler(const std::vector<Weight>& dist, const URBG& engine): weights(dist), slots(dist.size()), gen(engine) {
+  std::fill(tree, tree + buckets * 2 - 1, 0);
+
+  for (size_t i = 0; i < dist.size(); i ++) {
+    if (dist[i] == 0)
+      continue;
+    int b = bucket_of(dist[i]);
+    slots[i] = members[b].size();
+    members[b].push_back(i);
+    tree[buckets - 1 + b] += dist[i];
+  }
+
+  for (int i = buckets - 2; i >= 0; i --)
+    tree[i] = tree[i * 2 + 1] + tree[i * 2 + 2];
+}
+
+/*
+ * Returns the bucket of a positive weight.
+ */
+template<class URBG, class Weight, class Index>
+int basic_bucket_sampler<URBG, Weight, Index>::bucket_of(Weight weight) {
+  return 63 - __builtin_clzll(weight);
+}
+
+/*
+ * Adds the delta, which wraps for removals, along the path from a bucket's
+ * leaf to the root.
+ */
+template<class URBG, class Weight, class Index>
+void basic_bucket_sampler<URBG, Weight, Index>::add_to_bucket(int bucket, uint64_t delta) {
+  for (int i = buckets - 1 + bucket; i != 0; i = (i - 1) / 2)
+    tree[i] += delta;
+  tree[0] += delta;
+}
+
+template<class URBG, class Weight, class Index>
+void basic_bucket_sampler<URBG, Weight, Index>::insert(Index idx) {
+  int b = bucket_of(weights[idx]);
+  slots[idx] = members[b].size();
+  members[b].push_back(idx);
+  add_to_bucket(b, weights[idx]);
+}
+
+template<class URBG, class Weight, class Index>
+void basic_bucket_sampler<URBG, Weight, Index>::erase(Index idx) {
+  int b = bucket_of(weights[idx]);
+  std::vector<Index> &bucket = members[b];
+  Index last = bucket.back();
+  bucket[slots[idx]] = last;
+  slots[last] = slots[idx];
+  bucket.pop_back();
+  add_to_bucket(b, -(uint64_t) weights[idx]);
+}
+
+template<class URBG, class Weight, class Index>
+Index basic_bucket_sampler<URBG, Weight, Index>::sample() {
+  uint64_t targ = uniform_target(tree[0], gen);
+  int pos = 0;
+  while (pos < buckets - 1) {
+    if (targ < tree[pos * 2 + 1])
+      pos = pos * 2 + 1;
+    else {
+      targ -= tree[pos * 2 + 1];
+      pos = pos * 2 + 2;
+    }
+  }
+
+  int b = pos - (buckets - 1);
+  const std::vector<Index> &bucket = members[b];
+  std::uniform_int_distribution<size_t> pick(0, bucket.size() - 1);
+  std::uniform_int_distribution<uint64_t> accept(0, ((uint64_t) 2 << b) - 1);
+  while (true) {
+    Index idx = bucket[pick(gen)];
+    if (accept(gen) < weights[idx])
+      return idx;
+  }
+}
+
+template<class URBG, class Weight, class Index>
+void basic_bucket_sampler<URBG, Weight, Index>::update(Index idx, Weight value) {
+  Weight old = weights[idx];
+  if (old > 0 && value > 0 && bucket_of(old) == bucket_of(value)) {
+    weights[idx] = value;
+    add_to_bucket(bucket_of(value), (uint64_t) value - old);
+    return;
+  }
+
+  if (old > 0)
+    erase(idx);
+  weights[idx] = value;
+  if (value > 0)
+    insert(idx);
+}
+
+template<class URBG, class Weight, class Index>
+void basic_bucket_sampler<URBG, Weight, Index>::delta_update(Index idx, Weight delta) {
+  update(idx, weights[idx] + delta);
+}
+
+/*
+ * Draws m distinct items, each in proportion to its weight among the items
+ * not yet drawn, and returns them in draw order. Fewer are returned only if
+ * fewer than m items have positive weight. Repeats are rejected while they
+ * are rare; after that the drawn items are removed as they are drawn and
+ * restored at the end, each in O(1). For m above k / 8, exponential keys are
+ * used.
+ */
+template<class URBG, class Weight, class Index>
+std::vector<Index> basic_bucket_sampler<URBG, Weight, Index>::sample_without_replacement(int m) {
+  std::vector<Index> out;
+  if (m <= 0 || tree[0] == 0)
+    return out;
+  out.reserve(m);
+
+  if ((uint64_t) m * 8 >= weights.size()) {
+    exponential_keys(weights.size(), [this](size_t i) { return weights[i]; }, m, out, gen);
+    return out;
+  }
+
+  index_set seen(m);
+  auto draw = [this](Index *batch, size_t n) {
+    for (size_t i = 0; i < n; i ++)
+      batch[i] = sample();
+  };
+  if (reject_repeats(m, draw, seen, out))
+    return out;
+
+  std::vector<Weight> taken(out.size());
+  for (size_t j = 0; j < out.size(); j ++) {
+    taken[j] = weights[out[j]];
+    update(out[j], 0);
+  }
+
+  while (out.size() < m && tree[0] > 0) {
+    Index r = sample();
+    out.push_back(r);
+    taken.push_back(weights[r]);
+    update(r, 0);
+  }
+
+  for (size_t j = 0; j < out.size(); j ++)
+    update(out[j], taken[j]);
+
+  return out;
+}
+
+#define INSTANTIATE(URBG) template class basic_bucket_sampler<URBG>;
+SAMPLING_ENGINES(INSTANTIATE)
+
+#define INSTANTIATE_WEIGHTS(Weight, Index) template class basic_bucket_sampler<default_engine, Weight, Index>;
+SAMPLING_INTEGER_WEIGHT_TYPES(INSTANTIATE_WEIGHTS)
@@ -0,0 +1,56 @@
+/*
+ * A dynamic sampler for categorical random variables with O(1) expected
+ * sampling time and O(1) updates. Items are grouped by the binary logarithm
+ * of their weight, bucket j holding the weights in [2^j, 2^(j+1)), each in a
+ * flat array from which items are removed by swapping with the last. A
+ * bucket is chosen in proportion to its total by descending a fixed tree over
+ * the 64 buckets, laid out as in WE, and an item within it by rejection: a
+ * uniformly chosen member of weight w is accepted with probability
+ * w / 2^(j+1), which is at least one half.
+ *
+ * Weights must be unsigned integers, and their total must remain below 2^64.
+ */
+#ifndef BUCKET_SAMPLER_H
+#define BUCKET_SAMPLER_H
+
+#include <random>
+#include <type_traits>
+#include <vector>
+#include "rng.h"
+#include "weights.h"
+
+template<class URBG = default_engine, class Weight = uint64_t, class Index = int>
+class basic_bucket_sampler {
+  static_assert(std::is_unsigned<Weight>::value, "weights must be unsigned integers");
+  static_assert(std::is_integral<Index>::value, "indices must be integers");
+
+  private:
+    static const int buckets = 64;
+
+    std::vector<Weight> weights;
+    std::vector<uint32_t> slots;
+    std::vector<Index> members[buckets];
+    uint64_t tree[buckets * 2 - 1];
+    URBG gen;
+
+    static int bucket_of(Weight weight);
+    void add_to_bucket(int bucket, uint64_t delta);
+    void insert(Index idx);
+    void erase(Index idx);
+
+  public:
+    typedef Weight weight_type;
+    typedef Index index_type;
+
+    basic_bucket_sampler(const std::vector<Weight>& dist);
+    basic_bucket_sampler(const std::vector<Weight>& dist, uint64_t seed);
+    basic_bucket_sampler(const std::vector<Weight>& dist, const URBG& engine);
+    Index sample();
+    void update(Index idx, Weight value);
+    void delta_update(Index idx, Weight delta);
+    std::vector<Index> sample_without_replacement(int m);
+};
+
+typedef basic_bucket_sampler<> bucket_sampler;
+
+#endif
@@ -0,0 +1,207 @@
+#include "bwe.h"
+#include "cpu.h"
+#include "without_replacement.h"
+
+#ifdef SAMPLING_X86
+#include <immintrin.h>
+#endif
+
+template<class URBG>
+basic_bwe<URBG>::basic_bwe(const std::vector<uint64_t>& dist): basic_bwe(dist, random_seed()) {
+}
+
+template<class URBG>
+basic_bwe<URBG>::basic_bwe(const std::vector<uint64_t>& dist, uint64_t seed): basic_bwe(dist, URBG(seed)) {
+}
+
+template<class URBG>
+basic_bwe<URBG>::basic_bwe(const std::vector<uint64_t>& dist, const URBG& engine): gen(engine) {
+  levels = 1;
+  uint64_t width = 1;
+  while (width * fanout < dist.size()) {
+    width *= fanout;
+    levels ++;
+  }
+  leaf_start = (width - 1) / (fanout - 1);
+
+  uint64_t nodes = leaf_start + (dist.size() + fanout - 1) / fanout;
+  tree = std::vector<uint64_t, aligned_allocator<uint64_t, 64>>(nodes * fanout);
+
+  for (uint64_t i = 0; i < dist.size(); i ++)
+    tree[leaf_start * fanout + i] = dist[i];
+
+  for (uint64_t node = nodes; node-- > 0;) {
+    uint64_t *prefix = &tree[node * fanout];
+    if (node < leaf_start) {
+      for (int c = 0; c < fanout; c ++) {
+        uint64_t child = node * fanout + 1 + c;
+        prefix[c] = child < nodes ? tree[child * fanout + fanout - 1] : 0;
+      }
+    }
+    for (int c = 1; c < fanout; c ++)
+      prefix[c] += prefix[c - 1];
+  }
+}
+
+/*
+ * Descent kernels. Each returns the position of the sampled weight within
+ * the bottom level of the tree, counting at every node how many prefix sums
+ * lie at or below the remaining target.
+ */
+typedef uint64_t (*descend_kernel)(const uint64_t *tree, uint64_t levels, uint64_t targ);
+
+static uint64_t descend_scalar(const uint64_t *tree, uint64_t levels, uint64_t targ) {
+  uint64_t pos = 0;
+  uint64_t child = 0;
+  for (uint64_t i = 0; i < levels; i ++) {
+    const uint64_t *prefix = tree + pos * 8;
+    int c = 0;
+    for (int j = 0; j < 8; j ++)
+      c += prefix[j] <= targ;
+    if (c > 0)
+      targ -= prefix[c - 1];
+    child = pos * 8 + c;
+    pos = child + 1;
+  }
+  return child;
+}
+
+#ifdef SAMPLING_X86
+/*
+ * AVX2 only compares signed integers, so both sides are offset by 2^63,
+ * which orders them as unsigned.
+ */
+__attribute__((target("avx2,popcnt")))
+static uint64_t descend_avx2(const uint64_t *tree, uint64_t levels, uint64_t targ) {
+  const __m256i bias = _mm256_set1_epi64x(INT64_MIN);
+  uint64_t pos = 0;
+  uint64_t child = 0;
+  for (uint64_t i = 0; i < levels; i ++) {
+    const uint64_t *prefix = tree + pos * 8;
+    __m256i t = _mm256_xor_si256(_mm256_set1_epi64x(targ), bias);
+    __m256i lo = _mm256_cmpgt_epi64(_mm256_xor_si256(_mm256_load_si256((const __m256i*) prefix), bias), t);
+    __m256i hi = _mm256_cmpgt_epi64(_mm256_xor_si256(_mm256_load_si256((const __m256i*) (prefix + 4)), bias), t);
+    int above = _mm_popcnt_u32(_mm256_movemask_pd(_mm256_castsi256_pd(lo)) | (_mm256_movemask_pd(_mm256_castsi256_pd(hi)) << 4));
+    int c = 8 - above;
+    if (c > 0)
+      targ -= prefix[c - 1];
+    child = pos * 8 + c;
+    pos = child + 1;
+  }
+  return child;
+}
+
+__attribute__((target("avx512f,popcnt")))
+static uint64_t descend_avx512(const uint64_t *tree, uint64_t levels, uint64_t targ) {
+  uint64_t pos = 0;
+  uint64_t child = 0;
+  for (uint64_t i = 0; i < levels; i ++) {
+    const uint64_t *prefix = tree + pos * 8;
+    __mmask8 le = _mm512_cmple_epu64_mask(_mm512_load_si512((const void*) prefix), _mm512_set1_epi64(targ));
+    int c = _mm_popcnt_u32(le);
+    if (c > 0)
+      targ -= prefix[c - 1];
+    child = pos * 8 + c;
+    pos = child + 1;
+  }
+  return child;
+}
+#endif
+
+static descend_kernel select_kernel() {
+#ifdef SAMPLING_X86
+  if (cpu_has_avx512())
+    return descend_avx512;
+  if (cpu_has_avx2())
+    return descend_avx2;
+#endif
+  return descend_scalar;
+}
+
+template<class URBG>
+int basic_bwe<URBG>::sample() {
+  static const descend_kernel descend = select_kernel();
+
+  std::uniform_int_distribution<uint64_t> dis(0, tree[fanout - 1] - 1);
+  return descend(tree.data(), levels, dis(gen)) - leaf_start * fanout;
+}
+
+template<class URBG>
+void basic_bwe<URBG>::add(int idx, uint64_t delta) {
+  uint64_t pos = leaf_start * fanout + idx;
+  while (true) {
+    uint64_t *prefix = &tree[pos / fanout * fanout];
+    for (int c = pos % fanout; c < fanout; c ++)
+      prefix[c] += delta;
+    if (pos < fanout)
+      break;
+    pos = pos / fanout - 1;
+  }
+}
+
+template<class URBG>
+uint64_t basic_bwe<URBG>::weight(int idx) const {
+  uint64_t pos = leaf_start * fanout + idx;
+  return tree[pos] - (pos % fanout == 0 ? 0 : tree[pos - 1]);
+}
+
+template<class URBG>
+void basic_bwe<URBG>::update(int idx, int value) {
+  add(idx, value - weight(idx));
+}
+
+template<class URBG>
+void basic_bwe<URBG>::delta_update(int idx, int delta) {
+  add(idx, delta);
+}
+
+/*
+ * Draws m distinct items, each in proportion to its weight among the items
+ * not yet drawn, and returns them in draw order. Fewer are returned only if
+ * fewer than m items have positive weight. Repeats are rejected while they
+ * are rare; after that the drawn items are removed from the tree as they
+ * are drawn and added back at the end. For m above k / 8, exponential keys
+ * over the leaves are used.
+ */
+template<class URBG>
+std::vector<int> basic_bwe<URBG>::sample_without_replacement(int m) {
+  std::vector<int> out;
+  if (m <= 0 || tree[fanout - 1] == 0)
+    return out;
+  out.reserve(m);
+
+  uint64_t leaves = tree.size() - leaf_start * fanout;
+  if ((uint64_t) m * 8 >= leaves) {
+    exponential_keys(leaves, [this](size_t i) { return weight(i); }, m, out, gen);
+    return out;
+  }
+
+  index_set seen(m);
+  auto draw = [this](int *batch, size_t n) {
+    for (size_t i = 0; i < n; i ++)
+      batch[i] = sample();
+  };
+  if (reject_repeats(m, draw, seen, out))
+    return out;
+
+  std::vector<uint64_t> taken(out.size());
+  for (size_t j = 0; j < out.size(); j ++) {
+    taken[j] = weight(out[j]);
+    add(out[j], -taken[j]);
+  }
+
+  while (out.size() < m && tree[fanout - 1] > 0) {
+    int r = sample();
+    out.push_back(r);
+    taken.push_back(weight(r));
+    add(r, -taken.back());
+  }
+
+  for (size_t j = 0; j < out.size(); j ++)
+    add(out[j], taken[j]);
+
+  return out;
+}
+
+#define INSTANTIATE(URBG) template class basic_bwe<URBG>;
+SAMPLING_ENGINES(INSTANTIATE)
@@ -0,0 +1,45 @@
+/*
+ * A cache-conscious variant of Wong and Easton's tree-based method. Rather
+ * than a binary heap, the tree is stored as an implicit 8-ary heap whose
+ * nodes each occupy a single 64 byte cache line and hold the inclusive prefix
+ * sums of their children. A descent therefore touches log_8 k cache lines,
+ * and the child at each level is found with one vector comparison. Updates
+ * adjust the suffix of one node per level and remain O(log k).
+ */
+#ifndef BWE_H
+#define BWE_H
+
+#include <random>
+#include <vector>
+#include "rng.h"
+#include "aligned.h"
+
+template<class URBG = default_engine>
+class basic_bwe {
+  private:
+    static const int fanout = 8;
+
+    uint64_t levels;
+    uint64_t leaf_start;
+    std::vector<uint64_t, aligned_allocator<uint64_t, 64>> tree;
+    URBG gen;
+
+    void add(int idx, uint64_t delta);
+    uint64_t weight(int idx) const;
+
+  public:
+    typedef uint64_t weight_type;
+    typedef int index_type;
+
+    basic_bwe(const std::vector<uint64_t>& dist);
+    basic_bwe(const std::vector<uint64_t>& dist, uint64_t seed);
+    basic_bwe(const std::vector<uint64_t>& dist, const URBG& engine);
+    int sample();
+    void update(int idx, int value);
+    void delta_update(int idx, int delta);
+    std::vector<int> sample_without_replacement(int m);
+};
+
+typedef basic_bwe<> bwe;
+
+#endif
@@ -0,0 +1,94 @@
+#include "concurrent_we.h"
+
+template<class URBG>
+basic_concurrent_we<URBG>::basic_concurrent_we(const std::vector<uint64_t>& dist) {
+  levels = 2 + (int) std::floor(std::log2(dist.size() - 1));
+  round_size = 1ULL << (levels - 1);
+  tree = std::vector<std::atomic<uint64_t>>(round_size * 2 - 1);
+
+  for (uint64_t i = 0; i < dist.size(); i ++)
+    tree[round_size + i - 1].store(dist[i], std::memory_order_relaxed);
+
+  for (uint64_t size = round_size / 2; size > 0; size /= 2)
+    for (uint64_t i = 0; i < size; i ++)
+      tree[size + i - 1].store(tree[(size + i) * 2 - 1].load(std::memory_order_relaxed) + tree[(size + i) * 2].load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+template<class URBG>
+int basic_concurrent_we<URBG>::sample() {
+  static thread_local URBG gen(random_seed());
+  return sample(gen);
+}
+
+/*
+ * Loads the sum of a node. Racing updates of one leaf may reach an ancestor
+ * in either order and take it below zero for a time, so sums are read as
+ * signed and a negative one as empty.
+ */
+static inline uint64_t load_sum(const std::atomic<uint64_t>& node) {
+  int64_t sum = node.load(std::memory_order_relaxed);
+  return sum < 0 ? 0 : sum;
+}
+
+template<class URBG>
+int basic_concurrent_we<URBG>::sample(URBG& gen) {
+  while (true) {
+    uint64_t root = load_sum(tree[0]);
+    if (root == 0)
+      continue;
+
+    std::uniform_int_distribution<uint64_t> dis(0, root - 1);
+    uint64_t targ = dis(gen);
+    uint64_t pos = 0;
+    uint64_t i = 0;
+    for (; i < levels - 1; i ++) {
+      uint64_t left = load_sum(tree[pos * 2 + 1]);
+      if (targ < left) {
+        pos = pos * 2 + 1;
+        continue;
+      }
+
+      uint64_t right = load_sum(tree[pos * 2 + 2]);
+      if (targ - left < right) {
+        targ -= left;
+        pos = pos * 2 + 2;
+      } else if (right > 0) {
+        /* The parent ran ahead of its children; clamp to the right child */
+        targ = right - 1;
+        pos = pos * 2 + 2;
+      } else if (left > 0) {
+        targ = left - 1;
+        pos = pos * 2 + 1;
+      } else {
+        break;
+      }
+    }
+
+    /* Retry if the subtree was emptied underneath the descent */
+    if (i == levels - 1)
+      return pos - (round_size - 1);
+  }
+}
+
+template<class URBG>
+void basic_concurrent_we<URBG>::propagate(int idx, uint64_t delta) {
+  for (uint64_t i = (round_size + idx - 2) / 2; i != 0; i = (i - 1) / 2)
+    tree[i].fetch_add(delta, std::memory_order_relaxed);
+
+  tree[0].fetch_add(delta, std::memory_order_relaxed);
+}
+
+template<class URBG>
+void basic_concurrent_we<URBG>::update(int idx, uint64_t value) {
+  uint64_t prev = tree[round_size + idx - 1].exchange(value, std::memory_order_relaxed);
+  propagate(idx, value - prev);
+}
+
+template<class URBG>
+void basic_concurrent_we<URBG>::delta_update(int idx, int64_t delta) {
+  tree[round_size + idx - 1].fetch_add(delta, std::memory_order_relaxed);
+  propagate(idx, delta);
+}
+
+#define INSTANTIATE(URBG) template class basic_concurrent_we<URBG>;
+SAMPLING_ENGINES(INSTANTIATE)
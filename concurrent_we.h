@@ -0,0 +1,49 @@
+/*
+ * A thread-safe variant of Wong and Easton's tree-based method. The tree is
+ * stored as an array of atomic counters, and updates propagate their deltas
+ * along the leaf-to-root path with atomic fetch-adds, so any number of
+ * threads may sample and update the distribution concurrently without
+ * locking. Each thread draws from its own random engine, or from an engine
+ * passed by the caller.
+ *
+ * The counters are accessed with relaxed ordering, so a sample sees an
+ * arbitrary subset of the deltas of updates in flight, and of updates that
+ * have not yet become visible to the sampling thread. Racing updates of one
+ * leaf may take a node's sum below zero for a time; sums are read as signed
+ * and a negative one counts as empty, so the total weight must stay below
+ * 2^63. Where a partially applied update leaves a node inconsistent with its
+ * children, the descent clamps to the nearest child with remaining weight, so
+ * the sampling error is bounded by the magnitude of the unseen deltas. The
+ * total must be positive to sample; a sample retries until it is.
+ */
+#ifndef CONCURRENT_WE_H
+#define CONCURRENT_WE_H
+
+#include <atomic>
+#include <random>
+#include <vector>
+#include "rng.h"
+
+template<class URBG = default_engine>
+class basic_concurrent_we {
+  private:
+    uint64_t levels;
+    uint64_t round_size;
+    std::vector<std::atomic<uint64_t>> tree;
+
+    void propagate(int idx, uint64_t delta);
+
+  public:
+    typedef uint64_t weight_type;
+    typedef int index_type;
+
+    basic_concurrent_we(const std::vector<uint64_t>& dist);
+    int sample();
+    int sample(URBG& gen);
+    void update(int idx, uint64_t value);
+    void delta_update(int idx, int64_t delta);
+};
+
+typedef basic_concurrent_we<> concurrent_we;
+
+#endif
@@ -0,0 +1,29 @@
+/*
+ * Runtime detection of the x86 vector extensions used by the batched
+ * sampling kernels. On other targets every query reports false and callers
+ * fall back to their scalar implementations.
+ */
+#ifndef CPU_H
+#define CPU_H
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SAMPLING_X86 1
+#endif
+
+static inline bool cpu_has_avx2() {
+#ifdef SAMPLING_X86
+  return __builtin_cpu_supports("avx2");
+#else
+  return false;
+#endif
+}
+
+static inline bool cpu_has_avx512() {
+#ifdef SAMPLING_X86
+  return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl");
+#else
+  return false;
+#endif
+}
+
+#endif
@@ -0,0 +1,250 @@
+#include <algorithm>
+#include <limits>
+#include "dynamic_vose.h"
+#include "without_replacement.h"
+
+template<class URBG>
+basic_dynamic_vose<URBG>::basic_dynamic_vose(const std::vector<uint64_t> dist): basic_dynamic_vose(dist, random_seed()) {
+}
+
+template<class URBG>
+basic_dynamic_vose<URBG>::basic_dynamic_vose(const std::vector<uint64_t> dist, uint64_t seed): basic_dynamic_vose(dist, URBG(seed)) {
+}
+
+template<class URBG>
+basic_dynamic_vose<URBG>::basic_dynamic_vose(const std::vector<uint64_t> dist, const URBG& engine): dist(dist), gen(engine), total(0), max_drift(0.5) {
+  for (auto &entry : dist)
+    total += entry;
+  rebuild_alias_table();
+}
+
+/*
+ * Sets the fraction of the total weight that may be held as rejected mass
+ * before the table is rebuilt. Smaller values trade more frequent rebuilds
+ * for fewer rejections while sampling.
+ */
+template<class URBG>
+void basic_dynamic_vose<URBG>::set_max_drift(double max_drift) {
+  this->max_drift = max_drift;
+}
+
+template<class URBG>
+void basic_dynamic_vose<URBG>::rebuild_alias_table() {
+  std::vector<int> small;
+  std::vector<int> large;
+
+  table.resize(dist.size());
+  extra_pos.resize(dist.size());
+  alias_cols.assign(dist.size(), std::vector<int>());
+  extra_cols.assign(dist.size(), std::vector<int>());
+  stale_table = false;
+  capacity = total / dist.size();
+
+  for (int i = 0; i < dist.size(); i ++) {
+    table[i] = { (double) dist[i], 0, i, -1 };
+    if (dist[i] > capacity)
+      large.push_back(i);
+    if (dist[i] < capacity)
+      small.push_back(i);
+  }
+
+  while (!small.empty() && !large.empty()) {
+    int lg = large.back();
+    int sm = small.back();
+    small.pop_back();
+
+    table[sm].alt_p = capacity - table[sm].main_p;
+    table[sm].alt_i = lg;
+    table[lg].main_p -= table[sm].alt_p;
+    alias_cols[lg].push_back(sm);
+
+    if (table[lg].main_p < capacity) {
+      large.pop_back();
+      small.push_back(lg);
+    }
+  }
+}
+
+template<class URBG>
+int basic_dynamic_vose<URBG>::sample() {
+  if (stale_table)
+    rebuild_alias_table();
+
+  std::uniform_real_distribution<> unif_dis(0.0, table.size());
+
+  while (true) {
+    double sample = unif_dis(gen);
+    int a = sample;
+    double b = (sample - a) * capacity;
+
+    if (b < table[a].main_p)
+      return table[a].main_i;
+    if (b < table[a].main_p + table[a].alt_p)
+      return table[a].alt_i;
+  }
+}
+
+/*
+ * Adds weight to an item, first filling the free space in its own column,
+ * then its partially filled overflow column, and finally new overflow
+ * columns.
+ */
+template<class URBG>
+void basic_dynamic_vose<URBG>::grow(int idx, double delta) {
+  column &own = table[idx];
+  double room = std::min(capacity - own.main_p - own.alt_p, delta);
+  if (room > 0) {
+    own.main_p += room;
+    delta -= room;
+  }
+
+  if (delta > 0 && !extra_cols[idx].empty()) {
+    column &last = table[extra_cols[idx].back()];
+    room = std::min(capacity - last.main_p, delta);
+    if (room > 0) {
+      last.main_p += room;
+      delta -= room;
+    }
+  }
+
+  while (delta > 0) {
+    double piece = std::min(capacity, delta);
+    table.push_back({ piece, 0, idx, -1 });
+    extra_pos.push_back(extra_cols[idx].size());
+    extra_cols[idx].push_back(table.size() - 1);
+    delta -= piece;
+  }
+}
+
+/*
+ * Removes weight from an item, draining its overflow columns first so that
+ * they can be released, then its own column, and finally the columns in
+ * which it is the alias.
+ */
+template<class URBG>
+void basic_dynamic_vose<URBG>::shrink(int idx, double delta) {
+  while (delta > 0 && !extra_cols[idx].empty()) {
+    int col = extra_cols[idx].back();
+    double piece = std::min(table[col].main_p, delta);
+    table[col].main_p -= piece;
+    delta -= piece;
+    if (table[col].main_p <= 0) {
+      extra_cols[idx].pop_back();
+      remove_column(col);
+    }
+  }
+
+  double piece = std::min(table[idx].main_p, delta);
+  table[idx].main_p -= piece;
+  delta -= piece;
+
+  while (delta > 0 && !alias_cols[idx].empty()) {
+    column &col = table[alias_cols[idx].back()];
+    piece = std::min(col.alt_p, delta);
+    col.alt_p -= piece;
+    delta -= piece;
+    if (col.alt_p <= 0) {
+      col.alt_p = 0;
+      col.alt_i = -1;
+      alias_cols[idx].pop_back();
+    }
+  }
+}
+
+/*
+ * Releases an empty overflow column by moving the last column into its slot.
+ */
+template<class URBG>
+void basic_dynamic_vose<URBG>::remove_column(int col) {
+  int last = table.size() - 1;
+  if (col != last) {
+    table[col] = table[last];
+    extra_pos[col] = extra_pos[last];
+    extra_cols[table[col].main_i][extra_pos[col]] = col;
+  }
+  table.pop_back();
+  extra_pos.pop_back();
+}
+
+template<class URBG>
+void basic_dynamic_vose<URBG>::update(int idx, double value) {
+  double prev = dist[idx];
+  total -= dist[idx];
+  dist[idx] = value;
+  total += dist[idx];
+
+  if (stale_table)
+    return;
+
+  if (dist[idx] > prev) {
+    double delta = dist[idx] - prev;
+    if (table.size() + delta / capacity > 2 * dist.size()) {
+      stale_table = true;
+      return;
+    }
+    grow(idx, delta);
+  } else if (dist[idx] == 0) {
+    shrink(idx, std::numeric_limits<double>::infinity());
+  } else {
+    shrink(idx, prev - dist[idx]);
+  }
+
+  /* Rebuild once the rejected mass is too large a fraction of the total */
+  if (table.size() * capacity - total > max_drift * total)
+    stale_table = true;
+}
+
+template<class URBG>
+void basic_dynamic_vose<URBG>::delta_update(int idx, double delta) {
+  update(idx, dist[idx] + delta);
+}
+
+/*
+ * Draws m distinct items, each in proportion to its weight among the items
+ * not yet drawn, and returns them in draw order. Fewer are returned only if
+ * fewer than m items have positive weight. Repeats are rejected while they
+ * are rare; after that the drawn items are removed by updates as they are
+ * drawn and restored at the end. For m above k / 8, exponential keys are
+ * used.
+ */
+template<class URBG>
+std::vector<int> basic_dynamic_vose<URBG>::sample_without_replacement(int m) {
+  std::vector<int> out;
+  if (m <= 0 || total <= 0)
+    return out;
+  out.reserve(m);
+
+  if ((uint64_t) m * 8 >= dist.size()) {
+    exponential_keys(dist.size(), [this](size_t i) { return dist[i]; }, m, out, gen);
+    return out;
+  }
+
+  index_set seen(m);
+  auto draw = [this](int *batch, size_t n) {
+    for (size_t i = 0; i < n; i ++)
+      batch[i] = sample();
+  };
+  if (reject_repeats(m, draw, seen, out))
+    return out;
+
+  std::vector<uint64_t> taken(out.size());
+  for (size_t j = 0; j < out.size(); j ++) {
+    taken[j] = dist[out[j]];
+    update(out[j], 0);
+  }
+
+  while (out.size() < m && total > 0) {
+    int r = sample();
+    out.push_back(r);
+    taken.push_back(dist[r]);
+    update(r, 0);
+  }
+
+  for (size_t j = 0; j < out.size(); j ++)
+    update(out[j], taken[j]);
+
+  return out;
+}
+
+#define INSTANTIATE(URBG) template class basic_dynamic_vose<URBG>;
+SAMPLING_ENGINES(INSTANTIATE)
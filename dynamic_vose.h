@@ -0,0 +1,63 @@
+/*
+ * A dynamic variant of Vose's alias table method. Instead of discarding the
+ * table on every update, the columns holding the updated item are repaired in
+ * place: weight is removed from the item's pieces, and added weight fills the
+ * item's own column or spills into overflow columns appended to the table.
+ * Columns that are not full are handled by rejection. The table is only
+ * rebuilt once the rejected mass exceeds a fraction of the total weight (by
+ * default one half, see set_max_drift), so the O(k) rebuild is amortized
+ * over many updates while sampling remains O(1) expected time. The total
+ * must be positive to sample, as every column rejects once it is zero.
+ */
+
+#ifndef DYNAMIC_VOSE_H
+#define DYNAMIC_VOSE_H
+
+#include <random>
+#include <vector>
+#include "rng.h"
+
+template<class URBG = default_engine>
+class basic_dynamic_vose {
+  private:
+    struct column {
+      double main_p;
+      double alt_p;
+      int main_i;
+      int alt_i;
+    };
+
+    std::vector<uint64_t> dist;
+    std::vector<column> table;
+    std::vector<std::vector<int>> alias_cols;
+    std::vector<std::vector<int>> extra_cols;
+    std::vector<int> extra_pos;
+    URBG gen;
+    double total;
+    double capacity;
+    double max_drift;
+    bool stale_table;
+
+    void rebuild_alias_table();
+    void grow(int idx, double delta);
+    void shrink(int idx, double delta);
+    void remove_column(int col);
+
+  public:
+    typedef uint64_t weight_type;
+    typedef int index_type;
+
+    basic_dynamic_vose(const std::vector<uint64_t> dist);
+    basic_dynamic_vose(const std::vector<uint64_t> dist, uint64_t seed);
+    basic_dynamic_vose(const std::vector<uint64_t> dist, const URBG& engine);
+
+    void set_max_drift(double max_drift);
+    int sample();
+    void update(int idx, double value);
+    void delta_update(int idx, double delta);
+    std::vector<int> sample_without_replacement(int m);
+};
+
+typedef basic_dynamic_vose<> dynamic_vose;
+
+#endif
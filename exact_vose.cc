@@ -0,0 +1,154 @@
+#include "alias_sweep.h"
+#include "exact_vose.h"
+#include "thread_pool.h"
+#include "without_replacement.h"
+
+template<class URBG, class Weight, class Index>
+basic_exact_vose<URBG, Weight, Index>::basic_exact_vose(const std::vector<Weight> dist): basic_exact_vose(dist, random_seed()) {
+}
+
+template<class URBG, class Weight, class Index>
+basic_exact_vose<URBG, Weight, Index>::basic_exact_vose(const std::vector<Weight> dist, uint64_t seed): basic_exact_vose(dist, URBG(seed)) {
+}
+
+template<class URBG, class Weight, class Index>
+basic_exact_vose<URBG, Weight, Index>::basic_exact_vose(const std::vector<Weight> dist, const URBG& engine): dist(dist), gen(engine), pool(nullptr) {
+  rebuild_alias_table();
+}
+
+template<class URBG, class Weight, class Index>
+basic_exact_vose<URBG, Weight, Index>::basic_exact_vose(const std::vector<Weight> dist, uint64_t seed, thread_pool& pool): basic_exact_vose(dist, URBG(seed), pool) {
+}
+
+template<class URBG, class Weight, class Index>
+basic_exact_vose<URBG, Weight, Index>::basic_exact_vose(const std::vector<Weight> dist, const URBG& engine, thread_pool& pool): dist(dist), gen(engine), pool(&pool) {
+  rebuild_alias_table();
+}
+
+/*
+ * Fills the table with the exact sweep and computes the rejection bounds,
+ * 2^64 mod n, as (-n) % n in 64 bit arithmetic. These are the only
+ * divisions, and are done once per build.
+ */
+template<class URBG, class Weight, class Index>
+void basic_exact_vose<URBG, Weight, Index>::rebuild_alias_table() {
+  table.resize(dist.size());
+  stale_table = false;
+
+  alias_sweep<Weight> sweep(dist.data(), dist.size(), pool);
+  total = sweep.sum();
+  single_word = true;
+  reject = 0;
+  if (total == 0)
+    return;
+
+  parallel_for(pool, 0, dist.size(), alias_block, [this, &sweep](size_t lo, size_t hi) {
+    sweep.fill(lo, hi, table.data());
+  });
+
+  uint64_t k = dist.size();
+  single_word = (unsigned __int128) k * total <= UINT64_MAX;
+  if (single_word) {
+    uint64_t n = k * total;
+    reject = -n % n;
+  } else {
+    reject_k = -k % k;
+    reject_total = -total % total;
+  }
+}
+
+/*
+ * Draws uniformly from [0, n) by Lemire's method, given reject = 2^64 mod n.
+ */
+template<class URBG>
+static inline uint64_t bounded(URBG& gen, uint64_t n, uint64_t reject) {
+  unsigned __int128 m;
+  do {
+    m = (unsigned __int128) gen() * n;
+  } while ((uint64_t) m < reject);
+  return m >> 64;
+}
+
+template<class URBG, class Weight, class Index>
+Index basic_exact_vose<URBG, Weight, Index>::sample() {
+  if (stale_table)
+    rebuild_alias_table();
+
+  const uint64_t k = table.size();
+  uint64_t a, u;
+  if (single_word) {
+    unsigned __int128 column, offset;
+    do {
+      column = (unsigned __int128) gen() * k;
+      offset = (unsigned __int128) (uint64_t) column * total;
+    } while ((uint64_t) offset < reject);
+    a = column >> 64;
+    u = offset >> 64;
+  } else {
+    a = bounded(gen, k, reject_k);
+    u = bounded(gen, total, reject_total);
+  }
+
+  return u < table[a].main_p ? a : table[a].alt_i;
+}
+
+template<class URBG, class Weight, class Index>
+void basic_exact_vose<URBG, Weight, Index>::sample_n(Index *out, size_t n) {
+  if (stale_table)
+    rebuild_alias_table();
+
+  for (size_t i = 0; i < n; i ++)
+    out[i] = sample();
+}
+
+template<class URBG, class Weight, class Index>
+void basic_exact_vose<URBG, Weight, Index>::sample_n(std::vector<Index>& out) {
+  sample_n(out.data(), out.size());
+}
+
+template<class URBG, class Weight, class Index>
+std::vector<Index> basic_exact_vose<URBG, Weight, Index>::sample_n(size_t n) {
+  std::vector<Index> out(n);
+  sample_n(out.data(), n);
+  return out;
+}
+
+template<class URBG, class Weight, class Index>
+void basic_exact_vose<URBG, Weight, Index>::update(Index idx, Weight value) {
+  total -= dist[idx];
+  total += value;
+  dist[idx] = value;
+
+  stale_table = true;
+}
+
+template<class URBG, class Weight, class Index>
+void basic_exact_vose<URBG, Weight, Index>::delta_update(Index idx, Weight delta) {
+  update(idx, dist[idx] + delta);
+}
+
+/*
+ * Draws m distinct items as vose does, by rejecting repeats while they are
+ * rare and by exponential keys otherwise. Only the first of these is exact.
+ */
+template<class URBG, class Weight, class Index>
+std::vector<Index> basic_exact_vose<URBG, Weight, Index>::sample_without_replacement(int m) {
+  std::vector<Index> out;
+  if (m <= 0 || total == 0)
+    return out;
+  out.reserve(m);
+
+  index_set seen(m);
+  if ((uint64_t) m * 8 < dist.size() &&
+      reject_repeats(m, [this](Index *batch, size_t n) { sample_n(batch, n); }, seen, out))
+    return out;
+
+  exponential_keys(dist.size(), [this, &seen](size_t i) { return seen.contains(i) ? Weight(0) : dist[i]; }, m, out, gen);
+  return out;
+}
+
+#define INSTANTIATE(URBG) template class basic_exact_vose<URBG>;
+SAMPLING_ENGINES(INSTANTIATE)
+
+#define INSTANTIATE_WEIGHTS(Weight, Index) template class basic_exact_vose<default_engine, Weight, Index>;
+SAMPLING_INTEGER_WEIGHT_TYPES(INSTANTIATE_WEIGHTS)
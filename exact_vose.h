@@ -0,0 +1,82 @@
+/*
+ * An alias table for integer weights that samples with exactly the
+ * probabilities w_i / total, with no rounding anywhere.
+ *
+ * Thresholds are stored as integers in units of 1 / k of a weight, so that
+ * every column holds total units, and the sweep that builds them is exact
+ * for integer weights. A sample takes a column a and an offset u within it
+ * from a single 64 bit word x, by the multiplications x * k = a * 2^64 + l
+ * and l * total = u * 2^64 + r. Then a * total + u is the integer part of
+ * x * k * total / 2^64, which Lemire's "Fast Random Integer Generation in an
+ * Interval" makes exactly uniform over the k * total outcomes by rejecting
+ * the words with r below 2^64 mod (k * total), a bound computed when the
+ * table is built. Item a is returned if u is below its threshold, and its
+ * alias otherwise. Sampling uses neither division nor floating point.
+ *
+ * When k * total exceeds 2^64, the column and the offset are each drawn by
+ * the same method from a word of their own.
+ *
+ * Weights must be unsigned integers whose total fits in 64 bits, the total
+ * must be positive to sample, and indices must be 32 bit integers.
+ */
+#ifndef EXACT_VOSE_H
+#define EXACT_VOSE_H
+
+#include <cstdint>
+#include <random>
+#include <type_traits>
+#include <vector>
+#include "rng.h"
+#include "weights.h"
+
+class thread_pool;
+
+template<class URBG = default_engine, class Weight = uint64_t, class Index = int>
+class basic_exact_vose {
+  static_assert(std::is_unsigned<Weight>::value, "weights must be unsigned integers");
+  static_assert(std::is_integral<Index>::value && sizeof(Index) == 4, "indices must be 32 bit integers");
+  static_assert(URBG::min() == 0 && URBG::max() == UINT64_MAX, "exact sampling requires a 64 bit engine");
+
+  private:
+    struct exact_entry {
+      uint64_t main_p;
+      Index alt_i;
+    };
+
+    std::vector<Weight> dist;
+    std::vector<exact_entry> table;
+    URBG gen;
+    uint64_t total;
+    bool stale_table;
+    thread_pool *pool;
+
+    bool single_word;
+    uint64_t reject;
+    uint64_t reject_k;
+    uint64_t reject_total;
+
+    void rebuild_alias_table();
+
+  public:
+    typedef Weight weight_type;
+    typedef Index index_type;
+
+    basic_exact_vose(const std::vector<Weight> dist);
+    basic_exact_vose(const std::vector<Weight> dist, uint64_t seed);
+    basic_exact_vose(const std::vector<Weight> dist, const URBG& engine);
+    basic_exact_vose(const std::vector<Weight> dist, uint64_t seed, thread_pool& pool);
+    basic_exact_vose(const std::vector<Weight> dist, const URBG& engine, thread_pool& pool);
+
+    Index sample();
+    void sample_n(Index *out, size_t n);
+    void sample_n(std::vector<Index>& out);
+    std::vector<Index> sample_n(size_t n);
+    void update(Index idx, Weight value);
+    void delta_update(Index idx, Weight delta);
+    std::vector<Index> sample_without_replacement(int m);
+};
+
+typedef basic_exact_vose<> exact_vose;
+typedef basic_exact_vose<default_engine, uint32_t, uint32_t> exact_vose32;
+
+#endif
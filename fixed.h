@@ -0,0 +1,331 @@
+/*
+ * Categorical samplers over a number of items K fixed at compile time, for
+ * small distributions. The weights are held in a std::array inside the
+ * sampler, so it makes no allocation, and every loop has a constant trip
+ * count that the compiler unrolls.
+ *
+ * fixed_we keeps the inclusive prefix sums of the weights when K <= 64, and
+ * samples by counting the sums at or below a uniform target, which takes a
+ * handful of vector comparisons and no branches. Updates add to the suffix
+ * of the sums, in O(K) vector additions. Larger K use Wong and Easton's
+ * binary tree, descended in log2 K unrolled steps without branches.
+ *
+ * fixed_vose holds Vose's alias table in an array, built with fixed stacks
+ * rather than queues. A sample takes the column and the acceptance test
+ * from one 64 bit word.
+ *
+ * As K is a template parameter, the samplers are defined here rather than
+ * compiled for a list of types. Weights may be unsigned integers or floating
+ * point, as in weights.h, and the weights passed must number exactly K.
+ */
+#ifndef FIXED_H
+#define FIXED_H
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+#include "cpu.h"
+#include "rng.h"
+#include "weights.h"
+
+/*
+ * Returns the smallest power of two at least k.
+ */
+constexpr size_t fixed_round_pow2(size_t k) {
+  return k <= 1 ? 1 : 2 * fixed_round_pow2((k + 1) / 2);
+}
+
+constexpr int fixed_log2(size_t k) {
+  return k <= 1 ? 0 : 1 + fixed_log2(k / 2);
+}
+
+/*
+ * Counts the first N prefix sums at or below the target. The count is kept
+ * in an integer as wide as the weights so that the loop vectorizes; the
+ * kernels compile it for each vector extension.
+ */
+template<size_t N, class Weight>
+static inline size_t fixed_count(const Weight *prefix, Weight targ) {
+  typename std::conditional<sizeof(Weight) == 8, uint64_t, uint32_t>::type c = 0;
+  for (size_t i = 0; i < N; i ++)
+    c += prefix[i] <= targ;
+  return c;
+}
+
+template<size_t N, class Weight>
+using fixed_count_kernel = size_t (*)(const Weight *prefix, Weight targ);
+
+template<size_t N, class Weight>
+static size_t fixed_count_scalar(const Weight *prefix, Weight targ) {
+  return fixed_count<N>(prefix, targ);
+}
+
+#ifdef SAMPLING_X86
+template<size_t N, class Weight>
+__attribute__((target("avx2")))
+static size_t fixed_count_avx2(const Weight *prefix, Weight targ) {
+  return fixed_count<N>(prefix, targ);
+}
+
+template<size_t N, class Weight>
+__attribute__((target("avx2,avx512f,avx512vl,avx512bw,avx512dq")))
+static size_t fixed_count_avx512(const Weight *prefix, Weight targ) {
+  return fixed_count<N>(prefix, targ);
+}
+#endif
+
+template<size_t N, class Weight>
+static fixed_count_kernel<N, Weight> select_fixed_count() {
+#ifdef SAMPLING_X86
+  if (cpu_has_avx512())
+    return fixed_count_avx512<N, Weight>;
+  if (cpu_has_avx2())
+    return fixed_count_avx2<N, Weight>;
+#endif
+  return fixed_count_scalar<N, Weight>;
+}
+
+template<size_t K, class URBG = default_engine, class Weight = uint64_t, class Index = int>
+class basic_fixed_we {
+  static_assert(K > 0, "there must be at least one item");
+  static_assert(std::is_unsigned<Weight>::value || std::is_floating_point<Weight>::value,
+                "weights must be unsigned integers or floating point");
+  static_assert(std::is_integral<Index>::value, "indices must be integers");
+
+  private:
+    /*
+     * Prefix sums are padded with the total to a multiple of 64 bytes, and
+     * the tree has a leaf for each power of two at least K.
+     */
+    static const bool flat = K <= 64;
+    static const size_t pad = 64 / sizeof(Weight);
+    static const size_t width = flat ? (K + pad - 1) / pad * pad : fixed_round_pow2(K);
+    static const int depth = fixed_log2(width);
+
+    alignas(64) std::array<Weight, flat ? width : 2 * width> data;
+    URBG gen;
+
+    Weight total() const {
+      return flat ? data[width - 1] : data[1];
+    }
+
+    Weight weight(Index idx) const {
+      if (flat)
+        return data[idx] - (idx == 0 ? Weight(0) : data[idx - 1]);
+      return data[width + idx];
+    }
+
+  public:
+    typedef Weight weight_type;
+    typedef Index index_type;
+
+    /*
+     * Before C++17, new only aligns to alignof(max_align_t), short of the
+     * 64 bytes the sums are laid out for, so heap instances are allocated
+     * as in aligned.h.
+     */
+    static void *operator new(size_t size) {
+      void *ptr;
+      if (posix_memalign(&ptr, 64, size) != 0)
+        throw std::bad_alloc();
+      return ptr;
+    }
+
+    static void operator delete(void *ptr) {
+      free(ptr);
+    }
+
+    basic_fixed_we(const std::vector<Weight>& dist): basic_fixed_we(dist, random_seed()) {
+    }
+
+    basic_fixed_we(const std::vector<Weight>& dist, uint64_t seed): basic_fixed_we(dist, URBG(seed)) {
+    }
+
+    basic_fixed_we(const std::vector<Weight>& dist, const URBG& engine): gen(engine) {
+      if (dist.size() != K)
+        throw std::invalid_argument("fixed_we needs exactly K weights");
+
+      data.fill(0);
+      if (flat) {
+        Weight sum = 0;
+        for (size_t i = 0; i < K; i ++)
+          data[i] = sum += dist[i];
+        for (size_t i = K; i < width; i ++)
+          data[i] = sum;
+      } else {
+        for (size_t i = 0; i < K; i ++)
+          data[width + i] = dist[i];
+        for (size_t node = width - 1; node >= 1; node --)
+          data[node] = data[2 * node] + data[2 * node + 1];
+      }
+    }
+
+    /*
+     * Counts the prefix sums at or below the target, or descends the tree,
+     * going right whenever the target is at least the left child's sum. As
+     * in we, floating point sums may round so that the target overshoots
+     * the right subtree, so an empty right subtree is never entered.
+     */
+    Index sample() {
+      Weight targ = uniform_target(total(), gen);
+      if (flat) {
+        static const fixed_count_kernel<width, Weight> count = select_fixed_count<width, Weight>();
+        return count(data.data(), targ);
+      }
+
+      size_t node = 1;
+      for (int level = 0; level < depth; level ++) {
+        Weight left = data[2 * node];
+        bool right = targ >= left && (std::is_integral<Weight>::value || data[2 * node + 1] != 0);
+        targ -= right ? left : Weight(0);
+        node = 2 * node + right;
+      }
+      return node - width;
+    }
+
+    void update(Index idx, Weight value) {
+      if (flat) {
+        delta_update(idx, value - weight(idx));
+        return;
+      }
+
+      size_t node = width + idx;
+      data[node] = value;
+      for (int level = 0; level < depth; level ++) {
+        node /= 2;
+        data[node] = data[2 * node] + data[2 * node + 1];
+      }
+    }
+
+    void delta_update(Index idx, Weight delta) {
+      if (flat) {
+        for (size_t i = idx; i < width; i ++)
+          data[i] += delta;
+        return;
+      }
+      update(idx, weight(idx) + delta);
+    }
+};
+
+template<size_t K, class URBG = default_engine, class Weight = uint64_t, class Index = int>
+class basic_fixed_vose {
+  static_assert(K > 0, "there must be at least one item");
+  static_assert(std::is_unsigned<Weight>::value || std::is_floating_point<Weight>::value,
+                "weights must be unsigned integers or floating point");
+  static_assert(std::is_integral<Index>::value, "indices must be integers");
+  static_assert(URBG::min() == 0 && URBG::max() == UINT64_MAX, "fixed_vose requires a 64 bit engine");
+
+  private:
+    struct fixed_entry {
+      double main_p;
+      Index alt_i;
+    };
+
+    std::array<Weight, K> dist;
+    std::array<fixed_entry, K> table;
+    URBG gen;
+    double total;
+    double scale;
+    bool stale_table;
+
+    /*
+     * Vose's method, with the light and heavy items on stacks. Thresholds
+     * are in units of weight and a column holds total / K, the slot size.
+     * Items left on either stack by rounding fill their own column.
+     */
+    void rebuild_alias_table() {
+      std::array<Index, K> light, heavy;
+      std::array<double, K> scaled;
+      size_t lights = 0, heavies = 0;
+
+      total = 0;
+      for (size_t i = 0; i < K; i ++)
+        total += dist[i];
+      const double slot = total / K;
+      scale = std::ldexp(slot, -64);
+      stale_table = false;
+
+      for (size_t i = 0; i < K; i ++) {
+        scaled[i] = (double) dist[i] * K;
+        if (scaled[i] < total)
+          light[lights ++] = i;
+        else
+          heavy[heavies ++] = i;
+      }
+
+      while (lights > 0 && heavies > 0) {
+        Index l = light[-- lights];
+        Index g = heavy[heavies - 1];
+        table[l] = { scaled[l] / K, g };
+        scaled[g] -= total - scaled[l];
+        if (scaled[g] < total) {
+          heavies --;
+          light[lights ++] = g;
+        }
+      }
+      while (heavies > 0) {
+        Index g = heavy[-- heavies];
+        table[g] = { slot, g };
+      }
+      while (lights > 0) {
+        Index l = light[-- lights];
+        table[l] = { slot, l };
+      }
+    }
+
+  public:
+    typedef Weight weight_type;
+    typedef Index index_type;
+
+    basic_fixed_vose(const std::vector<Weight>& dist): basic_fixed_vose(dist, random_seed()) {
+    }
+
+    basic_fixed_vose(const std::vector<Weight>& dist, uint64_t seed): basic_fixed_vose(dist, URBG(seed)) {
+    }
+
+    basic_fixed_vose(const std::vector<Weight>& dist, const URBG& engine): gen(engine) {
+      if (dist.size() != K)
+        throw std::invalid_argument("fixed_vose needs exactly K weights");
+
+      for (size_t i = 0; i < K; i ++)
+        this->dist[i] = dist[i];
+      rebuild_alias_table();
+    }
+
+    /*
+     * The high word of x * K is the column and the low word the position
+     * within it, which is accepted below the threshold.
+     */
+    Index sample() {
+      if (stale_table)
+        rebuild_alias_table();
+
+      unsigned __int128 x = (unsigned __int128) gen() * K;
+      Index a = x >> 64;
+      double b = (double) (uint64_t) x * scale;
+      return b < table[a].main_p ? a : table[a].alt_i;
+    }
+
+    void update(Index idx, Weight value) {
+      dist[idx] = value;
+      stale_table = true;
+    }
+
+    void delta_update(Index idx, Weight delta) {
+      update(idx, dist[idx] + delta);
+    }
+};
+
+template<size_t K>
+using fixed_we = basic_fixed_we<K>;
+
+template<size_t K>
+using fixed_vose = basic_fixed_vose<K>;
+
+#endif
@@ -0,0 +1,176 @@
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "image.h"
+
+static const char image_magic[8] = { 'S', 'M', 'P', 'L', 'I', 'M', 'G', '\0' };
+static const size_t image_align = 64;
+
+/*
+ * FNV-1a over 64 bit words, with a final partial word padded with zeros.
+ */
+class image_checksum {
+  private:
+    uint64_t hash;
+    uint64_t word;
+    int filled;
+
+    void mix(uint64_t w) {
+      hash = (hash ^ w) * 0x100000001B3ULL;
+    }
+
+  public:
+    image_checksum(): hash(0xCBF29CE484222325ULL), word(0), filled(0) {}
+
+    void update(const void *data, size_t bytes) {
+      const unsigned char *p = static_cast<const unsigned char*>(data);
+      while (bytes > 0 && filled > 0) {
+        word |= (uint64_t) *p ++ << (8 * filled);
+        bytes --;
+        if (++ filled == 8) {
+          mix(word);
+          word = 0;
+          filled = 0;
+        }
+      }
+      for (; bytes >= 8; p += 8, bytes -= 8) {
+        uint64_t w;
+        std::memcpy(&w, p, 8);
+        mix(w);
+      }
+      for (; bytes > 0; bytes --)
+        word |= (uint64_t) *p ++ << (8 * filled ++);
+    }
+
+    uint64_t value() {
+      if (filled > 0) {
+        mix(word);
+        word = 0;
+        filled = 0;
+      }
+      return hash;
+    }
+};
+
+static size_t align_up(size_t offset) {
+  return (offset + image_align - 1) / image_align * image_align;
+}
+
+image_header make_image_header(image_kind kind, uint32_t weight_type, uint32_t index_type, uint64_t k, double total) {
+  image_header header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, image_magic, sizeof(image_magic));
+  header.version = image_version;
+  header.kind = kind;
+  header.weight_type = weight_type;
+  header.index_type = index_type;
+  header.k = k;
+  header.total = total;
+  return header;
+}
+
+/*
+ * Writes the header and sections, filling in the offsets and checksum.
+ */
+void write_image(const std::string& path, image_header header, const std::vector<image_section>& sections) {
+  if (sections.size() > image_sections)
+    throw std::runtime_error("too many image sections");
+
+  static const char zeros[image_align] = {};
+  image_checksum checksum;
+  size_t offset = sizeof(header);
+  for (size_t i = 0; i < sections.size(); i ++) {
+    size_t start = align_up(offset);
+    checksum.update(zeros, start - offset);
+    checksum.update(sections[i].data, sections[i].bytes);
+    header.offsets[i] = start;
+    offset = start + sections[i].bytes;
+  }
+  header.checksum = checksum.value();
+
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  if (!file)
+    throw std::runtime_error("cannot create image " + path);
+
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  offset = sizeof(header);
+  for (size_t i = 0; i < sections.size(); i ++) {
+    file.write(zeros, header.offsets[i] - offset);
+    file.write(static_cast<const char*>(sections[i].data), sections[i].bytes);
+    offset = header.offsets[i] + sections[i].bytes;
+  }
+
+  if (!file.flush())
+    throw std::runtime_error("cannot write image " + path);
+}
+
+mapped_image::mapped_image(const std::string& path): base(MAP_FAILED), length(0) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw std::runtime_error("cannot open image " + path);
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(image_header)) {
+    close(fd);
+    throw std::runtime_error("truncated image " + path);
+  }
+
+  length = st.st_size;
+  base = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    throw std::runtime_error("cannot map image " + path);
+
+  const image_header &h = header();
+  if (std::memcmp(h.magic, image_magic, sizeof(image_magic)) != 0 || h.version != image_version) {
+    munmap(base, length);
+    throw std::runtime_error("not a version " + std::to_string(image_version) + " sampler image: " + path);
+  }
+}
+
+mapped_image::~mapped_image() {
+  munmap(base, length);
+}
+
+const image_header& mapped_image::header() const {
+  return *static_cast<const image_header*>(base);
+}
+
+/*
+ * Returns the start of a section, checking that it holds the given number of
+ * bytes within the file.
+ */
+void* mapped_image::section(int i, size_t bytes) const {
+  if (i < 0 || i >= image_sections)
+    throw std::runtime_error("image section out of bounds");
+  uint64_t offset = header().offsets[i];
+  if (offset < sizeof(image_header) || offset % image_align != 0 || offset > length || bytes > length - offset)
+    throw std::runtime_error("image section out of bounds");
+  return static_cast<char*>(base) + offset;
+}
+
+/*
+ * Checks that the image was written by the given sampler with the given
+ * weight and index types.
+ */
+void mapped_image::check(image_kind kind, uint32_t weight_type, uint32_t index_type) const {
+  const image_header &h = header();
+  if (h.kind != kind)
+    throw std::runtime_error("image holds a different sampler");
+  if (h.weight_type != weight_type || h.index_type != index_type)
+    throw std::runtime_error("image holds different weight or index types");
+}
+
+/*
+ * Recomputes the checksum over every byte after the header. Samplers that
+ * have been updated since mapping the image no longer match it.
+ */
+bool mapped_image::verify() const {
+  image_checksum checksum;
+  checksum.update(static_cast<const char*>(base) + sizeof(image_header), length - sizeof(image_header));
+  return checksum.value() == header().checksum;
+}
@@ -0,0 +1,145 @@
+/*
+ * Serialized sampler images, so that built tables and trees can be mapped
+ * into memory at startup instead of constructed. An image is a 64 byte header
+ * followed by the sampler's arrays, each starting on a 64 byte boundary and
+ * stored in the native layout of the machine that wrote it:
+ *
+ *   magic     "SMPLIMG\0"
+ *   version   image_version
+ *   kind      which sampler wrote the image
+ *   types     codes for the weight and index types
+ *   k         number of items, or of leaves for WE
+ *   total     total weight
+ *   checksum  over every byte after the header
+ *   offsets   of up to two arrays from the start of the file
+ *
+ * Images are mapped privately, so the pages are shared through the page cache
+ * by every process mapping the same file until a sampler updates them, at
+ * which point the process gets its own copy of the touched pages and the file
+ * is left unchanged. Samplers constructed from the same mapped_image share
+ * its pages, updates included, so a sampler that will be updated should map
+ * the file itself. Opening an image checks the header and bounds but not
+ * the checksum, which would touch every page; verify() does so on demand.
+ * Failures to read or write an image throw std::runtime_error.
+ */
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+static const uint32_t image_version = 1;
+static const int image_sections = 2;
+
+enum image_kind : uint32_t {
+  image_we = 1,
+  image_vose = 2,
+};
+
+struct image_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t kind;
+  uint32_t weight_type;
+  uint32_t index_type;
+  uint64_t k;
+  double total;
+  uint64_t checksum;
+  uint64_t offsets[image_sections];
+};
+
+static_assert(sizeof(image_header) == 64, "image header must fill one cache line");
+
+/*
+ * Identifies an arithmetic type by its size, with flags for floating point
+ * and signed types.
+ */
+template<class T>
+constexpr uint32_t image_type() {
+  return sizeof(T) | (std::is_floating_point<T>::value ? 0x100 : 0) | (std::is_signed<T>::value ? 0x200 : 0);
+}
+
+/*
+ * A read-only file mapped privately into memory.
+ */
+class mapped_image {
+  private:
+    void *base;
+    size_t length;
+
+  public:
+    explicit mapped_image(const std::string& path);
+    ~mapped_image();
+    mapped_image(const mapped_image&) = delete;
+    mapped_image& operator=(const mapped_image&) = delete;
+
+    const image_header& header() const;
+    void* section(int i, size_t bytes) const;
+    void check(image_kind kind, uint32_t weight_type, uint32_t index_type) const;
+    bool verify() const;
+};
+
+/*
+ * A contiguous array of one sampler's image, written with write_image.
+ */
+struct image_section {
+  const void *data;
+  size_t bytes;
+};
+
+void write_image(const std::string& path, image_header header, const std::vector<image_section>& sections);
+image_header make_image_header(image_kind kind, uint32_t weight_type, uint32_t index_type, uint64_t k, double total);
+
+/*
+ * An array that is either owned or a view of a section of a mapped image,
+ * which it keeps alive. Copies are always owned, since copies sharing a
+ * private mapping would see each other's updates.
+ */
+template<class T>
+class image_array {
+  private:
+    std::vector<T> owned;
+    std::shared_ptr<mapped_image> image;
+    T *items;
+    size_t count;
+
+  public:
+    image_array(): items(nullptr), count(0) {}
+
+    explicit image_array(size_t n, const T& value = T()): owned(n, value), items(owned.data()), count(n) {}
+
+    explicit image_array(const std::vector<T>& values): owned(values), items(owned.data()), count(values.size()) {}
+
+    image_array(std::shared_ptr<mapped_image> image, int section, size_t n):
+      image(image), items(static_cast<T*>(image->section(section, n * sizeof(T)))), count(n) {}
+
+    image_array(const image_array& other): owned(other.items, other.items + other.count), items(owned.data()), count(other.count) {}
+
+    image_array(image_array&& other): owned(std::move(other.owned)), image(std::move(other.image)), items(other.items), count(other.count) {
+      other.items = nullptr;
+      other.count = 0;
+    }
+
+    image_array& operator=(image_array other) {
+      owned.swap(other.owned);
+      image.swap(other.image);
+      std::swap(items, other.items);
+      std::swap(count, other.count);
+      return *this;
+    }
+
+    T& operator[](size_t i) { return items[i]; }
+    const T& operator[](size_t i) const { return items[i]; }
+    T* data() { return items; }
+    const T* data() const { return items; }
+    size_t size() const { return count; }
+    T* begin() { return items; }
+    T* end() { return items + count; }
+    const T* begin() const { return items; }
+    const T* end() const { return items + count; }
+};
+
+#endif
@@ -0,0 +1,328 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include "cpu.h"
+#include "logits.h"
+#include "vose.h"
+
+#ifdef SAMPLING_X86
+#include <immintrin.h>
+#endif
+
+/*
+ * Cephes' single precision exponential: x = n ln 2 + r with |r| <= ln 2 / 2,
+ * ln 2 split in two for an exact reduction, and e^r from a degree 7
+ * polynomial. Arguments below exp_floor flush to zero, which keeps 2^n
+ * normal and maps -infinity to zero.
+ */
+static const float exp_floor = -87.0f;
+static const float exp_log2e = 1.44269504088896341f;
+static const float exp_ln2_hi = 0.693359375f;
+static const float exp_ln2_lo = -2.12194440e-4f;
+static const float exp_p0 = 1.9875691500e-4f;
+static const float exp_p1 = 1.3981999507e-3f;
+static const float exp_p2 = 8.3334519073e-3f;
+static const float exp_p3 = 4.1665795894e-2f;
+static const float exp_p4 = 1.6666665459e-1f;
+static const float exp_p5 = 5.0000001201e-1f;
+
+static inline float scaled_exp(float logit, float max, float inv_temperature) {
+  float x = (logit - max) * inv_temperature;
+  if (x < exp_floor)
+    return 0;
+
+  float fn = std::floor(x * exp_log2e + 0.5f);
+  float r = x - fn * exp_ln2_hi - fn * exp_ln2_lo;
+  float p = exp_p0;
+  p = p * r + exp_p1;
+  p = p * r + exp_p2;
+  p = p * r + exp_p3;
+  p = p * r + exp_p4;
+  p = p * r + exp_p5;
+  float y = p * r * r + r + 1.0f;
+
+  uint32_t bits = (uint32_t) ((int32_t) fn + 127) << 23;
+  float scale;
+  std::memcpy(&scale, &bits, sizeof(scale));
+  return y * scale;
+}
+
+typedef float (*max_kernel)(const float *logits, size_t n);
+typedef void (*exp_kernel)(const float *logits, size_t n, float max, float inv_temperature, float *out);
+
+static float max_scalar(const float *logits, size_t n) {
+  float max = -std::numeric_limits<float>::infinity();
+  for (size_t i = 0; i < n; i ++)
+    max = logits[i] > max ? logits[i] : max;
+  return max;
+}
+
+static void exp_scalar(const float *logits, size_t n, float max, float inv_temperature, float *out) {
+  for (size_t i = 0; i < n; i ++)
+    out[i] = scaled_exp(logits[i], max, inv_temperature);
+}
+
+#ifdef SAMPLING_X86
+__attribute__((target("avx2")))
+static float max_avx2(const float *logits, size_t n) {
+  __m256 acc = _mm256_set1_ps(-std::numeric_limits<float>::infinity());
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8)
+    acc = _mm256_max_ps(acc, _mm256_loadu_ps(logits + i));
+
+  float lanes[8];
+  _mm256_storeu_ps(lanes, acc);
+  return std::max(max_scalar(lanes, 8), max_scalar(logits + i, n - i));
+}
+
+__attribute__((target("avx2")))
+static void exp_avx2(const float *logits, size_t n, float max, float inv_temperature, float *out) {
+  const __m256 vmax = _mm256_set1_ps(max);
+  const __m256 vinv = _mm256_set1_ps(inv_temperature);
+  const __m256 floor = _mm256_set1_ps(exp_floor);
+
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 x = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(logits + i), vmax), vinv);
+    __m256 under = _mm256_cmp_ps(x, floor, _CMP_LT_OQ);
+    x = _mm256_max_ps(x, floor);
+
+    __m256 fn = _mm256_floor_ps(_mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(exp_log2e)), _mm256_set1_ps(0.5f)));
+    __m256 r = _mm256_sub_ps(_mm256_sub_ps(x, _mm256_mul_ps(fn, _mm256_set1_ps(exp_ln2_hi))),
+                             _mm256_mul_ps(fn, _mm256_set1_ps(exp_ln2_lo)));
+    __m256 p = _mm256_set1_ps(exp_p0);
+    p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(exp_p1));
+    p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(exp_p2));
+    p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(exp_p3));
+    p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(exp_p4));
+    p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(exp_p5));
+    __m256 y = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(p, r), r), r), _mm256_set1_ps(1.0f));
+
+    __m256i bits = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(fn), _mm256_set1_epi32(127)), 23);
+    y = _mm256_mul_ps(y, _mm256_castsi256_ps(bits));
+    _mm256_storeu_ps(out + i, _mm256_andnot_ps(under, y));
+  }
+
+  exp_scalar(logits + i, n - i, max, inv_temperature, out + i);
+}
+
+__attribute__((target("avx2,avx512f")))
+static float max_avx512(const float *logits, size_t n) {
+  __m512 acc = _mm512_set1_ps(-std::numeric_limits<float>::infinity());
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16)
+    acc = _mm512_max_ps(acc, _mm512_loadu_ps(logits + i));
+
+  return std::max(_mm512_reduce_max_ps(acc), max_scalar(logits + i, n - i));
+}
+
+/*
+ * AVX-512 implies FMA, which the compiler would otherwise use to fuse the
+ * polynomial's multiplies and adds, rounding differently from the scalar code.
+ */
+__attribute__((target("avx2,avx512f"), optimize("fp-contract=off")))
+static void exp_avx512(const float *logits, size_t n, float max, float inv_temperature, float *out) {
+  const __m512 vmax = _mm512_set1_ps(max);
+  const __m512 vinv = _mm512_set1_ps(inv_temperature);
+  const __m512 floor = _mm512_set1_ps(exp_floor);
+
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512 x = _mm512_mul_ps(_mm512_sub_ps(_mm512_loadu_ps(logits + i), vmax), vinv);
+    __mmask16 keep = _mm512_cmp_ps_mask(x, floor, _CMP_GE_OQ);
+    x = _mm512_max_ps(x, floor);
+
+    __m512 fn = _mm512_roundscale_ps(_mm512_add_ps(_mm512_mul_ps(x, _mm512_set1_ps(exp_log2e)), _mm512_set1_ps(0.5f)),
+                                     _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+    __m512 r = _mm512_sub_ps(_mm512_sub_ps(x, _mm512_mul_ps(fn, _mm512_set1_ps(exp_ln2_hi))),
+                             _mm512_mul_ps(fn, _mm512_set1_ps(exp_ln2_lo)));
+    __m512 p = _mm512_set1_ps(exp_p0);
+    p = _mm512_add_ps(_mm512_mul_ps(p, r), _mm512_set1_ps(exp_p1));
+    p = _mm512_add_ps(_mm512_mul_ps(p, r), _mm512_set1_ps(exp_p2));
+    p = _mm512_add_ps(_mm512_mul_ps(p, r), _mm512_set1_ps(exp_p3));
+    p = _mm512_add_ps(_mm512_mul_ps(p, r), _mm512_set1_ps(exp_p4));
+    p = _mm512_add_ps(_mm512_mul_ps(p, r), _mm512_set1_ps(exp_p5));
+    __m512 y = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(_mm512_mul_ps(p, r), r), r), _mm512_set1_ps(1.0f));
+
+    __m512i bits = _mm512_slli_epi32(_mm512_add_epi32(_mm512_cvtps_epi32(fn), _mm512_set1_epi32(127)), 23);
+    y = _mm512_mul_ps(y, _mm512_castsi512_ps(bits));
+    _mm512_storeu_ps(out + i, _mm512_maskz_mov_ps(keep, y));
+  }
+
+  exp_scalar(logits + i, n - i, max, inv_temperature, out + i);
+}
+#endif
+
+static max_kernel select_max_kernel() {
+#ifdef SAMPLING_X86
+  if (cpu_has_avx512())
+    return max_avx512;
+  if (cpu_has_avx2())
+    return max_avx2;
+#endif
+  return max_scalar;
+}
+
+static exp_kernel select_exp_kernel() {
+#ifdef SAMPLING_X86
+  if (cpu_has_avx512())
+    return exp_avx512;
+  if (cpu_has_avx2())
+    return exp_avx2;
+#endif
+  return exp_scalar;
+}
+
+float logit_max(logit_span logits) {
+  static const max_kernel kernel = select_max_kernel();
+  return kernel(logits.data, logits.size);
+}
+
+/*
+ * Writes exp((l - max) * inv_temperature) for n logits.
+ */
+void logit_exp(const float *logits, size_t n, float max, float inv_temperature, float *out) {
+  static const exp_kernel kernel = select_exp_kernel();
+  kernel(logits, n, max, inv_temperature, out);
+}
+
+/*
+ * Items are exponentiated in blocks small enough to stay in L1.
+ */
+static const size_t logit_block = 1024;
+
+/*
+ * Sums a block in eight lanes of doubles, combined in a fixed order.
+ */
+static double block_sum(const float *values, size_t n) {
+  double lanes[8] = {};
+  for (size_t i = 0; i < n; i ++)
+    lanes[i % 8] += values[i];
+
+  double sum = 0;
+  for (int j = 0; j < 8; j ++)
+    sum += lanes[j];
+  return sum;
+}
+
+/*
+ * Writes the weights of the given logits and returns their total.
+ */
+template<class Weight>
+double logit_weights(logit_span logits, double temperature, Weight *out) {
+  const float max = logit_max(logits);
+  const float inv_temperature = 1.0 / temperature;
+  const double scale = std::is_integral<Weight>::value ?
+    std::ldexp(1.0, std::numeric_limits<Weight>::digits - 2) / std::max<size_t>(logits.size, 1) : 1.0;
+
+  float buffer[logit_block];
+  double total = 0;
+  for (size_t base = 0; base < logits.size; base += logit_block) {
+    size_t n = std::min(logit_block, logits.size - base);
+    logit_exp(logits.data + base, n, max, inv_temperature, buffer);
+    for (size_t i = 0; i < n; i ++) {
+      Weight w = std::is_integral<Weight>::value ? (Weight) (buffer[i] * scale + 0.5) : (Weight) buffer[i];
+      out[base + i] = w;
+      total += w;
+    }
+  }
+  return total;
+}
+
+/*
+ * Draws n samples with replacement. Sorted targets in [0, total) are matched
+ * against the block sums, and each block holding a target is exponentiated
+ * again and scanned in order. Where rounding leaves the running sum short of
+ * the block sum, the remaining targets of the block go to the last item of
+ * positive weight so far, which may lie in an earlier block.
+ */
+template<class URBG>
+std::vector<int> sample_from_logits(logit_span logits, double temperature, size_t n, URBG& gen) {
+  const size_t k = logits.size;
+  if (logit_max(logits) == -std::numeric_limits<float>::infinity())
+    throw std::invalid_argument("sample_from_logits needs a finite logit");
+  if (n >= 8 * k) {
+    basic_vose<default_engine, double, int> table(logits, temperature, gen());
+    return table.sample_n(n);
+  }
+
+  const float max = logit_max(logits);
+  const float inv_temperature = 1.0 / temperature;
+  const size_t blocks = (k + logit_block - 1) / logit_block;
+
+  float buffer[logit_block];
+  std::vector<double> sums(blocks);
+  double total = 0;
+  for (size_t b = 0; b < blocks; b ++) {
+    size_t len = std::min(logit_block, k - b * logit_block);
+    logit_exp(logits.data + b * logit_block, len, max, inv_temperature, buffer);
+    sums[b] = block_sum(buffer, len);
+    total += sums[b];
+  }
+
+  const double below_total = std::nextafter(total, 0.0);
+  std::vector<std::pair<double, size_t>> targets(n);
+  for (size_t j = 0; j < n; j ++)
+    targets[j] = std::make_pair(std::min(uniform01(gen) * total, below_total), j);
+  std::sort(targets.begin(), targets.end());
+
+  std::vector<int> out(n);
+  double before = 0;
+  int last = -1;
+  for (size_t b = 0, j = 0; j < n; b ++) {
+    double end = before + sums[b];
+    bool last_block = b + 1 == blocks;
+    if (!last_block && targets[j].first >= end) {
+      before = end;
+      continue;
+    }
+
+    size_t base = b * logit_block;
+    size_t len = std::min(logit_block, k - base);
+    logit_exp(logits.data + base, len, max, inv_temperature, buffer);
+
+    double cum = before;
+    for (size_t i = 0; i < len && j < n; i ++) {
+      if (buffer[i] == 0)
+        continue;
+      cum += buffer[i];
+      last = base + i;
+      while (j < n && targets[j].first < cum && (last_block || targets[j].first < end))
+        out[targets[j ++].second] = last;
+    }
+    while (j < n && (last_block || targets[j].first < end))
+      out[targets[j ++].second] = last;
+
+    before = end;
+  }
+
+  return out;
+}
+
+template<class URBG>
+int sample_from_logits(logit_span logits, double temperature, URBG& gen) {
+  return sample_from_logits(logits, temperature, 1, gen)[0];
+}
+
+int sample_from_logits(logit_span logits, double temperature) {
+  return sample_from_logits(logits, temperature, thread_engine());
+}
+
+std::vector<int> sample_from_logits(logit_span logits, double temperature, size_t n) {
+  return sample_from_logits(logits, temperature, n, thread_engine());
+}
+
+#define INSTANTIATE(URBG) \
+  template int sample_from_logits<URBG>(logit_span logits, double temperature, URBG& gen); \
+  template std::vector<int> sample_from_logits<URBG>(logit_span logits, double temperature, size_t n, URBG& gen);
+SAMPLING_ENGINES(INSTANTIATE)
+
+#define INSTANTIATE_WEIGHTS(Weight) template double logit_weights<Weight>(logit_span logits, double temperature, Weight *out);
+INSTANTIATE_WEIGHTS(uint32_t)
+INSTANTIATE_WEIGHTS(uint64_t)
+INSTANTIATE_WEIGHTS(float)
+INSTANTIATE_WEIGHTS(double)
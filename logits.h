@@ -0,0 +1,51 @@
+/*
+ * Sampling from unnormalized log-probabilities. Item i is drawn with
+ * probability proportional to exp(l_i / T) for logits l and temperature T.
+ *
+ * The samplers can be built from logits directly, writing the weights into
+ * their own storage. Weights are exp((l_i - max) / T); integer weight types
+ * are scaled so that the total stays below a quarter of their range, and
+ * items whose scaled weight rounds to zero are never drawn.
+ *
+ * For distributions sampled only once or a few times, sample_from_logits
+ * avoids building a sampler. It takes the maximum, then the exponentials with
+ * their sums over blocks of items, and resolves every sample by rescanning
+ * just the block it falls in. Both passes use vector kernels where the CPU
+ * supports them, computing the exponential with the same polynomial as the
+ * scalar code, so results are identical on every machine. From n >= 8k
+ * samples on, an alias table is built instead. At least one logit must be
+ * finite, or sample_from_logits throws std::invalid_argument.
+ */
+#ifndef LOGITS_H
+#define LOGITS_H
+
+#include <cstdint>
+#include <vector>
+#include "rng.h"
+
+/*
+ * A view of k logits, which may include -infinity for items that are never
+ * drawn.
+ */
+struct logit_span {
+  const float *data;
+  size_t size;
+
+  logit_span(const float *data, size_t size): data(data), size(size) {}
+  explicit logit_span(const std::vector<float>& logits): data(logits.data()), size(logits.size()) {}
+};
+
+float logit_max(logit_span logits);
+void logit_exp(const float *logits, size_t n, float max, float inv_temperature, float *out);
+
+template<class Weight>
+double logit_weights(logit_span logits, double temperature, Weight *out);
+
+template<class URBG>
+int sample_from_logits(logit_span logits, double temperature, URBG& gen);
+template<class URBG>
+std::vector<int> sample_from_logits(logit_span logits, double temperature, size_t n, URBG& gen);
+int sample_from_logits(logit_span logits, double temperature = 1.0);
+std::vector<int> sample_from_logits(logit_span logits, double temperature, size_t n);
+
+#endif
@@ -1,15 +1,40 @@
+#include <algorithm>
+#include <climits>
 #include <gsl/gsl_randist.h>
 #include <gsl/gsl_rng.h>
 #include <random>
 #include <vector>
 #include "multi.h"
+#include "thread_pool.h"
 
-static std::vector<long double> unif_gen(int n) {
+/*
+ * Exposes a C++ random engine to GSL, so that GSL's samplers draw from the
+ * same engine as the rest of the library.
+ */
+template<class URBG>
+struct gsl_engine {
+  static void set(void *state, unsigned long int seed) {
+  }
+
+  static unsigned long int get(void *state) {
+    return (*static_cast<URBG*>(state))() - URBG::min();
+  }
+
+  static double get_double(void *state) {
+    return uniform01(*static_cast<URBG*>(state));
+  }
+
+  static const gsl_rng_type type;
+};
+
+template<class URBG>
+const gsl_rng_type gsl_engine<URBG>::type = { "urbg", URBG::max() - URBG::min(), 0, 0, set, get, get_double };
+
+template<class URBG>
+static std::vector<long double> unif_gen(int n, URBG& gen) {
   std::vector<long double> dist(n);
   std::vector<long double> expo(n + 1);
 
-  std::random_device rd;
-  std::mt19937_64 gen(rd());
   std::uniform_real_distribution<> unif_dis(0.0, 1.0);
 
   long double total = 0;
@@ -32,8 +57,9 @@ static std::vector<long double> unif_gen(int n) {
 /*
  * The O(n + k) algorithm for multinomial sampling.
  */
-std::vector<uint64_t> full_uniform(int n, const std::vector<long double>& dist) {
-  std::vector<long double> unifs = unif_gen(n);
+template<class URBG>
+std::vector<uint64_t> full_uniform(int n, const std::vector<long double>& dist, URBG& gen) {
+  std::vector<long double> unifs = unif_gen(n, gen);
   std::vector<uint64_t> output(dist.size());
 
   long double cum = dist.front();
@@ -50,8 +76,9 @@ std::vector<uint64_t> full_uniform(int n, const std::vector<long double>& dist)
 /*
  * The O(n + k log n) algorithm for multinomial sampling.
  */
-std::vector<uint64_t> full_uniform_bin_search(int n, const std::vector<long double>& dist) {
-  std::vector<long double> unifs = unif_gen(n);
+template<class URBG>
+std::vector<uint64_t> full_uniform_bin_search(int n, const std::vector<long double>& dist, URBG& gen) {
+  std::vector<long double> unifs = unif_gen(n, gen);
   std::vector<uint64_t> output(dist.size());
 
   long double cum = 0;
@@ -60,7 +87,7 @@ std::vector<uint64_t> full_uniform_bin_search(int n, const std::vector<long doub
   for (int i = 0; i < dist.size(); i ++) {
     cum += dist[i];
     auto loc = std::lower_bound(last, unifs.end(), cum);
-    output[i] = std::distance(last, loc) - 1;
+    output[i] = std::distance(last, loc);
     last = loc;
   }
 
@@ -71,7 +98,8 @@ std::vector<uint64_t> full_uniform_bin_search(int n, const std::vector<long doub
 /*
  * The O(n log k) algorithm for multinomial sampling.
  */
-std::vector<uint64_t> reverse_bin_search(int n, const std::vector<long double>& dist) {
+template<class URBG>
+std::vector<uint64_t> reverse_bin_search(int n, const std::vector<long double>& dist, URBG& gen) {
   std::vector<long double> dist_cum(dist.size());
   std::vector<uint64_t> output(dist.size());
   long double cum = 0;
@@ -80,42 +108,148 @@ std::vector<uint64_t> reverse_bin_search(int n, const std::vector<long double>&
     cum += dist[i];
   }
 
-  std::random_device rd;
-  std::mt19937_64 gen(rd());
   std::uniform_real_distribution<> unif(0, 1);
 
   for (int i = 0; i < n; i ++) {
-    int x = std::distance(dist_cum.begin(), std::lower_bound(dist_cum.begin(), dist_cum.end(), unif(gen))) - 1;
+    int x = std::distance(dist_cum.begin(), std::upper_bound(dist_cum.begin(), dist_cum.end(), unif(gen))) - 1;
     output[x] ++;
   }
 
   return output;
 }
 
+template<class URBG>
+uint64_t binomial(uint64_t n, double p, URBG& gen) {
+  if (p <= 0)
+    return 0;
+  if (p >= 1)
+    return n;
+
+  /* GSL takes the number of trials as an unsigned int */
+  gsl_rng r = { &gsl_engine<URBG>::type, &gen };
+  uint64_t count = 0;
+  for (; n > UINT_MAX; n -= UINT_MAX)
+    count += gsl_ran_binomial(&r, p, UINT_MAX);
+
+  return count + gsl_ran_binomial(&r, p, n);
+}
+
 /*
  * The O(k) BTPE algorithm for multinomial sampling.
  */
-std::vector<uint64_t> btpe(int n, const std::vector<long double>& dist) {
-  gsl_rng* r = gsl_rng_alloc(gsl_rng_taus);
-  std::random_device rd;
-  gsl_rng_set(r, rd());
-
+template<class URBG>
+std::vector<uint64_t> btpe(int n, const std::vector<long double>& dist, URBG& gen) {
   std::vector<uint64_t> output(dist.size());
 
-  double cum = 0;
-  uint64_t sampled = 0;
-  for (int i = 0; i < dist.size(); i ++) {
-    double p = dist[i] / (1 - cum);
-    uint64_t tot = n - sampled;
+  btpe_stream(n, dist.begin(), dist.end(), [&output](uint64_t i, uint64_t count) {
+    output[i] = count;
+  }, gen);
+
+  return output;
+}
 
-    output[i] = gsl_ran_binomial(r, p, tot);
+/* Categories per leaf block of the parallel splitting tree */
+static const size_t split_grain = 1 << 16;
 
-    cum += dist[i];
-    sampled += output[i];
+/*
+ * Seeds the engine of a node of the splitting tree, numbered from one at the
+ * root with children 2i and 2i + 1.
+ */
+static uint64_t node_seed(uint64_t seed, uint64_t node) {
+  splitmix64 mix(seed ^ (node * 0xD6E8FEB86659FD93ULL));
+  return mix();
+}
+
+/*
+ * Samples the counts of blocks [lo, hi) given that n trials fall in them,
+ * handing left subtrees to the pool and continuing down the right.
+ */
+template<class URBG>
+static void split_btpe(uint64_t n, const std::vector<long double>& dist, const std::vector<long double>& block_cum, std::vector<uint64_t>& output,
+                       uint64_t seed, uint64_t node, size_t lo, size_t hi, task_group& group) {
+  while (n > 0) {
+    URBG gen(node_seed(seed, node));
+
+    if (hi - lo == 1) {
+      size_t first = lo * split_grain;
+      size_t last = std::min(dist.size(), first + split_grain);
+      long double mass = block_cum[hi] - block_cum[lo];
+      btpe_stream(n, last - first, [&dist, first, mass](uint64_t i) {
+        return dist[first + i] / mass;
+      }, [&output, first](uint64_t i, uint64_t count) {
+        output[first + i] = count;
+      }, gen);
+      return;
+    }
+
+    size_t mid = lo + (hi - lo) / 2;
+    long double left = block_cum[mid] - block_cum[lo];
+    uint64_t count = binomial(n, left / (block_cum[hi] - block_cum[lo]), gen);
+    group.run([=, &dist, &block_cum, &output, &group] {
+      split_btpe<URBG>(count, dist, block_cum, output, seed, 2 * node, lo, mid, group);
+    });
+
+    n -= count;
+    node = 2 * node + 1;
+    lo = mid;
   }
+}
 
-  gsl_rng_free(r);
+template<class URBG>
+std::vector<uint64_t> parallel_btpe(uint64_t n, const std::vector<long double>& dist, uint64_t seed, thread_pool& pool) {
+  size_t blocks = (dist.size() + split_grain - 1) / split_grain;
+  std::vector<long double> block_cum(blocks + 1);
+  std::vector<uint64_t> output(dist.size());
+  if (blocks == 0)
+    return output;
+
+  parallel_for(pool, 0, blocks, 1, [&dist, &block_cum](size_t lo, size_t hi) {
+    for (size_t b = lo; b < hi; b ++) {
+      size_t last = std::min(dist.size(), (b + 1) * split_grain);
+      long double mass = 0;
+      for (size_t i = b * split_grain; i < last; i ++)
+        mass += dist[i];
+      block_cum[b + 1] = mass;
+    }
+  });
+  for (size_t b = 0; b < blocks; b ++)
+    block_cum[b + 1] += block_cum[b];
+
+  task_group group(pool);
+  split_btpe<URBG>(n, dist, block_cum, output, seed, 1, 0, blocks, group);
+  group.wait();
 
   return output;
 }
 
+template<class URBG>
+std::vector<uint64_t> parallel_btpe(uint64_t n, const std::vector<long double>& dist, uint64_t seed) {
+  return parallel_btpe<URBG>(n, dist, seed, thread_pool::shared());
+}
+
+std::vector<uint64_t> full_uniform(int n, const std::vector<long double>& dist) {
+  return full_uniform(n, dist, thread_engine());
+}
+
+std::vector<uint64_t> full_uniform_bin_search(int n, const std::vector<long double>& dist) {
+  return full_uniform_bin_search(n, dist, thread_engine());
+}
+
+std::vector<uint64_t> reverse_bin_search(int n, const std::vector<long double>& dist) {
+  return reverse_bin_search(n, dist, thread_engine());
+}
+
+std::vector<uint64_t> btpe(int n, const std::vector<long double>& dist) {
+  return btpe(n, dist, thread_engine());
+}
+
+#define INSTANTIATE(URBG) \
+  template uint64_t binomial(uint64_t n, double p, URBG& gen); \
+  template std::vector<uint64_t> full_uniform(int n, const std::vector<long double>& dist, URBG& gen); \
+  template std::vector<uint64_t> full_uniform_bin_search(int n, const std::vector<long double>& dist, URBG& gen); \
+  template std::vector<uint64_t> reverse_bin_search(int n, const std::vector<long double>& dist, URBG& gen); \
+  template std::vector<uint64_t> btpe(int n, const std::vector<long double>& dist, URBG& gen); \
+  template std::vector<uint64_t> parallel_btpe<URBG>(uint64_t n, const std::vector<long double>& dist, uint64_t seed, thread_pool& pool); \
+  template std::vector<uint64_t> parallel_btpe<URBG>(uint64_t n, const std::vector<long double>& dist, uint64_t seed);
+SAMPLING_ENGINES(INSTANTIATE)
+
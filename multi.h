@@ -3,16 +3,126 @@
  * of which are highly inefficient. Also included is the BTPE multinomial
  * method, the state-of-the-art with respect to real world performance in
  * multinomial sampling.
+ *
+ * Each method takes the random engine to draw from. The overloads without an
+ * engine use a per-thread engine seeded once from std::random_device.
  */
 #ifndef MULTI_H
 #define MULTI_H
 
+#include <cmath>
 #include <vector>
+#include "rng.h"
+
+class thread_pool;
+
+template<class URBG>
+std::vector<uint64_t> full_uniform(int n, const std::vector<long double>& dist, URBG& gen);
+template<class URBG>
+std::vector<uint64_t> full_uniform_bin_search(int n, const std::vector<long double>& dist, URBG& gen);
+template<class URBG>
+std::vector<uint64_t> reverse_bin_search(int n, const std::vector<long double>& dist, URBG& gen);
+template<class URBG>
+std::vector<uint64_t> btpe(int n, const std::vector<long double>& dist, URBG& gen);
 
 std::vector<uint64_t> full_uniform(int n, const std::vector<long double>& dist);
 std::vector<uint64_t> full_uniform_bin_search(int n, const std::vector<long double>& dist);
 std::vector<uint64_t> reverse_bin_search(int n, const std::vector<long double>& dist);
 std::vector<uint64_t> btpe(int n, const std::vector<long double>& dist);
 
-#endif
+/*
+ * Draws from the binomial distribution with n trials and success probability
+ * p, clamped to [0, 1], using GSL's BTPE implementation.
+ */
+template<class URBG>
+uint64_t binomial(uint64_t n, double p, URBG& gen);
+
+/*
+ * Streaming versions of BTPE. Category probabilities are read in order from
+ * an input range, or from a function mapping each index in [0, k) to its
+ * probability, and visit(index, count) is called for every category with a
+ * nonzero count. Beyond the input the memory used is O(1), and reading stops
+ * as soon as all n trials have been assigned.
+ *
+ * Where a category expects at least one of the remaining trials its count is
+ * drawn directly as a conditional binomial. Otherwise the position of the
+ * first remaining trial is drawn as the minimum of n uniforms, the categories
+ * before it are skipped with zero counts, and the category holding it
+ * receives that trial plus a binomial share of the rest. Sparse outputs
+ * therefore cost O(k) additions and O(1) random draws per nonzero count.
+ */
+template<class Source, class Visitor, class URBG>
+void btpe_stream_source(uint64_t n, Source next, Visitor visit, URBG& gen) {
+  long double start = 0;
+  long double p;
+  uint64_t i = 0;
+
+  while (n > 0 && next(p)) {
+    long double rest = 1 - start;
+    if (n * p >= rest) {
+      uint64_t count = binomial(n, p / rest, gen);
+      if (count > 0) {
+        visit(i, count);
+        n -= count;
+      }
+      start += p;
+      i ++;
+      continue;
+    }
 
+    long double first = start - rest * std::expm1(std::log(uniform01(gen)) / n);
+    while (start + p <= first) {
+      start += p;
+      i ++;
+      if (!next(p)) {
+        /* Rounding left the first trial past the end */
+        visit(i - 1, n);
+        return;
+      }
+    }
+
+    uint64_t count = 1 + binomial(n - 1, (start + p - first) / (1 - first), gen);
+    visit(i, count);
+    n -= count;
+    start += p;
+    i ++;
+  }
+}
+
+template<class InputIt, class Visitor, class URBG>
+void btpe_stream(uint64_t n, InputIt first, InputIt last, Visitor visit, URBG& gen) {
+  btpe_stream_source(n, [&first, last](long double& p) {
+    if (first == last)
+      return false;
+    p = *first;
+    ++first;
+    return true;
+  }, visit, gen);
+}
+
+template<class Generator, class Visitor, class URBG>
+void btpe_stream(uint64_t n, uint64_t k, Generator prob, Visitor visit, URBG& gen) {
+  uint64_t i = 0;
+  btpe_stream_source(n, [&i, k, &prob](long double& p) {
+    if (i == k)
+      return false;
+    p = prob(i ++);
+    return true;
+  }, visit, gen);
+}
+
+/*
+ * Parallel BTPE. The categories are split into fixed blocks, and a balanced
+ * binary tree over the blocks is walked top down: each internal node draws
+ * the binomial count of its left half, and the two halves are then sampled
+ * independently on the pool, with the blocks at the leaves sampled by
+ * btpe_stream. Every node seeds its own engine from the seed and its
+ * position in the tree, so the result depends only on the seed and not on
+ * the number of threads or the order in which subtrees run.
+ */
+template<class URBG = default_engine>
+std::vector<uint64_t> parallel_btpe(uint64_t n, const std::vector<long double>& dist, uint64_t seed, thread_pool& pool);
+template<class URBG = default_engine>
+std::vector<uint64_t> parallel_btpe(uint64_t n, const std::vector<long double>& dist, uint64_t seed);
+
+#endif
@@ -1,94 +1,181 @@
+#include <algorithm>
 #include <queue>
-#include <unordered_map>
 #include "mvn.h"
+#include "without_replacement.h"
 
-namespace std {
-  size_t hash<std::pair<uint64_t, uint64_t>>::operator()(const std::pair<uint64_t, uint64_t>& p) const {
-    size_t first = std::hash<uint64_t>{}(p.first);
-    size_t second = std::hash<uint64_t>{}(p.second);
+/*
+ * Expands to its argument only in builds that collect statistics.
+ */
+#ifdef SAMPLING_MVN_STATS
+#define MVN_STAT(...) __VA_ARGS__
 
-    size_t k = 0xC6A4A7935BD1E995UL;
-    second = ((second * k) >> 47) * k;
-    return (first ^ second) * k;
+/*
+ * Adds one operation of the given number of steps to a total and its
+ * histogram.
+ */
+static void count_steps(uint64_t& total, uint64_t *histogram, uint64_t steps) {
+  total += steps;
+  histogram[std::min<uint64_t>(steps, mvn_stats::bins - 1)] ++;
+}
+#else
+#define MVN_STAT(...)
+#endif
+
+mvn_stats& mvn_stats::operator+=(const mvn_stats& other) {
+  enabled = enabled || other.enabled;
+  samples += other.samples;
+  level_steps += other.level_steps;
+  root_steps += other.root_steps;
+  rejections += other.rejections;
+  updates += other.updates;
+  queued += other.queued;
+  migrations += other.migrations;
+  for (int i = 0; i < bins; i ++) {
+    level_histogram[i] += other.level_histogram[i];
+    root_histogram[i] += other.root_histogram[i];
+    rejection_histogram[i] += other.rejection_histogram[i];
+    queue_histogram[i] += other.queue_histogram[i];
+    migration_histogram[i] += other.migration_histogram[i];
   }
-};
+  nodes = std::max(nodes, other.nodes);
+  levels = std::max(levels, other.levels);
+  roots = std::max(roots, other.roots);
+  return *this;
+}
 
 static constexpr inline uint64_t binlog(uint64_t val) {
   return val == 0 ? 0 : 64 - __builtin_clzll(val);
 }
 
-mvn::mvn(const std::vector<uint64_t> &dist): gen(rd()), total_weight(0) {
+template<class URBG, class Weight, class Index>
+basic_mvn<URBG, Weight, Index>::basic_mvn(const std::vector<Weight> &dist): basic_mvn(dist, random_seed()) {
+}
+
+template<class URBG, class Weight, class Index>
+basic_mvn<URBG, Weight, Index>::basic_mvn(const std::vector<Weight> &dist, uint64_t seed): basic_mvn(dist, URBG(seed)) {
+}
+
+template<class URBG, class Weight, class Index>
+basic_mvn<URBG, Weight, Index>::basic_mvn(const std::vector<Weight> &dist, const URBG& engine): bucket_levels(0), total_weight(0), gen(engine) {
   construct_tree(dist);
 }
 
-void mvn::construct_tree(const std::vector<uint64_t> &dist) {
-  std::queue<mvn_node*> next_level;
-  base_nodes.resize(dist.size());
+template<class URBG, class Weight, class Index>
+basic_mvn<URBG, Weight, Index>::basic_mvn(logit_span logits, double temperature): basic_mvn(logits, temperature, random_seed()) {
+}
+
+template<class URBG, class Weight, class Index>
+basic_mvn<URBG, Weight, Index>::basic_mvn(logit_span logits, double temperature, uint64_t seed): basic_mvn(logits, temperature, URBG(seed)) {
+}
+
+/*
+ * Builds the forest from logits. The weights pass through a temporary
+ * vector, as the forest keeps them only in its nodes.
+ */
+template<class URBG, class Weight, class Index>
+basic_mvn<URBG, Weight, Index>::basic_mvn(logit_span logits, double temperature, const URBG& engine): bucket_levels(0), total_weight(0), gen(engine) {
+  std::vector<Weight> dist(logits.size);
+  logit_weights(logits, temperature, dist.data());
+  construct_tree(dist);
+}
+
+/*
+ * Returns the arena index of the bucket node at the given level (at least
+ * one) holding children whose sums have the given binary logarithm.
+ */
+template<class URBG, class Weight, class Index>
+uint32_t basic_mvn<URBG, Weight, Index>::bucket(int level, int value) const {
+  return leaf_count + (level - 1) * buckets + value;
+}
+
+/*
+ * Allocates the bucket nodes of every level up to and including the given
+ * one. Growing the arena invalidates references to its nodes.
+ */
+template<class URBG, class Weight, class Index>
+void basic_mvn<URBG, Weight, Index>::ensure_level(int level) {
+  while (bucket_levels < level) {
+    bucket_levels ++;
+    nodes.resize(nodes.size() + buckets);
+    children.resize(children.size() + buckets);
+    weights.resize(bucket_levels + 2);
+    roots.resize(bucket_levels + 2);
+    for (int j = 0; j < buckets; j ++) {
+      mvn_node &node = nodes[bucket(bucket_levels, j)];
+      node.value = j;
+      node.level = bucket_levels;
+    }
+  }
+}
+
+template<class URBG, class Weight, class Index>
+void basic_mvn<URBG, Weight, Index>::construct_tree(const std::vector<Weight> &dist) {
+  std::queue<uint32_t> next_level;
+  MVN_STAT(counters = mvn_stats();)
+
+  leaf_count = dist.size();
+  nodes.reserve(leaf_count + 8 * buckets);
+  nodes.resize(leaf_count);
+  ensure_level(1);
 
   for (int i = 0; i < dist.size(); i ++) {
-    mvn_node *node = new mvn_node;
-    node->sum = dist[i];
-    node->value = i;
-    node->level = 0;
+    mvn_node &node = nodes[i];
+    node.sum = dist[i];
+    node.value = i;
+    node.level = 0;
     total_weight += dist[i];
-    base_nodes[i] = node;
-
-    int j = binlog(dist[i]);
-    mvn_node *bucket = nodes[level_index_pair(1, j)];
-    if (bucket == nullptr)
-      bucket = nodes[level_index_pair(1, j)] = new mvn_node;
-    bucket->value = j;
-    bucket->level = 1;
-    bucket->sum += dist[i];
-    bucket->children.push_back(node);
-    node->parent_pos = bucket->children.size() - 1;
-    node->has_parent = true;
-    if (!bucket->enqueued) {
-      next_level.push(bucket);
-      bucket->enqueued = true;
+
+    uint32_t b = bucket(1, binlog(dist[i]));
+    nodes[b].sum += dist[i];
+    children[b - leaf_count].push_back(i);
+    node.parent_pos = children[b - leaf_count].size() - 1;
+    node.has_parent = true;
+    if (!nodes[b].enqueued) {
+      next_level.push(b);
+      nodes[b].enqueued = true;
     }
     level_count = 1;
   }
 
-  weights.resize(dist.size());
-  roots.resize(dist.size());
-
   while (!next_level.empty()) {
-    mvn_node* node = next_level.front();
+    uint32_t id = next_level.front();
     next_level.pop();
-    node->enqueued = false;
-
-    if (node->children.size() > 1) {
-      int j = binlog(node->sum);
-      mvn_node *bucket = nodes[level_index_pair(node->level + 1, j)];
-      if (bucket == nullptr)
-        bucket = nodes[level_index_pair(node->level + 1, j)] = new mvn_node;
-      bucket->value = j;
-      bucket->level = node->level + 1;
-      bucket->sum += node->sum;
-      bucket->children.push_back(node);
-      node->parent_pos = bucket->children.size() - 1;
-      node->has_parent = true;
-      if (!bucket->enqueued) {
-        next_level.push(bucket);
-        bucket->enqueued = true;
+    nodes[id].enqueued = false;
+
+    if (children[id - leaf_count].size() > 1) {
+      ensure_level(nodes[id].level + 1);
+      mvn_node &node = nodes[id];
+      uint32_t b = bucket(node.level + 1, binlog(node.sum));
+      mvn_node &parent = nodes[b];
+      parent.sum += node.sum;
+      children[b - leaf_count].push_back(id);
+      node.parent_pos = children[b - leaf_count].size() - 1;
+      node.has_parent = true;
+      if (!parent.enqueued) {
+        next_level.push(b);
+        parent.enqueued = true;
       }
-      level_count = node->level + 1;
+      level_count = node.level + 1;
     } else {
-      weights[node->level] += node->sum;
-      roots[node->level] |= (1ULL << node->value);
+      mvn_node &node = nodes[id];
+      weights[node.level] += node.sum;
+      roots[node.level] |= (1ULL << node.value);
     }
   }
 }
 
-int mvn::sample() {
+template<class URBG, class Weight, class Index>
+Index basic_mvn<URBG, Weight, Index>::sample() {
   std::uniform_int_distribution<uint64_t> dist(0, total_weight - 1);
 
+  MVN_STAT(uint64_t level_steps = 0, root_steps = 0, rejections = 0;)
+
   /* Sequential level search */
   int level = 1;
   uint64_t total = 0;
   uint64_t targ = dist(gen);
   for (int i = 1; i <= level_count; i ++) {
+    MVN_STAT(level_steps ++;)
     if (total + weights[i] <= targ) {
       level = i + 1;
       total += weights[i];
@@ -101,8 +188,9 @@ int mvn::sample() {
   uint64_t root_nodes = roots[level];
   int pos = binlog(root_nodes) - 1;
   while (root_nodes != 0) {
+    MVN_STAT(root_steps ++;)
     root_nodes ^= (1ULL << pos);
-    uint64_t cand_sum = nodes[level_index_pair(level, pos)]->sum;
+    uint64_t cand_sum = nodes[bucket(level, pos)].sum;
 
     if (total + cand_sum <= targ) {
       total += cand_sum;
@@ -113,139 +201,276 @@ int mvn::sample() {
   }
 
   /* Descent */
-  int dpop = 0;
-  mvn_node *node = nodes[level_index_pair(level, pos)];
+  uint32_t id = bucket(level, pos);
   while (level != 0) {
-    std::uniform_int_distribution<uint64_t> dist(0, node->children.size() - 1);
-    std::uniform_int_distribution<uint64_t> dist2(0, (1ULL << node->value) - 1);
-    int idx = dist(gen);
-    int rem = dist2(gen);
-    dpop++;
-
-    if (__builtin_expect(rem < node->children[idx]->sum, 1)) {
-      node = node->children[idx];
+    const std::vector<uint32_t> &child_ids = children[id - leaf_count];
+    std::uniform_int_distribution<uint64_t> dist(0, child_ids.size() - 1);
+    std::uniform_int_distribution<uint64_t> dist2(0, (1ULL << nodes[id].value) - 1);
+    uint32_t child = child_ids[dist(gen)];
+    uint64_t rem = dist2(gen);
+
+    if (__builtin_expect(rem < nodes[child].sum, 1)) {
+      id = child;
       level --;
+    } else {
+      MVN_STAT(rejections ++;)
     }
   }
 
-  return node->value;
+  MVN_STAT(
+    counters.samples ++;
+    count_steps(counters.level_steps, counters.level_histogram, level_steps);
+    count_steps(counters.root_steps, counters.root_histogram, root_steps);
+    count_steps(counters.rejections, counters.rejection_histogram, rejections);
+  )
+  return id;
 }
 
-void mvn::update(int idx, int value) {
-  mvn_node *dist_node = base_nodes[idx];
-  dist_node->prev_sum = dist_node->sum;
-  dist_node->root_sum = dist_node->sum;
-  dist_node->sum = value;
-  total_weight -= dist_node->prev_sum;
-  total_weight += dist_node->sum;
+/*
+ * Sets the weight of a leaf and queues it to be moved, remembering the sum
+ * it had when first queued.
+ */
+template<class URBG, class Weight, class Index>
+void basic_mvn<URBG, Weight, Index>::stage(Index idx, uint64_t value) {
+  mvn_node &leaf = nodes[idx];
+  if (!leaf.enqueued) {
+    leaf.prev_sum = leaf.sum;
+    leaf.root_sum = leaf.sum;
+    leaf.enqueued = true;
+    pending.push_back(idx);
+  }
+  total_weight -= leaf.sum;
+  total_weight += value;
+  leaf.sum = value;
+}
 
-  std::queue<mvn_node*> to_process;
-  to_process.push(dist_node);
+/*
+ * Moves the queued nodes to the buckets of their new sums and passes the
+ * changes up. The queue is first in first out, so every node of a level is
+ * processed before any node above it, and a bucket changed by several
+ * children is queued and moved once.
+ */
+template<class URBG, class Weight, class Index>
+void basic_mvn<URBG, Weight, Index>::propagate() {
+  MVN_STAT(uint64_t migrations = 0;)
 
-  while (!to_process.empty()) {
-    mvn_node *child = to_process.front();
-    to_process.pop();
-    child->enqueued = false;
+  for (size_t head = 0; head < pending.size(); head ++) {
+    uint32_t child_id = pending[head];
+    ensure_level(nodes[child_id].level + 1);
+
+    mvn_node &child = nodes[child_id];
+    child.enqueued = false;
 
     /* Identify parents */
-    int old_pos = binlog(child->prev_sum);
-    int new_pos = binlog(child->sum);
-    mvn_node *parent = nodes[level_index_pair(child->level + 1, old_pos)];
+    int old_pos = binlog(child.prev_sum);
+    int new_pos = binlog(child.sum);
+    uint32_t parent_id = bucket(child.level + 1, old_pos);
+    mvn_node &parent = nodes[parent_id];
+    std::vector<uint32_t> &siblings = children[parent_id - leaf_count];
 
     /* Short circuit if parent hasn't changed */
-    if (child->has_parent && old_pos == new_pos) {
-      if (!parent->enqueued) {
-        parent->prev_sum = parent->sum;
-        parent->root_sum = parent->sum;
+    if (child.has_parent && old_pos == new_pos) {
+      if (!parent.enqueued) {
+        parent.prev_sum = parent.sum;
+        parent.root_sum = parent.sum;
       }
-      parent->sum -= child->prev_sum;
-      parent->sum += child->sum;
-      if (parent->children.size() == 1) {
-        weights[parent->level] -= parent->root_sum;
-        weights[parent->level] += parent->sum;
-        parent->root_sum = parent->sum;
+      parent.sum -= child.prev_sum;
+      parent.sum += child.sum;
+      if (siblings.size() == 1) {
+        weights[parent.level] -= parent.root_sum;
+        weights[parent.level] += parent.sum;
+        parent.root_sum = parent.sum;
       }
 
-      if (!parent->enqueued) {
-        to_process.push(parent);
-        parent->enqueued = true;
+      if (!parent.enqueued) {
+        pending.push_back(parent_id);
+        parent.enqueued = true;
       }
 
       continue;
     }
+    MVN_STAT(migrations ++;)
 
     /* Deal with the old parent (if present) */
-    if (child->has_parent) {
-      if (!parent->enqueued) {
-        parent->prev_sum = parent->sum;
-        parent->root_sum = parent->sum;
+    if (child.has_parent) {
+      if (!parent.enqueued) {
+        parent.prev_sum = parent.sum;
+        parent.root_sum = parent.sum;
       }
-      parent->sum -= child->prev_sum;
-      parent->children[child->parent_pos] = parent->children.back();
-      parent->children.back()->parent_pos = child->parent_pos;
-      parent->children.pop_back();
-      child->has_parent = false;
-      if (!parent->enqueued) {
-        to_process.push(parent);
-        parent->enqueued = true;
+      parent.sum -= child.prev_sum;
+      siblings[child.parent_pos] = siblings.back();
+      nodes[siblings.back()].parent_pos = child.parent_pos;
+      siblings.pop_back();
+      child.has_parent = false;
+      if (!parent.enqueued) {
+        pending.push_back(parent_id);
+        parent.enqueued = true;
       }
-      if (parent->children.size() == 1) {
+      if (siblings.size() == 1) {
         /* Add to root set */
-        weights[parent->level] += parent->sum;
-        roots[parent->level] |= (1ULL << parent->value);
-        parent->root_sum = parent->sum;
-      } else if (parent->children.size() == 0) {
+        weights[parent.level] += parent.sum;
+        roots[parent.level] |= (1ULL << parent.value);
+        parent.root_sum = parent.sum;
+      } else if (siblings.size() == 0) {
         /* Remove from root set */
-        weights[parent->level] -= parent->root_sum;
-        roots[parent->level] ^= (1ULL << parent->value);
+        weights[parent.level] -= parent.root_sum;
+        roots[parent.level] ^= (1ULL << parent.value);
       }
     }
 
     /* Deal with the new parent (if not root) */
-    if (child->children.size() > 1 || child->level == 0) {
-      mvn_node *bucket = nodes[level_index_pair(child->level + 1, new_pos)];
-      if (bucket == NULL)
-        bucket = nodes[level_index_pair(child->level + 1, new_pos)] = new mvn_node;
-      bucket->value = new_pos;
-      bucket->level = child->level + 1;
-      if (!bucket->enqueued) {
-        bucket->prev_sum = bucket->sum;
-        bucket->root_sum = bucket->sum;
+    if (child.level == 0 || children[child_id - leaf_count].size() > 1) {
+      uint32_t bucket_id = bucket(child.level + 1, new_pos);
+      mvn_node &bucket_node = nodes[bucket_id];
+      std::vector<uint32_t> &bucket_children = children[bucket_id - leaf_count];
+      if (!bucket_node.enqueued) {
+        bucket_node.prev_sum = bucket_node.sum;
+        bucket_node.root_sum = bucket_node.sum;
       }
-      bucket->sum += child->sum;
-      bucket->children.push_back(child);
-      child->parent_pos = bucket->children.size() - 1;
-      child->has_parent = true;
-      if (!bucket->enqueued) {
-        to_process.push(bucket);
-        bucket->enqueued = true;
+      bucket_node.sum += child.sum;
+      bucket_children.push_back(child_id);
+      child.parent_pos = bucket_children.size() - 1;
+      child.has_parent = true;
+      if (!bucket_node.enqueued) {
+        pending.push_back(bucket_id);
+        bucket_node.enqueued = true;
       }
-      if (bucket->children.size() == 1) {
+      if (bucket_children.size() == 1) {
         /* Add to root set */
-        weights[bucket->level] += bucket->sum;
-        roots[bucket->level] |= (1ULL << bucket->value);
-        bucket->root_sum = bucket->sum;
-      } else if (bucket->children.size() == 2) {
+        weights[bucket_node.level] += bucket_node.sum;
+        roots[bucket_node.level] |= (1ULL << bucket_node.value);
+        bucket_node.root_sum = bucket_node.sum;
+      } else if (bucket_children.size() == 2) {
         /* Remove from root set */
-        weights[bucket->level] -= bucket->root_sum;
-        roots[bucket->level] ^= (1ULL << bucket->value);
+        weights[bucket_node.level] -= bucket_node.root_sum;
+        roots[bucket_node.level] ^= (1ULL << bucket_node.value);
       }
-      level_count = std::max(level_count, (uint64_t) bucket->level);
+      level_count = std::max(level_count, (uint64_t) bucket_node.level);
     }
   }
+
+  MVN_STAT(
+    counters.updates ++;
+    count_steps(counters.queued, counters.queue_histogram, pending.size());
+    count_steps(counters.migrations, counters.migration_histogram, migrations);
+  )
+  pending.clear();
+}
+
+template<class URBG, class Weight, class Index>
+void basic_mvn<URBG, Weight, Index>::update(Index idx, Weight value) {
+  stage(idx, value);
+  propagate();
+}
+
+template<class URBG, class Weight, class Index>
+void basic_mvn<URBG, Weight, Index>::delta_update(Index idx, Weight delta) {
+  update(idx, (Weight) nodes[idx].sum + delta);
+}
+
+/*
+ * Sets the weights of a batch of items, the last value given for an item
+ * taking effect. The leaves are queued together, so each bucket is moved
+ * once however many of its children change.
+ */
+template<class URBG, class Weight, class Index>
+void basic_mvn<URBG, Weight, Index>::update_batch(const std::pair<Index, Weight> *updates, size_t n) {
+  for (size_t i = 0; i < n; i ++)
+    stage(updates[i].first, updates[i].second);
+  propagate();
+}
+
+template<class URBG, class Weight, class Index>
+void basic_mvn<URBG, Weight, Index>::update_batch(const std::vector<std::pair<Index, Weight>>& updates) {
+  update_batch(updates.data(), updates.size());
+}
+
+/*
+ * Adds a batch of deltas, which may repeat an item, and moves the changed
+ * nodes together as update_batch does.
+ */
+template<class URBG, class Weight, class Index>
+void basic_mvn<URBG, Weight, Index>::delta_update_batch(const std::pair<Index, Weight> *updates, size_t n) {
+  for (size_t i = 0; i < n; i ++)
+    stage(updates[i].first, (Weight) nodes[updates[i].first].sum + updates[i].second);
+  propagate();
 }
 
-void mvn::delta_update(int idx, int delta) {
-  update(idx, base_nodes[idx]->sum + delta);
+template<class URBG, class Weight, class Index>
+void basic_mvn<URBG, Weight, Index>::delta_update_batch(const std::vector<std::pair<Index, Weight>>& updates) {
+  delta_update_batch(updates.data(), updates.size());
 }
 
-mvn::mvn_node::mvn_node(): sum(0), value(0), level(0), enqueued(false), has_parent(false) {
+/*
+ * Draws m distinct items, each in proportion to its weight among the items
+ * not yet drawn, and returns them in draw order. Fewer are returned only if
+ * fewer than m items have positive weight. Repeats are rejected while they
+ * are rare; after that the drawn items are removed by updates as they are
+ * drawn and restored at the end. For m above k / 8, exponential keys are
+ * used.
+ */
+template<class URBG, class Weight, class Index>
+std::vector<Index> basic_mvn<URBG, Weight, Index>::sample_without_replacement(int m) {
+  std::vector<Index> out;
+  if (m <= 0 || total_weight == 0)
+    return out;
+  out.reserve(m);
+
+  if ((uint64_t) m * 8 >= leaf_count) {
+    exponential_keys(leaf_count, [this](size_t i) { return nodes[i].sum; }, m, out, gen);
+    return out;
+  }
+
+  index_set seen(m);
+  auto draw = [this](Index *batch, size_t n) {
+    for (size_t i = 0; i < n; i ++)
+      batch[i] = sample();
+  };
+  if (reject_repeats(m, draw, seen, out))
+    return out;
+
+  std::vector<uint64_t> taken(out.size());
+  for (size_t j = 0; j < out.size(); j ++) {
+    taken[j] = nodes[out[j]].sum;
+    update(out[j], 0);
+  }
+
+  while (out.size() < m && total_weight > 0) {
+    Index r = sample();
+    out.push_back(r);
+    taken.push_back(nodes[r].sum);
+    update(r, 0);
+  }
+
+  for (size_t j = 0; j < out.size(); j ++)
+    update(out[j], taken[j]);
+
+  return out;
 }
 
-mvn::~mvn() {
-  for (auto node : base_nodes)
-    delete node;
-  for (auto &pair : nodes)
-    delete pair.second;
+/*
+ * Returns the counts collected so far, with the current size of the forest.
+ */
+template<class URBG, class Weight, class Index>
+mvn_stats basic_mvn<URBG, Weight, Index>::stats() const {
+  mvn_stats out = mvn_stats();
+#ifdef SAMPLING_MVN_STATS
+  out = counters;
+  out.enabled = true;
+#endif
+  out.nodes = nodes.size();
+  out.levels = level_count;
+  for (uint64_t level_roots : roots)
+    out.roots += __builtin_popcountll(level_roots);
+  return out;
 }
 
+template<class URBG, class Weight, class Index>
+basic_mvn<URBG, Weight, Index>::mvn_node::mvn_node(): sum(0), prev_sum(0), root_sum(0), value(0), level(0), parent_pos(0), enqueued(false), has_parent(false) {
+}
+
+#define INSTANTIATE(URBG) template class basic_mvn<URBG>;
+SAMPLING_ENGINES(INSTANTIATE)
+
+#define INSTANTIATE_WEIGHTS(Weight, Index) template class basic_mvn<default_engine, Weight, Index>;
+SAMPLING_INTEGER_WEIGHT_TYPES(INSTANTIATE_WEIGHTS)
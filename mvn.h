@@ -2,58 +2,131 @@
  * An implementation of Matias, Yossi, et al.'s O(log* n) sampling algorithm
  * for categorical random variables. The original algorithm was specified in
  * "Dynamic Generation of Discrete Random Variables".
+ *
+ * All nodes live in a single arena. The first k entries are the leaves, one
+ * per category, followed by a block of 64 bucket nodes for each level of the
+ * forest, so the bucket for a given level and binary logarithm is found by
+ * direct indexing. Child lists are kept only for bucket nodes and refer to
+ * their children by arena index. Sums must remain below 2^63.
+ *
+ * An update moves the changed nodes between buckets level by level. Batches
+ * of updates are moved together, so that a bucket changed by many of them is
+ * moved once.
+ *
+ * Buckets are formed by the binary logarithms of the weights, so weights must
+ * be unsigned integers. Sums are kept in 64 bits whatever the weight type.
+ *
+ * Compiled with SAMPLING_MVN_STATS defined, the sampler counts the steps of
+ * its searches and updates, which stats() reports. Otherwise nothing is
+ * recorded and the hot paths are unchanged.
  */
 
 #ifndef MVN_H
 #define MVN_H
 
 #include <random>
-#include <unordered_map>
+#include <type_traits>
+#include <utility>
 #include <vector>
+#include "logits.h"
+#include "rng.h"
+#include "weights.h"
 
-namespace std {
-  template<> struct hash<std::pair<uint64_t, uint64_t>> {
-    size_t operator()(const std::pair<uint64_t, uint64_t>& p) const;
-  };
+/*
+ * The work done by an mvn. For samples, the steps of the sequential level
+ * search, the steps of the root search and the rejected steps of the descent;
+ * for updates, the nodes passed through the update queue and the nodes moved
+ * to another bucket, a batch counting as one update. Each histogram counts
+ * operations by their number of steps, the last bin holding all longer ones.
+ * The counts are only kept when enabled, while the size of the forest, in
+ * arena nodes, levels and roots, is always reported.
+ */
+struct mvn_stats {
+  static const int bins = 16;
+
+  bool enabled;
+  uint64_t samples;
+  uint64_t level_steps;
+  uint64_t root_steps;
+  uint64_t rejections;
+  uint64_t level_histogram[bins];
+  uint64_t root_histogram[bins];
+  uint64_t rejection_histogram[bins];
+  uint64_t updates;
+  uint64_t queued;
+  uint64_t migrations;
+  uint64_t queue_histogram[bins];
+  uint64_t migration_histogram[bins];
+  uint64_t nodes;
+  uint64_t levels;
+  uint64_t roots;
+
+  mvn_stats& operator+=(const mvn_stats& other);
 };
 
-class mvn {
+template<class URBG = default_engine, class Weight = uint64_t, class Index = int>
+class basic_mvn {
+  static_assert(std::is_unsigned<Weight>::value, "weights must be unsigned integers");
+  static_assert(std::is_integral<Index>::value, "indices must be integers");
+
   private:
+    static const int buckets = 64;
+
     struct mvn_node {
       uint64_t sum;
+      uint64_t prev_sum;
+      uint64_t root_sum;
       int value;
       int level;
+      int parent_pos;
       bool enqueued;
       bool has_parent;
-      std::vector<mvn_node*> children;
-      uint64_t prev_sum;
-      uint64_t root_sum;
-      int parent_pos;
 
       mvn_node();
     };
 
-    using level_index_pair = std::pair<uint64_t, uint64_t>;
-
     uint64_t level_count;
-    std::vector<uint64_t> level_totals;
-    std::unordered_map<level_index_pair, mvn_node*> nodes;
-    std::vector<mvn_node*> base_nodes;
+    uint64_t bucket_levels;
+    uint64_t leaf_count;
+    std::vector<mvn_node> nodes;
+    std::vector<std::vector<uint32_t>> children;
     std::vector<uint64_t> weights;
     std::vector<uint64_t> roots;
+    std::vector<uint32_t> pending;
     uint64_t total_weight;
-    std::random_device rd;
-    std::mt19937_64 gen;
+    URBG gen;
+#ifdef SAMPLING_MVN_STATS
+    mvn_stats counters;
+#endif
 
-    void construct_tree(const std::vector<uint64_t> &dist);
+    void construct_tree(const std::vector<Weight> &dist);
+    void ensure_level(int level);
+    uint32_t bucket(int level, int value) const;
+    void stage(Index idx, uint64_t value);
+    void propagate();
 
   public:
-    mvn(const std::vector<uint64_t> &dist);
-    ~mvn();
-    int sample();
-    void update(int idx, int value);
-    void delta_update(int idx, int delta);
+    typedef Weight weight_type;
+    typedef Index index_type;
+
+    basic_mvn(const std::vector<Weight> &dist);
+    basic_mvn(const std::vector<Weight> &dist, uint64_t seed);
+    basic_mvn(const std::vector<Weight> &dist, const URBG& engine);
+    basic_mvn(logit_span logits, double temperature = 1.0);
+    basic_mvn(logit_span logits, double temperature, uint64_t seed);
+    basic_mvn(logit_span logits, double temperature, const URBG& engine);
+    Index sample();
+    void update(Index idx, Weight value);
+    void delta_update(Index idx, Weight delta);
+    void update_batch(const std::pair<Index, Weight> *updates, size_t n);
+    void update_batch(const std::vector<std::pair<Index, Weight>>& updates);
+    void delta_update_batch(const std::pair<Index, Weight> *updates, size_t n);
+    void delta_update_batch(const std::vector<std::pair<Index, Weight>>& updates);
+    std::vector<Index> sample_without_replacement(int m);
+    mvn_stats stats() const;
 };
 
-#endif
+typedef basic_mvn<> mvn;
+typedef basic_mvn<default_engine, uint32_t, uint32_t> mvn32;
 
+#endif
@@ -0,0 +1,93 @@
+#include "perf_counters.h"
+
+#ifdef __linux__
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int open_counter(uint32_t type, uint64_t config) {
+  struct perf_event_attr attr;
+  std::memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+perf_counters::perf_counters() {
+  fds[cycles] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+  fds[instructions] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+  fds[llc_misses] = open_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL |
+                                 (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+  if (fds[llc_misses] < 0)
+    fds[llc_misses] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+  fds[branch_misses] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+
+  for (int c = 0; c < count; c ++)
+    values[c] = 0;
+}
+
+perf_counters::~perf_counters() {
+  for (int c = 0; c < count; c ++) {
+    if (fds[c] >= 0)
+      close(fds[c]);
+  }
+}
+
+void perf_counters::start() {
+  for (int c = 0; c < count; c ++) {
+    if (fds[c] >= 0) {
+      ioctl(fds[c], PERF_EVENT_IOC_RESET, 0);
+      ioctl(fds[c], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+}
+
+void perf_counters::stop() {
+  for (int c = 0; c < count; c ++) {
+    if (fds[c] >= 0) {
+      ioctl(fds[c], PERF_EVENT_IOC_DISABLE, 0);
+      if (read(fds[c], &values[c], sizeof(values[c])) != sizeof(values[c]))
+        values[c] = 0;
+    }
+  }
+}
+#else
+perf_counters::perf_counters() {
+  for (int c = 0; c < count; c ++) {
+    fds[c] = -1;
+    values[c] = 0;
+  }
+}
+
+perf_counters::~perf_counters() {
+}
+
+void perf_counters::start() {
+}
+
+void perf_counters::stop() {
+}
+#endif
+
+bool perf_counters::available(counter c) const {
+  return fds[c] >= 0;
+}
+
+/*
+ * Returns the count between the last start and stop.
+ */
+uint64_t perf_counters::value(counter c) const {
+  return values[c];
+}
+
+const char* perf_counters::name(counter c) {
+  static const char *names[count] = { "cycles", "instructions", "llc_misses", "branch_misses" };
+  return names[c];
+}
@@ -0,0 +1,35 @@
+/*
+ * Hardware performance counters for the benchmark, read through Linux's
+ * perf_event_open for the calling thread in user mode. Each counter is
+ * opened separately, so counters the kernel or CPU does not support, or that
+ * perf_event_paranoid forbids, are reported as unavailable without affecting
+ * the others. On other systems every counter is unavailable.
+ */
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <cstdint>
+
+class perf_counters {
+  public:
+    enum counter { cycles, instructions, llc_misses, branch_misses, count };
+
+  private:
+    int fds[count];
+    uint64_t values[count];
+
+  public:
+    perf_counters();
+    ~perf_counters();
+    perf_counters(const perf_counters&) = delete;
+    perf_counters& operator=(const perf_counters&) = delete;
+
+    void start();
+    void stop();
+    bool available(counter c) const;
+    uint64_t value(counter c) const;
+
+    static const char* name(counter c);
+};
+
+#endif
@@ -1,89 +1,128 @@
-#include <boost/math/special_functions/beta.hpp>
-#include <deque>
+#include <algorithm>
+#include <cmath>
 #include <random>
-#include <unordered_map>
 #include "relles.h"
 
-#include<iostream>
-static uint64_t beta_bsearch(std::unordered_map<uint64_t, long double>& memo, long double value, uint64_t n) {
-  uint64_t low = 0;
-  uint64_t high = n;
-
-  std::random_device rd;
-  std::mt19937_64 gen(rd());
-  std::uniform_real_distribution<> unif_dis(0.0, 1.0);
-
-  while (low < high - 1) {
-    uint64_t idx = low + (high - low) / 2;
-    if (memo.find(idx) == memo.end()) {
-      long double beta = boost::math::ibeta_inv(idx - low + 1, high - idx, unif_dis(gen), boost::math::policies::policy<boost::math::policies::digits2<25>>());
-      memo[idx] = memo[low] + (memo[high] - memo[low]) * beta;
-    }
-
-    if (memo[idx] < value) {
-      low = idx;
-    } else {
-      high = idx;
-    }
-  }
+/*
+ * The n uniform points are order statistics U_1 <= ... <= U_n, bracketed by
+ * the sentinels U_0 = 0 and U_{n+1} = 1. The count of a category is the
+ * number of points between its cumulative bounds, so sampling reduces to
+ * finding, for each cumulative probability in increasing order, the rank of
+ * the last point below it. Points are discovered lazily by splitting the
+ * interval between two known neighbours with a Beta variate.
+ *
+ * Since the searches only move upwards, the points discovered below the
+ * current position are never needed again except for the greatest one. The
+ * points above it are kept in a flat stack ordered with the smallest on top,
+ * each push lying between the current low point and the previous top.
+ */
+struct split_point {
+  uint64_t rank;
+  long double value;
+};
+
+struct split_points {
+  split_point low;
+  std::vector<split_point> above;
+
+  split_points(uint64_t n);
+  void advance(long double value);
+};
+
+split_points::split_points(uint64_t n) {
+  low = { 0, 0 };
+  above.reserve(128);
+  above.push_back({ n + 1, 1 });
+}
 
-  assert(low == high - 1);
+/*
+ * Moves the low point up to the greatest known point below the given value,
+ * which must not exceed one.
+ */
+void split_points::advance(long double value) {
+  while (above.back().value < value) {
+    low = above.back();
+    above.pop_back();
+  }
+}
 
-  return low;
+/*
+ * Draws the point of the given rank strictly between two adjacent known
+ * points. Its position within the interval is Beta distributed, drawn as
+ * X / (X + Y) for gamma variates X and Y.
+ */
+template<class URBG>
+static long double beta_split(const split_point& low, const split_point& high, uint64_t rank, URBG& gen) {
+  std::gamma_distribution<double> left(rank - low.rank);
+  std::gamma_distribution<double> right(high.rank - rank);
+  long double x = left(gen);
+  long double y = right(gen);
+  return low.value + (high.value - low.value) * (x / (x + y));
 }
 
-static uint64_t beta_isearch(std::unordered_map<uint64_t, long double>& memo, std::deque<std::pair<uint64_t, long double>>& prev_points, long double value, uint64_t n) {
-  uint64_t low = 0;
-  while (prev_points.back().second < value) {
-    low = prev_points.back().first;
-    prev_points.pop_back();
+/*
+ * Narrows the known points around value until they are adjacent, moving to
+ * the midpoint rank at each step, and returns the rank of the lower one.
+ */
+template<class URBG>
+static uint64_t beta_bsearch(split_points& points, long double value, URBG& gen) {
+  points.advance(value);
+
+  while (points.above.back().rank - points.low.rank > 1) {
+    const split_point& high = points.above.back();
+    uint64_t rank = points.low.rank + (high.rank - points.low.rank) / 2;
+    split_point mid = { rank, beta_split(points.low, high, rank, gen) };
+
+    if (mid.value < value)
+      points.low = mid;
+    else
+      points.above.push_back(mid);
   }
-  long double low_val = memo[low];
-  uint64_t high = prev_points.back().first;
-  long double high_val = memo[high];
-
-  std::random_device rd;
-  std::mt19937_64 gen(rd());
-  std::uniform_real_distribution<> unif_dis(0.0, 1.0);
-
-  while (low < high - 2) {
-    uint64_t idx = round((value - low_val) / (high_val - low_val) * (high - low - 2)) + low + 1;
-    assert(idx >= 0);
-    if (memo.find(idx) == memo.end()) {
-      long double beta = boost::math::ibeta_inv(idx - low, high - idx + 1, unif_dis(gen), boost::math::policies::policy<boost::math::policies::digits2<25>>());
-      memo[idx] = memo[low] + (memo[high] - memo[low]) * beta;
-      prev_points.emplace_back(idx, memo[idx]);
-    }
-
-    if (memo[idx] < value) {
-      low = idx;
-      low_val = memo[idx];
-    } else {
-      high = idx;
-      high_val = memo[idx];
-    }
+
+  return points.low.rank;
+}
+
+/*
+ * As beta_bsearch, but moves to the rank interpolated from the values of the
+ * known points at each step.
+ */
+template<class URBG>
+static uint64_t beta_isearch(split_points& points, long double value, URBG& gen) {
+  points.advance(value);
+
+  while (points.above.back().rank - points.low.rank > 1) {
+    const split_point& high = points.above.back();
+    uint64_t gap = high.rank - points.low.rank - 2;
+    long double frac = (value - points.low.value) / (high.value - points.low.value);
+    uint64_t rank = points.low.rank + 1 + std::min<uint64_t>(gap, std::llround(frac * gap));
+    split_point mid = { rank, beta_split(points.low, high, rank, gen) };
+
+    if (mid.value < value)
+      points.low = mid;
+    else
+      points.above.push_back(mid);
   }
 
-  return low + 1;
+  return points.low.rank;
 }
 
 /*
- * The O(k log n) algorithm for multinomial sampling.
+ * Assigns the n points to categories by searching for each cumulative
+ * probability in turn. The last category, and any reached once the
+ * cumulative probability rounds to one, take all remaining points.
  */
-std::vector<uint64_t> relles(uint64_t n, const std::vector<long double>& dist) {
-  std::unordered_map<uint64_t, long double> memo;
+template<class URBG, class Search>
+static std::vector<uint64_t> split_counts(uint64_t n, const std::vector<long double>& dist, URBG& gen, Search search) {
+  split_points points(n);
   std::vector<uint64_t> output(dist.size());
 
-  memo[0] = 0;
-  memo[n] = 1;
-
   long double cum = 0;
   uint64_t last = 0;
 
-  for (int i = 0; i < dist.size(); i ++) {
+  for (int i = 0; i < dist.size() && last < n; i ++) {
     cum += dist[i];
-    uint64_t loc = beta_bsearch(memo, cum, n);
-    output[i] = loc - last - 1;
+    uint64_t loc = (cum >= 1 || i == dist.size() - 1) ? n : search(points, cum, gen);
+    output[i] = loc - last;
     last = loc;
   }
 
@@ -91,30 +130,30 @@ std::vector<uint64_t> relles(uint64_t n, const std::vector<long double>& dist) {
 }
 
 /*
- * The O(k log log n) algorithm for multinomial sampling.
+ * The O(k log n) algorithm for multinomial sampling.
  */
-std::vector<uint64_t> relles_enhanced(uint64_t n, const std::vector<long double>& dist) {
-  std::unordered_map<uint64_t, long double> memo;
-  std::deque<std::pair<uint64_t, long double>> prev_points = { { n, 1 } };
-  std::vector<uint64_t> output(dist.size());
-
-  memo[0] = 0;
-  memo[n] = 1;
+template<class URBG>
+std::vector<uint64_t> relles(uint64_t n, const std::vector<long double>& dist, URBG& gen) {
+  return split_counts(n, dist, gen, beta_bsearch<URBG>);
+}
 
-  long double cum = 0;
-  uint64_t last = 0;
+/*
+ * The O(k log log n) algorithm for multinomial sampling.
+ */
+template<class URBG>
+std::vector<uint64_t> relles_enhanced(uint64_t n, const std::vector<long double>& dist, URBG& gen) {
+  return split_counts(n, dist, gen, beta_isearch<URBG>);
+}
 
-  for (int i = 0; i < dist.size(); i ++) {
-    cum += dist[i];
-    if (cum >= 1) {
-      output[i] = n - last - 1;
-      break;
-    }
-    uint64_t loc = beta_isearch(memo, prev_points, cum, n);
-    output[i] = loc - last - 1;
-    last = loc;
-  }
+std::vector<uint64_t> relles(uint64_t n, const std::vector<long double>& dist) {
+  return relles(n, dist, thread_engine());
+}
 
-  return output;
+std::vector<uint64_t> relles_enhanced(uint64_t n, const std::vector<long double>& dist) {
+  return relles_enhanced(n, dist, thread_engine());
 }
 
+#define INSTANTIATE(URBG) \
+  template std::vector<uint64_t> relles(uint64_t n, const std::vector<long double>& dist, URBG& gen); \
+  template std::vector<uint64_t> relles_enhanced(uint64_t n, const std::vector<long double>& dist, URBG& gen);
+SAMPLING_ENGINES(INSTANTIATE)
@@ -4,11 +4,19 @@
  * Large". The enhanced version is a modified version of this algorithm that
  * uses interpolation search instead of binary search, resulting in improved
  * performance for multinomial distributions with large n.
+ *
+ * As in multi.h, the overloads without an engine use a per-thread engine.
  */
 #ifndef RELLES_H
 #define RELLES_H
 
 #include <vector>
+#include "rng.h"
+
+template<class URBG>
+std::vector<uint64_t> relles(uint64_t n, const std::vector<long double>& dist, URBG& gen);
+template<class URBG>
+std::vector<uint64_t> relles_enhanced(uint64_t n, const std::vector<long double>& dist, URBG& gen);
 
 std::vector<uint64_t> relles(uint64_t n, const std::vector<long double>& dist);
 std::vector<uint64_t> relles_enhanced(uint64_t n, const std::vector<long double>& dist);
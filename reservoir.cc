@@ -0,0 +1,203 @@
+#include <algorithm>
+#include <cmath>
+#include "reservoir.h"
+
+/*
+ * Returns a standard exponential variate.
+ */
+template<class URBG>
+static inline double exponential(URBG& gen) {
+  return -std::log1p(-uniform01(gen));
+}
+
+template<class URBG, class Weight, class Index>
+basic_reservoir<URBG, Weight, Index>::basic_reservoir(size_t m): basic_reservoir(m, random_seed()) {
+}
+
+template<class URBG, class Weight, class Index>
+basic_reservoir<URBG, Weight, Index>::basic_reservoir(size_t m, uint64_t seed): basic_reservoir(m, URBG(seed)) {
+}
+
+template<class URBG, class Weight, class Index>
+basic_reservoir<URBG, Weight, Index>::basic_reservoir(size_t m, const URBG& engine): m(m), threshold(0), skip(0), seen(0), gen(engine) {
+  heap.reserve(m);
+}
+
+/*
+ * Adds an item while the reservoir is filling. Once it is full, the heap is
+ * formed and the first skip drawn.
+ */
+template<class URBG, class Weight, class Index>
+void basic_reservoir<URBG, Weight, Index>::push(Index item, double key) {
+  heap.emplace_back(key, item);
+  if (heap.size() == m) {
+    std::make_heap(heap.begin(), heap.end());
+    threshold = heap.front().first;
+    skip = exponential(gen) / threshold;
+  }
+}
+
+/*
+ * Replaces the item of largest key in a full reservoir, sifting the new one
+ * down from the root in a single pass, and draws the skip anew under the
+ * lower threshold.
+ */
+template<class URBG, class Weight, class Index>
+void basic_reservoir<URBG, Weight, Index>::replace(Index item, double key) {
+  std::pair<double, Index> entry(key, item);
+  size_t pos = 0;
+  while (true) {
+    size_t child = 2 * pos + 1;
+    if (child >= heap.size())
+      break;
+    if (child + 1 < heap.size() && heap[child] < heap[child + 1])
+      child ++;
+    if (!(entry < heap[child]))
+      break;
+    heap[pos] = heap[child];
+    pos = child;
+  }
+  heap[pos] = entry;
+  threshold = heap.front().first;
+  skip = exponential(gen) / threshold;
+}
+
+/*
+ * Admits the item on which the skip ran out. Its key is E / w for an
+ * exponential E conditioned below w T, drawn by inversion.
+ */
+template<class URBG, class Weight, class Index>
+void basic_reservoir<URBG, Weight, Index>::enter(Index item, Weight weight) {
+  double w = weight;
+  double e = -std::log1p(std::expm1(-w * threshold) * uniform01(gen));
+  replace(item, e / w);
+}
+
+/*
+ * Skipping runs over blocks of eight items, summed pairwise so that the
+ * additions do not wait on each other, and only the block in which the skip
+ * runs out is scanned item by item.
+ */
+static const size_t skip_block = 8;
+
+template<class Weigh>
+static inline double block_sum(Weigh weigh, size_t i) {
+  double a = (double) weigh(i) + weigh(i + 1);
+  double b = (double) weigh(i + 2) + weigh(i + 3);
+  double c = (double) weigh(i + 4) + weigh(i + 5);
+  double d = (double) weigh(i + 6) + weigh(i + 7);
+  return (a + b) + (c + d);
+}
+
+/*
+ * Feeds n items, given by position, to the reservoir. Items of zero weight
+ * never enter, and the skip only runs out on an item of positive weight.
+ */
+template<class URBG, class Weight, class Index>
+template<class Item, class Weigh>
+void basic_reservoir<URBG, Weight, Index>::consume(size_t n, Item item, Weigh weigh) {
+  seen += n;
+  if (m == 0)
+    return;
+
+  size_t i = 0;
+  for (; i < n && heap.size() < m; i ++) {
+    Weight w = weigh(i);
+    if (w > 0)
+      push(item(i), exponential(gen) / w);
+  }
+
+  while (i < n) {
+    double s = skip;
+    bool out = false;
+    while (i < n && !out) {
+      for (; i + skip_block <= n; i += skip_block) {
+        double sum = block_sum(weigh, i);
+        if (sum >= s)
+          break;
+        s -= sum;
+      }
+      size_t end = std::min(n, i + skip_block);
+      for (; i < end && !out; i ++) {
+        s -= weigh(i);
+        out = s <= 0;
+      }
+    }
+    skip = s;
+    if (!out)
+      break;
+
+    enter(item(i - 1), weigh(i - 1));
+  }
+}
+
+template<class URBG, class Weight, class Index>
+void basic_reservoir<URBG, Weight, Index>::add(Index item, Weight weight) {
+  consume(1, [item](size_t i) { return item; }, [weight](size_t i) { return weight; });
+}
+
+template<class URBG, class Weight, class Index>
+void basic_reservoir<URBG, Weight, Index>::add_batch(const std::pair<Index, Weight> *items, size_t n) {
+  consume(n, [items](size_t i) { return items[i].first; }, [items](size_t i) { return items[i].second; });
+}
+
+template<class URBG, class Weight, class Index>
+void basic_reservoir<URBG, Weight, Index>::add_batch(const std::vector<std::pair<Index, Weight>>& items) {
+  add_batch(items.data(), items.size());
+}
+
+/*
+ * Feeds a batch of items numbered consecutively from first.
+ */
+template<class URBG, class Weight, class Index>
+void basic_reservoir<URBG, Weight, Index>::add_batch(Index first, const Weight *weights, size_t n) {
+  consume(n, [first](size_t i) { return (Index) (first + i); }, [weights](size_t i) { return weights[i]; });
+}
+
+/*
+ * Merges a reservoir fed a disjoint part of the stream. The keys of both are
+ * those of the m smallest in their parts, so the m smallest of their union
+ * are those of the whole stream. The skip is drawn afresh, as the weight
+ * left to skip is memoryless.
+ */
+template<class URBG, class Weight, class Index>
+void basic_reservoir<URBG, Weight, Index>::merge(const basic_reservoir& other) {
+  seen += other.seen;
+  for (const std::pair<double, Index> &entry : other.heap) {
+    if (heap.size() < m)
+      push(entry.second, entry.first);
+    else if (entry.first < threshold)
+      replace(entry.second, entry.first);
+  }
+}
+
+/*
+ * Returns the items held, in increasing order of key, which is the order in
+ * which successive draws without replacement would take them.
+ */
+template<class URBG, class Weight, class Index>
+std::vector<Index> basic_reservoir<URBG, Weight, Index>::sample() const {
+  std::vector<std::pair<double, Index>> sorted(heap);
+  std::sort(sorted.begin(), sorted.end());
+
+  std::vector<Index> out(sorted.size());
+  for (size_t i = 0; i < sorted.size(); i ++)
+    out[i] = sorted[i].second;
+  return out;
+}
+
+template<class URBG, class Weight, class Index>
+size_t basic_reservoir<URBG, Weight, Index>::size() const {
+  return heap.size();
+}
+
+template<class URBG, class Weight, class Index>
+uint64_t basic_reservoir<URBG, Weight, Index>::count() const {
+  return seen;
+}
+
+#define INSTANTIATE(URBG) template class basic_reservoir<URBG>;
+SAMPLING_ENGINES(INSTANTIATE)
+
+#define INSTANTIATE_WEIGHTS(Weight, Index) template class basic_reservoir<default_engine, Weight, Index>;
+SAMPLING_WEIGHT_TYPES(INSTANTIATE_WEIGHTS)
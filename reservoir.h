@@ -0,0 +1,72 @@
+/*
+ * A weighted reservoir over a stream of unknown length, following
+ * Efraimidis and Spirakis' "Weighted Random Sampling with a Reservoir". It
+ * holds m items such that, at any point, they are distributed as m
+ * successive draws without replacement from the items seen so far.
+ *
+ * Each item of weight w is given the key E / w for a standard exponential
+ * E, as in without_replacement.h, and the reservoir keeps the m smallest
+ * keys in a max-heap. Rather than drawing a key for every item, A-ExpJ
+ * draws the weight to skip before the next item enters: with T the largest
+ * key held, each item enters with probability 1 - exp(-w T), so the weight
+ * skipped is exponential with rate T. The item on which the skip runs out
+ * enters with its key drawn below T. The number of insertions grows as
+ * m log(n / m), so once the reservoir has settled an item costs a
+ * subtraction and a comparison, and almost never a random number.
+ *
+ * Reservoirs fed disjoint parts of a stream, on different threads, can be
+ * merged, giving a reservoir distributed as if it had seen every part.
+ */
+#ifndef RESERVOIR_H
+#define RESERVOIR_H
+
+#include <random>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "rng.h"
+#include "weights.h"
+
+template<class URBG = default_engine, class Weight = uint64_t, class Index = uint64_t>
+class basic_reservoir {
+  static_assert(std::is_unsigned<Weight>::value || std::is_floating_point<Weight>::value,
+                "weights must be unsigned integers or floating point");
+  static_assert(std::is_integral<Index>::value, "indices must be integers");
+
+  private:
+    size_t m;
+    std::vector<std::pair<double, Index>> heap;
+    double threshold;
+    double skip;
+    uint64_t seen;
+    URBG gen;
+
+    void push(Index item, double key);
+    void replace(Index item, double key);
+    void enter(Index item, Weight weight);
+
+    template<class Item, class Weigh>
+    void consume(size_t n, Item item, Weigh weigh);
+
+  public:
+    typedef Weight weight_type;
+    typedef Index index_type;
+
+    basic_reservoir(size_t m);
+    basic_reservoir(size_t m, uint64_t seed);
+    basic_reservoir(size_t m, const URBG& engine);
+
+    void add(Index item, Weight weight);
+    void add_batch(const std::pair<Index, Weight> *items, size_t n);
+    void add_batch(const std::vector<std::pair<Index, Weight>>& items);
+    void add_batch(Index first, const Weight *weights, size_t n);
+    void merge(const basic_reservoir& other);
+
+    std::vector<Index> sample() const;
+    size_t size() const;
+    uint64_t count() const;
+};
+
+typedef basic_reservoir<> reservoir;
+
+#endif
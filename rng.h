@@ -0,0 +1,145 @@
+/*
+ * Random engines shared by the samplers. Every sampler is templated on a
+ * uniform random bit generator, defaulting to xoshiro256++, which is several
+ * times faster than std::mt19937_64 and has a 32 byte state. Engines are
+ * seeded either explicitly, for reproducible runs, or once from
+ * std::random_device.
+ *
+ * The samplers are compiled for each engine listed in SAMPLING_ENGINES.
+ */
+#ifndef RNG_H
+#define RNG_H
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <random>
+
+/*
+ * SplitMix64, used to expand a 64 bit seed into the state of the other
+ * engines.
+ */
+class splitmix64 {
+  public:
+    typedef uint64_t result_type;
+
+    explicit splitmix64(uint64_t seed = 0): state(seed) {}
+
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+
+    result_type operator()() {
+      uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+      z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+      z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+      return z ^ (z >> 31);
+    }
+
+  private:
+    uint64_t state;
+};
+
+/*
+ * Blackman and Vigna's xoshiro256++ generator, from "Scrambled Linear
+ * Pseudorandom Number Generators".
+ */
+class xoshiro256pp {
+  public:
+    typedef uint64_t result_type;
+
+    explicit xoshiro256pp(uint64_t seed = 0) {
+      this->seed(seed);
+    }
+
+    void seed(uint64_t seed) {
+      splitmix64 init(seed);
+      for (auto &word : s)
+        word = init();
+    }
+
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+
+    result_type operator()() {
+      const uint64_t result = rotl(s[0] + s[3], 23) + s[0];
+      const uint64_t t = s[1] << 17;
+
+      s[2] ^= s[0];
+      s[3] ^= s[1];
+      s[1] ^= s[2];
+      s[0] ^= s[3];
+      s[2] ^= t;
+      s[3] = rotl(s[3], 45);
+
+      return result;
+    }
+
+  private:
+    uint64_t s[4];
+
+    static uint64_t rotl(uint64_t x, int k) {
+      return (x << k) | (x >> (64 - k));
+    }
+};
+
+/*
+ * Wang Yi's wyrand generator: a single 64 bit counter mixed with one 128 bit
+ * multiplication.
+ */
+class wyrand {
+  public:
+    typedef uint64_t result_type;
+
+    explicit wyrand(uint64_t seed = 0): state(seed) {}
+
+    void seed(uint64_t seed) {
+      state = seed;
+    }
+
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+
+    result_type operator()() {
+      state += 0xA0761D6478BD642FULL;
+      unsigned __int128 t = (unsigned __int128) state * (state ^ 0xE7037ED1A0B428DBULL);
+      return (uint64_t) (t >> 64) ^ (uint64_t) t;
+    }
+
+  private:
+    uint64_t state;
+};
+
+typedef xoshiro256pp default_engine;
+
+#define SAMPLING_ENGINES(X) \
+  X(xoshiro256pp) \
+  X(wyrand) \
+  X(std::mt19937_64)
+
+/*
+ * Draws a fresh seed from the operating system.
+ */
+inline uint64_t random_seed() {
+  std::random_device rd;
+  return (uint64_t) rd() << 32 | rd();
+}
+
+/*
+ * A per-thread engine seeded once, used by the functions that are called
+ * without an explicit engine.
+ */
+inline default_engine& thread_engine() {
+  static thread_local default_engine engine(random_seed());
+  return engine;
+}
+
+/*
+ * Returns a uniform double in [0, 1).
+ */
+template<class URBG>
+inline double uniform01(URBG& gen) {
+  double u = std::generate_canonical<double, std::numeric_limits<double>::digits>(gen);
+  return u < 1.0 ? u : std::nextafter(1.0, 0.0);
+}
+
+#endif
@@ -0,0 +1,201 @@
+#include <algorithm>
+#include <thread>
+#include "sharded.h"
+
+template<class Backend>
+basic_sharded<Backend>::basic_sharded(const std::vector<Weight>& dist, int count): basic_sharded(dist, count, random_seed()) {
+}
+
+template<class Backend>
+basic_sharded<Backend>::basic_sharded(const std::vector<Weight>& dist, int count, uint64_t seed): basic_sharded(dist, count, seed, thread_pool::shared()) {
+}
+
+/*
+ * Builds the backends on the pool, each seeded from an engine seeded with
+ * the given seed. Shard s holds the items from floor(s k / S) up to the
+ * start of the next.
+ */
+template<class Backend>
+basic_sharded<Backend>::basic_sharded(const std::vector<Weight>& dist, int count, uint64_t seed, thread_pool& pool):
+  k(dist.size()), top(shard_totals(dist, shard_count(dist.size(), count))), pool(pool), in_flight(0) {
+  size_t n = shard_count(k, count);
+  default_engine seeder(seed);
+  std::vector<uint64_t> seeds(n);
+  for (size_t s = 0; s < n; s ++) {
+    seeds[s] = seeder();
+    shards.emplace_back(new shard());
+    shards[s]->start = k * s / n;
+  }
+
+  parallel_for(pool, 0, n, 1, [&](size_t lo, size_t hi) {
+    for (size_t s = lo; s < hi; s ++) {
+      shard &sh = *shards[s];
+      size_t end = s + 1 < n ? shards[s + 1]->start : k;
+      sh.weights.assign(dist.begin() + sh.start, dist.begin() + end);
+      sh.total = 0;
+      for (Weight w : sh.weights)
+        sh.total += w;
+      sh.backend.reset(new Backend(sh.weights, seeds[s]));
+      sh.scheduled = false;
+    }
+  });
+}
+
+/*
+ * Returns the number of shards, at most the number asked for and few
+ * enough that each holds two items, which the backends need.
+ */
+template<class Backend>
+size_t basic_sharded<Backend>::shard_count(size_t k, int count) {
+  return std::max<size_t>(1, std::min<size_t>(count, k / 2));
+}
+
+/*
+ * Returns the totals of the shards, padded to the two leaves the smallest
+ * concurrent_we holds.
+ */
+template<class Backend>
+std::vector<uint64_t> basic_sharded<Backend>::shard_totals(const std::vector<Weight>& dist, size_t count) {
+  std::vector<uint64_t> totals(std::max<size_t>(count, 2), 0);
+  for (size_t s = 0; s < count; s ++) {
+    for (size_t i = dist.size() * s / count; i < dist.size() * (s + 1) / count; i ++)
+      totals[s] += dist[i];
+  }
+  return totals;
+}
+
+template<class Backend>
+basic_sharded<Backend>::~basic_sharded() {
+  flush();
+}
+
+template<class Backend>
+typename basic_sharded<Backend>::Index basic_sharded<Backend>::sample() {
+  return sample(thread_engine());
+}
+
+/*
+ * Draws a shard by the totals applied so far, then an item within it. A
+ * shard emptied by a batch whose change has not yet reached the top-level
+ * tree is drawn again.
+ */
+template<class Backend>
+typename basic_sharded<Backend>::Index basic_sharded<Backend>::sample(default_engine& gen) {
+  while (true) {
+    int s = top.sample(gen);
+    shard &sh = *shards[s];
+    std::lock_guard<std::mutex> guard(sh.lock);
+    if (sh.total > 0)
+      return sh.start + sh.backend->sample();
+  }
+}
+
+/*
+ * Queues an update on its shard, and schedules the shard's task unless one
+ * is already pending. Item i lies in shard s exactly when s k < (i + 1) S
+ * <= (s + 1) k.
+ */
+template<class Backend>
+void basic_sharded<Backend>::enqueue(Index idx, Weight value, bool delta) {
+  size_t s = (((uint64_t) idx + 1) * shards.size() - 1) / k;
+  shard &sh = *shards[s];
+  bool schedule;
+  {
+    std::lock_guard<std::mutex> guard(sh.queue_lock);
+    sh.queue.push_back({ (Index) (idx - sh.start), value, delta });
+    schedule = !sh.scheduled;
+    sh.scheduled = true;
+  }
+
+  if (schedule) {
+    in_flight.fetch_add(1);
+    pool.submit([this, s] { drain(s); });
+  }
+}
+
+template<class Backend>
+void basic_sharded<Backend>::update(Index idx, Weight value) {
+  enqueue(idx, value, false);
+}
+
+template<class Backend>
+void basic_sharded<Backend>::delta_update(Index idx, Weight delta) {
+  enqueue(idx, delta, true);
+}
+
+/*
+ * Applies a batch of new weights to a backend.
+ */
+template<class Backend, class Index, class Weight>
+static void apply_batch(Backend& backend, const std::vector<std::pair<Index, Weight>>& updates) {
+  backend.update_batch(updates);
+}
+
+template<class URBG, class Weight, class Index>
+static void apply_batch(basic_vose<URBG, Weight, Index>& backend, const std::vector<std::pair<Index, Weight>>& updates) {
+  for (const std::pair<Index, Weight> &u : updates)
+    backend.update(u.first, u.second);
+}
+
+/*
+ * Applies the shard's queued updates until the queue is found empty. Each
+ * batch is turned into new weights, applied in one call under the shard's
+ * lock, and its change in the total added to the top-level tree.
+ */
+template<class Backend>
+void basic_sharded<Backend>::drain(size_t s) {
+  shard &sh = *shards[s];
+  std::vector<queued_update> batch;
+  std::vector<std::pair<Index, Weight>> updates;
+
+  while (true) {
+    {
+      std::lock_guard<std::mutex> guard(sh.queue_lock);
+      if (sh.queue.empty()) {
+        sh.scheduled = false;
+        break;
+      }
+      batch.swap(sh.queue);
+    }
+
+    uint64_t before, after;
+    {
+      std::lock_guard<std::mutex> guard(sh.lock);
+      before = sh.total;
+      updates.clear();
+      for (const queued_update &u : batch) {
+        Weight &w = sh.weights[u.idx];
+        sh.total -= w;
+        w = u.delta ? w + u.value : u.value;
+        sh.total += w;
+        updates.emplace_back(u.idx, w);
+      }
+      apply_batch(*sh.backend, updates);
+      after = sh.total;
+    }
+
+    top.delta_update(s, after - before);
+    batch.clear();
+  }
+
+  in_flight.fetch_sub(1);
+}
+
+/*
+ * Waits until every queued update has been applied, running queued tasks of
+ * the pool on the calling thread meanwhile.
+ */
+template<class Backend>
+void basic_sharded<Backend>::flush() {
+  while (in_flight.load() > 0) {
+    if (!pool.run_pending())
+      std::this_thread::yield();
+  }
+}
+
+template class basic_sharded<we>;
+template class basic_sharded<mvn>;
+template class basic_sharded<vose>;
+template class basic_sharded<we32>;
+template class basic_sharded<mvn32>;
+template class basic_sharded<vose32>;
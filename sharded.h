@@ -0,0 +1,100 @@
+/*
+ * A categorical sampler that splits the items into S shards of consecutive
+ * indices, as even as possible and of at least two items, each held by its
+ * own backend, a we, mvn or vose, so that a shard fits in a core's cache and
+ * updates to different shards do not contend.
+ *
+ * A sample picks a shard from a concurrent_we over the shard totals, then
+ * draws within it under the shard's lock. Updates are queued on their shard
+ * and applied on the thread pool, at most one task per shard at a time, in
+ * batches through the backend's update_batch; each batch then adds the
+ * change in the shard's total to the top-level tree. Updates thus take
+ * effect asynchronously: a sample sees the shard totals as concurrent_we
+ * does, and within its shard every batch applied before it took the lock.
+ * flush() waits until every queued update has been applied.
+ *
+ * Any number of threads may sample and update at once. Shards are drawn
+ * from the calling thread's engine, or from an engine passed by the caller,
+ * and items from the backends, which are seeded from the constructor's
+ * seed. A single thread sampling with an engine of its own thus draws
+ * reproducibly. Weights must be unsigned integers, and the total must stay
+ * positive while sampling: a sample retries until it finds weight, so one
+ * taken while every applied total is zero spins until an update restores
+ * some.
+ */
+#ifndef SHARDED_H
+#define SHARDED_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "concurrent_we.h"
+#include "mvn.h"
+#include "rng.h"
+#include "thread_pool.h"
+#include "vose.h"
+#include "we.h"
+
+template<class Backend>
+class basic_sharded {
+  private:
+    typedef typename Backend::weight_type Weight;
+    typedef typename Backend::index_type Index;
+
+    static_assert(std::is_unsigned<Weight>::value, "weights must be unsigned integers");
+
+    struct queued_update {
+      Index idx;
+      Weight value;
+      bool delta;
+    };
+
+    struct shard {
+      uint64_t start;
+      std::mutex lock;
+      std::unique_ptr<Backend> backend;
+      std::vector<Weight> weights;
+      uint64_t total;
+
+      std::mutex queue_lock;
+      std::vector<queued_update> queue;
+      bool scheduled;
+    };
+
+    uint64_t k;
+    std::vector<std::unique_ptr<shard>> shards;
+    basic_concurrent_we<default_engine> top;
+    thread_pool &pool;
+    std::atomic<size_t> in_flight;
+
+    static size_t shard_count(size_t k, int count);
+    static std::vector<uint64_t> shard_totals(const std::vector<Weight>& dist, size_t count);
+
+    void enqueue(Index idx, Weight value, bool delta);
+    void drain(size_t s);
+
+  public:
+    typedef Weight weight_type;
+    typedef Index index_type;
+
+    basic_sharded(const std::vector<Weight>& dist, int count);
+    basic_sharded(const std::vector<Weight>& dist, int count, uint64_t seed);
+    basic_sharded(const std::vector<Weight>& dist, int count, uint64_t seed, thread_pool& pool);
+    ~basic_sharded();
+
+    Index sample();
+    Index sample(default_engine& gen);
+    void update(Index idx, Weight value);
+    void delta_update(Index idx, Weight delta);
+    void flush();
+};
+
+typedef basic_sharded<we> sharded_we;
+typedef basic_sharded<mvn> sharded_mvn;
+typedef basic_sharded<vose> sharded_vose;
+
+#endif
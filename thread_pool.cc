@@ -0,0 +1,143 @@
+#include "thread_pool.h"
+
+/* The pool and worker index of the calling thread, if it is a worker */
+static thread_local thread_pool *current_pool = nullptr;
+static thread_local int current_worker = -1;
+
+thread_pool::thread_pool(unsigned threads): queued(0), next_queue(0), stopping(false) {
+  if (threads == 0)
+    threads = std::max(1u, std::thread::hardware_concurrency());
+
+  for (unsigned i = 0; i < threads; i ++)
+    queues.emplace_back(new task_queue());
+  for (unsigned i = 0; i < threads; i ++)
+    workers.emplace_back(&thread_pool::work, this, i);
+}
+
+thread_pool::~thread_pool() {
+  {
+    std::lock_guard<std::mutex> guard(sleep_lock);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (std::thread &worker : workers)
+    worker.join();
+}
+
+unsigned thread_pool::size() const {
+  return workers.size();
+}
+
+/*
+ * A process-wide pool with one worker per hardware thread, created on first
+ * use.
+ */
+thread_pool& thread_pool::shared() {
+  static thread_pool pool;
+  return pool;
+}
+
+void thread_pool::submit(std::function<void()> task) {
+  size_t id;
+  if (current_pool == this)
+    id = current_worker;
+  else
+    id = next_queue.fetch_add(1, std::memory_order_relaxed) % queues.size();
+
+  {
+    std::lock_guard<std::mutex> guard(queues[id]->lock);
+    queues[id]->tasks.push_back(std::move(task));
+  }
+  queued.fetch_add(1);
+
+  {
+    std::lock_guard<std::mutex> guard(sleep_lock);
+  }
+  wake.notify_one();
+}
+
+/*
+ * Takes a task from the back of the given worker's own deque, or failing
+ * that steals from the front of another. A negative id only steals.
+ */
+bool thread_pool::pop(int id, std::function<void()> &task) {
+  if (queued.load() == 0)
+    return false;
+
+  if (id >= 0) {
+    std::lock_guard<std::mutex> guard(queues[id]->lock);
+    if (!queues[id]->tasks.empty()) {
+      task = std::move(queues[id]->tasks.back());
+      queues[id]->tasks.pop_back();
+      queued.fetch_sub(1);
+      return true;
+    }
+  }
+
+  size_t start = id >= 0 ? id + 1 : 0;
+  for (size_t i = 0; i < queues.size(); i ++) {
+    task_queue &victim = *queues[(start + i) % queues.size()];
+    std::lock_guard<std::mutex> guard(victim.lock);
+    if (!victim.tasks.empty()) {
+      task = std::move(victim.tasks.front());
+      victim.tasks.pop_front();
+      queued.fetch_sub(1);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/*
+ * Runs one queued task on the calling thread, returning whether there was
+ * one.
+ */
+bool thread_pool::run_pending() {
+  std::function<void()> task;
+  if (!pop(current_pool == this ? current_worker : -1, task))
+    return false;
+
+  task();
+  return true;
+}
+
+void thread_pool::work(int id) {
+  current_pool = this;
+  current_worker = id;
+
+  std::function<void()> task;
+  while (true) {
+    if (pop(id, task)) {
+      task();
+      continue;
+    }
+
+    std::unique_lock<std::mutex> guard(sleep_lock);
+    wake.wait(guard, [this] { return stopping || queued.load() > 0; });
+    if (stopping && queued.load() == 0)
+      return;
+  }
+}
+
+task_group::task_group(thread_pool &pool): pool(pool), pending(0) {
+}
+
+task_group::~task_group() {
+  wait();
+}
+
+void task_group::run(std::function<void()> task) {
+  pending.fetch_add(1);
+  pool.submit([this, task] {
+    task();
+    pending.fetch_sub(1);
+  });
+}
+
+void task_group::wait() {
+  while (pending.load() > 0) {
+    if (!pool.run_pending())
+      std::this_thread::yield();
+  }
+}
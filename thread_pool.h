@@ -0,0 +1,92 @@
+/*
+ * A small work-stealing thread pool for the parallel samplers. Each worker
+ * owns a deque of tasks: tasks submitted from a worker go to the back of its
+ * own deque and are run last in, first out, while idle workers steal from
+ * the front of the others' deques. Tasks submitted from outside the pool are
+ * spread over the deques round robin.
+ *
+ * Fork-join work is expressed with a task_group. Waiting on a group runs
+ * queued tasks on the waiting thread until the group's tasks have finished,
+ * so groups may be nested inside tasks without deadlock.
+ */
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class thread_pool {
+  private:
+    struct task_queue {
+      std::mutex lock;
+      std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<task_queue>> queues;
+    std::vector<std::thread> workers;
+    std::atomic<size_t> queued;
+    std::atomic<size_t> next_queue;
+    std::mutex sleep_lock;
+    std::condition_variable wake;
+    bool stopping;
+
+    bool pop(int id, std::function<void()> &task);
+    void work(int id);
+
+  public:
+    explicit thread_pool(unsigned threads = 0);
+    ~thread_pool();
+    unsigned size() const;
+    void submit(std::function<void()> task);
+    bool run_pending();
+
+    static thread_pool& shared();
+};
+
+class task_group {
+  private:
+    thread_pool &pool;
+    std::atomic<size_t> pending;
+
+  public:
+    explicit task_group(thread_pool &pool);
+    ~task_group();
+    void run(std::function<void()> task);
+    void wait();
+};
+
+/*
+ * Calls f(lo, hi) on consecutive subranges of [begin, end) of at most grain
+ * elements, in parallel, and returns once all calls have finished.
+ */
+template<class F>
+void parallel_for(thread_pool &pool, size_t begin, size_t end, size_t grain, F f) {
+  task_group group(pool);
+  for (size_t lo = begin; lo < end; lo += grain) {
+    size_t hi = std::min(end, lo + grain);
+    group.run([&f, lo, hi] { f(lo, hi); });
+  }
+  group.wait();
+}
+
+/*
+ * As above, or in order on the calling thread when no pool is given.
+ */
+template<class F>
+void parallel_for(thread_pool *pool, size_t begin, size_t end, size_t grain, F f) {
+  if (pool) {
+    parallel_for(*pool, begin, end, grain, f);
+    return;
+  }
+  for (size_t lo = begin; lo < end; lo += grain)
+    f(lo, std::min(end, lo + grain));
+}
+
+#endif
@@ -0,0 +1,1113 @@
+/*
+ * Statistical validation of the samplers. The categorical samplers are run
+ * through the static, Polya, without replacement and random update scenarios
+ * of the benchmark, after which their empirical frequencies are compared
+ * with the weights they should hold by chi-squared and G-tests. Drawing an
+ * item of weight zero fails immediately. The multinomial functions are
+ * checked by a chi-squared test of their pooled counts and by
+ * Kolmogorov-Smirnov tests of individual marginals against the binomial.
+ *
+ * Every test uses a fixed seed, so results are reproducible, and fails when
+ * its p-value falls below alpha. The exit status is the number of failures.
+ */
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <boost/math/distributions/binomial.hpp>
+#include <boost/math/special_functions/gamma.hpp>
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "adaptive.h"
+#include "batch_vose.h"
+#include "bucket_sampler.h"
+#include "bwe.h"
+#include "concurrent_we.h"
+#include "dynamic_vose.h"
+#include "exact_vose.h"
+#include "fixed.h"
+#include "image.h"
+#include "logits.h"
+#include "multi.h"
+#include "mvn.h"
+#include "relles.h"
+#include "reservoir.h"
+#include "sharded.h"
+#include "thread_pool.h"
+#include "vose.h"
+#include "we.h"
+
+static const double alpha = 1e-4;
+static int failures = 0;
+
+static void report(const std::string& name, double p) {
+  bool pass = p >= alpha;
+  std::cout << "  " << name << " p = " << p << (pass ? " PASS" : " FAIL") << "\n";
+  if (!pass)
+    failures ++;
+}
+
+/*
+ * Pools the bins expected to hold fewer than five observations, so that the
+ * chi-squared approximation holds, and returns the observed and expected
+ * counts of the remaining bins. Observations in bins of zero expectation
+ * yield an empty result.
+ */
+static bool pool_bins(const std::vector<double>& observed, const std::vector<double>& expected,
+                      std::vector<double>& obs, std::vector<double>& exp) {
+  double small_obs = 0;
+  double small_exp = 0;
+  for (size_t i = 0; i < observed.size(); i ++) {
+    if (expected[i] == 0 && observed[i] > 0)
+      return false;
+    if (expected[i] < 5) {
+      small_obs += observed[i];
+      small_exp += expected[i];
+    } else {
+      obs.push_back(observed[i]);
+      exp.push_back(expected[i]);
+    }
+  }
+  if (small_exp > 0) {
+    obs.push_back(small_obs);
+    exp.push_back(small_exp);
+  }
+  return true;
+}
+
+static double chi_squared_p(double stat, size_t bins) {
+  if (bins < 2)
+    return 1;
+  return boost::math::gamma_q((bins - 1) / 2.0, stat / 2);
+}
+
+/*
+ * Pearson's chi-squared test of observed counts against expected counts with
+ * the same total.
+ */
+static double chi_squared_test(const std::vector<double>& observed, const std::vector<double>& expected) {
+  std::vector<double> obs, exp;
+  if (!pool_bins(observed, expected, obs, exp))
+    return 0;
+
+  double stat = 0;
+  for (size_t i = 0; i < obs.size(); i ++)
+    stat += (obs[i] - exp[i]) * (obs[i] - exp[i]) / exp[i];
+  return chi_squared_p(stat, obs.size());
+}
+
+/*
+ * The likelihood ratio G-test of observed counts against expected counts.
+ */
+static double g_test(const std::vector<double>& observed, const std::vector<double>& expected) {
+  std::vector<double> obs, exp;
+  if (!pool_bins(observed, expected, obs, exp))
+    return 0;
+
+  double stat = 0;
+  for (size_t i = 0; i < obs.size(); i ++) {
+    if (obs[i] > 0)
+      stat += 2 * obs[i] * std::log(obs[i] / exp[i]);
+  }
+  return chi_squared_p(stat, obs.size());
+}
+
+/*
+ * The Kolmogorov-Smirnov test of samples against the binomial distribution
+ * with n trials and success probability p, using the asymptotic Kolmogorov
+ * distribution. The test is conservative for discrete distributions.
+ */
+static double ks_binomial_test(std::vector<uint64_t> samples, uint64_t n, double p) {
+  boost::math::binomial_distribution<double> binom(n, std::min(1.0, std::max(0.0, p)));
+  std::sort(samples.begin(), samples.end());
+
+  double size = samples.size();
+  double stat = 0;
+  for (size_t i = 0; i < samples.size(); ) {
+    size_t j = i;
+    while (j < samples.size() && samples[j] == samples[i])
+      j ++;
+
+    uint64_t v = samples[i];
+    double below = v == 0 ? 0 : boost::math::cdf(binom, v - 1);
+    stat = std::max(stat, std::fabs(i / size - below));
+    stat = std::max(stat, std::fabs(j / size - boost::math::cdf(binom, v)));
+    i = j;
+  }
+
+  double lambda = (std::sqrt(size) + 0.12 + 0.11 / std::sqrt(size)) * stat;
+  double q = 0;
+  for (int j = 1; j <= 100; j ++)
+    q += 2 * (j % 2 ? 1 : -1) * std::exp(-2.0 * j * j * lambda * lambda);
+  return std::min(1.0, std::max(0.0, q));
+}
+
+/*
+ * Construction and sampling, specialized for the samplers that draw from an
+ * engine owned by the caller.
+ */
+template<class C>
+static C* build(const std::vector<uint64_t>& dist, uint64_t seed) {
+  return new C(std::vector<typename C::weight_type>(dist.begin(), dist.end()), seed);
+}
+
+template<>
+concurrent_we* build<concurrent_we>(const std::vector<uint64_t>& dist, uint64_t seed) {
+  return new concurrent_we(dist);
+}
+
+template<class C>
+static int draw(C& generator, default_engine& gen) {
+  return generator.sample();
+}
+
+static int draw(concurrent_we& generator, default_engine& gen) {
+  return generator.sample(gen);
+}
+
+/*
+ * Draws from the sampler and tests the frequencies against the weights it
+ * should hold.
+ */
+template<class C>
+static void check_frequencies(const std::string& name, C& generator, const std::vector<uint64_t>& weights, int n, default_engine& gen) {
+  std::vector<double> observed(weights.size());
+  for (int i = 0; i < n; i ++)
+    observed[draw(generator, gen)] ++;
+
+  double total = 0;
+  for (uint64_t w : weights)
+    total += w;
+  std::vector<double> expected(weights.size());
+  for (size_t i = 0; i < weights.size(); i ++)
+    expected[i] = n * (weights[i] / total);
+
+  report(name + " chi-squared", chi_squared_test(observed, expected));
+  report(name + " G-test", g_test(observed, expected));
+}
+
+static void check_support(const std::string& name, bool ok) {
+  if (!ok) {
+    std::cout << "  " << name << " drew an item of weight zero FAIL\n";
+    failures ++;
+  }
+}
+
+template<class C>
+static void static_check(const std::string& name, int m, int n) {
+  default_engine gen(1);
+  std::vector<uint64_t> dist(m);
+  for (int i = 0; i < m; i ++)
+    dist[i] = i % 7 == 0 ? 0 : gen() % 1000;
+
+  C *generator = build<C>(dist, 2);
+  check_frequencies(name + " static", *generator, dist, n, gen);
+  delete generator;
+}
+
+template<class C>
+static void polya_check(const std::string& name, int m, int steps, int n) {
+  default_engine gen(3);
+  std::vector<uint64_t> dist(m, 1);
+  C *generator = build<C>(dist, 4);
+
+  for (int i = 0; i < steps; i ++) {
+    int r = draw(*generator, gen);
+    generator->delta_update(r, 1);
+    dist[r] ++;
+  }
+
+  check_frequencies(name + " Polya", *generator, dist, n, gen);
+  delete generator;
+}
+
+template<class C>
+static void without_replacement_check(const std::string& name, int m, int per_item, int n) {
+  default_engine gen(5);
+  std::vector<uint64_t> dist(m, per_item);
+  C *generator = build<C>(dist, 6);
+
+  bool ok = true;
+  for (int i = 0; i < m * per_item * 3 / 4; i ++) {
+    int r = draw(*generator, gen);
+    ok = ok && dist[r] > 0;
+    generator->delta_update(r, -1);
+    dist[r] --;
+  }
+
+  check_support(name + " without replacement", ok);
+  check_frequencies(name + " without replacement", *generator, dist, n, gen);
+  delete generator;
+}
+
+template<class C>
+static void random_check(const std::string& name, int m, int steps, double k, int n) {
+  default_engine gen(7);
+  std::vector<uint64_t> dist(m, 1);
+  C *generator = build<C>(dist, 8);
+
+  bool ok = true;
+  for (int i = 0; i < steps; i ++) {
+    if (uniform01(gen) < k) {
+      int idx = gen() % m;
+      int value = gen() % m;
+      generator->update(idx, value);
+      dist[idx] = value;
+    } else {
+      int r = draw(*generator, gen);
+      ok = ok && dist[r] > 0;
+    }
+  }
+
+  check_support(name + " random", ok);
+  check_frequencies(name + " random", *generator, dist, n, gen);
+  delete generator;
+}
+
+template<class C>
+static void categorical_check(const std::string& name) {
+  int m = 500;
+  int n = 500000;
+
+  std::cout << name << ":\n";
+  static_check<C>(name, m, n);
+  polya_check<C>(name, m, 100000, n);
+  without_replacement_check<C>(name, m, 100, n);
+  random_check<C>(name, m, 20000, 0.1, n);
+}
+
+/*
+ * Streams k items through reservoirs of m, either whole or in parts on
+ * separate reservoirs that are then merged, and tests the first and second
+ * items held, in key order, against the distributions of successive
+ * sampling. The items are grouped into buckets of consecutive indices, so
+ * that every bucket expects enough draws.
+ */
+template<class C>
+static void reservoir_check(const std::string& name, int k, int m, int parts, int reps) {
+  default_engine gen(40);
+  std::vector<typename C::weight_type> dist(k);
+  for (int i = 0; i < k; i ++)
+    dist[i] = i % 11 == 0 ? 0 : 1 + gen() % 1000;
+
+  double total = 0;
+  for (auto w : dist)
+    total += w;
+  double spread = 0;
+  for (auto w : dist)
+    spread += w / (total - w);
+
+  int buckets = 50;
+  int per_bucket = (k + buckets - 1) / buckets;
+  std::vector<double> first(buckets), second(buckets), first_exp(buckets), second_exp(buckets);
+  for (int j = 0; j < k; j ++) {
+    first_exp[j / per_bucket] += reps * (dist[j] / total);
+    second_exp[j / per_bucket] += reps * (dist[j] / total) * (spread - dist[j] / (total - dist[j]));
+  }
+
+  bool ok = true;
+  for (int r = 0; r < reps; r ++) {
+    C merged(m, 41 + r * parts);
+    for (int p = 0; p < parts; p ++) {
+      int lo = (int64_t) k * p / parts;
+      int hi = (int64_t) k * (p + 1) / parts;
+      C part(m, 42 + r * parts + p);
+      part.add_batch(lo, dist.data() + lo, (hi - lo) / 2);
+      for (int i = lo + (hi - lo) / 2; i < hi; i ++)
+        part.add(i, dist[i]);
+      if (parts == 1)
+        merged = part;
+      else
+        merged.merge(part);
+    }
+
+    std::vector<typename C::index_type> items = merged.sample();
+    ok = ok && items.size() == (size_t) m && merged.count() == (uint64_t) k;
+    std::vector<typename C::index_type> sorted = items;
+    std::sort(sorted.begin(), sorted.end());
+    ok = ok && std::adjacent_find(sorted.begin(), sorted.end()) == sorted.end();
+    for (auto item : items)
+      ok = ok && dist[item] > 0;
+
+    first[items[0] / per_bucket] ++;
+    second[items[1] / per_bucket] ++;
+  }
+
+  std::string label = name + (parts == 1 ? "" : " merged");
+  std::cout << label << ":\n";
+  if (!ok) {
+    std::cout << "  " << label << " held repeated, zero weight or too few items FAIL\n";
+    failures ++;
+  }
+  report(label + " first item chi-squared", chi_squared_test(first, first_exp));
+  report(label + " second item chi-squared", chi_squared_test(second, second_exp));
+  report(label + " second item G-test", g_test(second, second_exp));
+}
+
+/*
+ * Tests a sharded sampler on its initial weights, then after threads have
+ * sampled and updated it at once, each updating its own items by new
+ * weights and by deltas. The updates are flushed before the frequencies are
+ * tested. Two samplers from the same seed, drawn from in turn with engines
+ * of the same seed, must first draw the same samples.
+ */
+template<class C>
+static void sharded_check(const std::string& name, int m, int shards, int n) {
+  default_engine gen(50);
+  std::vector<uint64_t> dist(m);
+  for (int i = 0; i < m; i ++)
+    dist[i] = i % 7 == 0 ? 0 : gen() % 1000;
+
+  thread_pool pool(4);
+  std::vector<typename C::weight_type> weights(dist.begin(), dist.end());
+  C generator(weights, shards, 51, pool);
+  C replay(weights, shards, 51, pool);
+  default_engine first(54), second(54);
+  bool same = true;
+  for (int i = 0; i < 10000; i ++)
+    same = same && generator.sample(first) == replay.sample(second);
+
+  std::cout << name << ":\n";
+  if (!same) {
+    std::cout << "  " << name << " differs from a sampler of the same seed FAIL\n";
+    failures ++;
+  }
+  check_frequencies(name + " static", generator, dist, n, gen);
+
+  int threads = 4;
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; t ++) {
+    workers.emplace_back([&generator, &dist, m, threads, t] {
+      default_engine local(52 + t);
+      for (int r = 0; r < 20000; r ++) {
+        int i = local() % (m / threads) * threads + t;
+        if (r % 2 == 0) {
+          uint64_t value = local() % 1000;
+          generator.update(i, value);
+          dist[i] = value;
+        } else {
+          generator.delta_update(i, 5);
+          dist[i] += 5;
+        }
+        generator.sample();
+      }
+    });
+  }
+  for (std::thread &worker : workers)
+    worker.join();
+
+  generator.flush();
+  check_frequencies(name + " concurrent updates", generator, dist, n, gen);
+}
+
+/*
+ * Races two threads setting the same light leaf of a concurrent_we to zero
+ * and one, which may take its ancestors below zero for a time, while the
+ * heavy leaf holds nearly all the weight. Almost every draw must take it.
+ */
+static void concurrent_race_check(int n) {
+  concurrent_we generator({ 0, 0, 1000000, 0 });
+  std::atomic<bool> done(false);
+  std::vector<std::thread> workers;
+  for (int t = 0; t < 2; t ++) {
+    workers.emplace_back([&generator, &done] {
+      for (uint64_t r = 0; !done.load(std::memory_order_relaxed); r ++)
+        generator.update(0, r & 1);
+    });
+  }
+
+  default_engine gen(53);
+  int astray = 0;
+  for (int i = 0; i < n; i ++)
+    astray += generator.sample(gen) != 2;
+  done = true;
+  for (std::thread &worker : workers)
+    worker.join();
+
+  std::cout << "Concurrent WE racing updates:\n";
+  if (astray > n / 10000) {
+    std::cout << "  Concurrent WE racing updates drew " << astray << " of " << n << " samples astray FAIL\n";
+    failures ++;
+  }
+}
+
+/*
+ * Runs the same scenarios on a sampler over a fixed number of items.
+ */
+template<class C, size_t K>
+static void fixed_check(const std::string& name) {
+  int n = 500000;
+
+  std::cout << name << ":\n";
+  static_check<C>(name, K, n);
+  polya_check<C>(name, K, 100000, n);
+  without_replacement_check<C>(name, K, 100, n);
+  random_check<C>(name, K, 20000, 0.1, n);
+}
+
+/*
+ * Tests sample_without_replacement against the exact distributions of the
+ * first and second items of successive sampling, where the second item is j
+ * with probability (w_j / W) * sum over i != j of w_i / (W - w_i). Every
+ * result must hold distinct items of positive weight, and the sampler must
+ * hold its original weights afterwards.
+ */
+template<class C>
+static void sample_without_replacement_check(const std::string& name, const std::vector<uint64_t>& dist, int m, int reps) {
+  default_engine gen(14);
+  C generator(std::vector<typename C::weight_type>(dist.begin(), dist.end()), 15);
+  size_t k = dist.size();
+
+  double total = 0;
+  size_t positive = 0;
+  for (uint64_t w : dist) {
+    total += w;
+    positive += w > 0;
+  }
+  double spread = 0;
+  for (uint64_t w : dist)
+    spread += w / (total - w);
+
+  std::vector<double> first(k), second(k), first_exp(k), second_exp(k);
+  for (size_t j = 0; j < k; j ++) {
+    first_exp[j] = reps * (dist[j] / total);
+    second_exp[j] = reps * (dist[j] / total) * (spread - dist[j] / (total - dist[j]));
+  }
+
+  bool ok = true;
+  for (int r = 0; r < reps; r ++) {
+    std::vector<typename C::index_type> items = generator.sample_without_replacement(m);
+    ok = ok && items.size() == std::min<size_t>(m, positive);
+    std::vector<typename C::index_type> sorted = items;
+    std::sort(sorted.begin(), sorted.end());
+    ok = ok && std::adjacent_find(sorted.begin(), sorted.end()) == sorted.end();
+    for (auto item : items)
+      ok = ok && dist[item] > 0;
+
+    first[items[0]] ++;
+    second[items[1]] ++;
+  }
+
+  if (!ok) {
+    std::cout << "  " << name << " returned repeated, zero weight or too few items FAIL\n";
+    failures ++;
+  }
+  report(name + " first item chi-squared", chi_squared_test(first, first_exp));
+  report(name + " second item chi-squared", chi_squared_test(second, second_exp));
+  report(name + " second item G-test", g_test(second, second_exp));
+  check_frequencies(name + " afterwards", generator, dist, 200000, gen);
+}
+
+/*
+ * Covers the three strategies: rejection of repeats, removal once a heavy
+ * item makes repeats common, and exponential keys for m large against k.
+ */
+template<class C>
+static void sample_without_replacement_checks(const std::string& name) {
+  default_engine gen(16);
+  std::vector<uint64_t> light(1024), heavy(1024, 1), small(64);
+  for (uint64_t &w : light)
+    w = 1 + gen() % 1000;
+  heavy[0] = 10000000;
+  for (uint64_t &w : small)
+    w = gen() % 100;
+
+  std::cout << name << " sample_without_replacement:\n";
+  sample_without_replacement_check<C>(name + " rejection", light, 16, 50000);
+  sample_without_replacement_check<C>(name + " removal", heavy, 16, 50000);
+  sample_without_replacement_check<C>(name + " exponential keys", small, 16, 50000);
+}
+
+/*
+ * Tests the batched kernels of the static Vose sampler.
+ */
+template<class C>
+static void vose_batch_check(const std::string& name, int m, int n) {
+  default_engine gen(9);
+  std::vector<uint64_t> dist(m);
+  for (int i = 0; i < m; i ++)
+    dist[i] = i % 7 == 0 ? 0 : gen() % 1000;
+
+  C generator(std::vector<typename C::weight_type>(dist.begin(), dist.end()), 10);
+  std::vector<typename C::index_type> out(n);
+  generator.sample_n(out.data(), n);
+
+  std::vector<double> observed(m), expected(m);
+  double total = 0;
+  for (uint64_t w : dist)
+    total += w;
+  for (auto r : out)
+    observed[r] ++;
+  for (int i = 0; i < m; i ++)
+    expected[i] = n * (dist[i] / total);
+
+  std::cout << name << " sample_n:\n";
+  report(name + " sample_n static chi-squared", chi_squared_test(observed, expected));
+  report(name + " sample_n static G-test", g_test(observed, expected));
+}
+
+/*
+ * Tests the exact alias table on wide weights, with a total of 2^54 + 1 that
+ * puts k * total just above 2^63, where nearly half the words are rejected,
+ * and with a total of 2^60, where the column and the offset are drawn from a
+ * word each. The first item takes up the rest of the total.
+ */
+static void exact_vose_check(int m, int n) {
+  default_engine gen(30);
+  std::cout << "Exact Vose (wide):\n";
+  for (uint64_t target : { (1ULL << 54) + 1, 1ULL << 60 }) {
+    std::vector<uint64_t> dist(m);
+    uint64_t rest = 0;
+    for (int i = 1; i < m; i ++) {
+      dist[i] = i % 7 == 0 ? 0 : gen() % (target / m);
+      rest += dist[i];
+    }
+    dist[0] = target - rest;
+
+    exact_vose generator(dist, 31);
+    check_frequencies("Exact Vose total " + std::to_string(target), generator, dist, n, gen);
+  }
+}
+
+/*
+ * Builds a sampler serially and on a pool from the same seed. The two must
+ * draw the same samples, and the parallel build must hold the weights. There
+ * are enough items to split the build, and a few heavy enough to fill slots
+ * across the splits.
+ */
+template<class C>
+static void parallel_build_check(const std::string& name, int m, int n) {
+  default_engine gen(22);
+  std::vector<uint64_t> dist(m);
+  for (int i = 0; i < m; i ++)
+    dist[i] = i % 7 == 0 ? 0 : gen() % 1000;
+  for (int i = 1; i < m; i += m / 5)
+    dist[i] = 10000000;
+
+  thread_pool pool(4);
+  std::vector<typename C::weight_type> weights(dist.begin(), dist.end());
+  C serial(weights, 23);
+  C parallel(weights, 23, pool);
+
+  bool same = true;
+  for (int i = 0; i < 100000; i ++)
+    same = same && serial.sample() == parallel.sample();
+
+  std::cout << name << " parallel build:\n";
+  check_frequencies(name + " parallel build", parallel, dist, n, gen);
+  if (!same) {
+    std::cout << "  " << name << " parallel build differs from the serial build FAIL\n";
+    failures ++;
+  }
+}
+
+/*
+ * Applies alternating batches of new weights and of deltas, small ones and
+ * ones covering a third of the items, with repeated items among them, and
+ * tests the frequencies against the weights the batches leave.
+ */
+template<class C>
+static void batch_update_check(const std::string& name, int m, int batches, int n) {
+  default_engine gen(28);
+  std::vector<uint64_t> dist(m);
+  for (int i = 0; i < m; i ++)
+    dist[i] = gen() % 1000;
+  C *generator = build<C>(dist, 29);
+
+  for (int b = 0; b < batches; b ++) {
+    std::vector<std::pair<typename C::index_type, typename C::weight_type>> batch(b % 4 < 2 ? 10 : m / 3);
+    for (auto &entry : batch) {
+      entry.first = gen() % m;
+      entry.second = b % 2 == 0 ? gen() % 1000 : gen() % 10;
+      if (b % 2 == 0)
+        dist[entry.first] = entry.second;
+      else
+        dist[entry.first] += entry.second;
+    }
+    if (b % 2 == 0)
+      generator->update_batch(batch);
+    else
+      generator->delta_update_batch(batch);
+  }
+
+  std::cout << name << " batched updates:\n";
+  check_frequencies(name + " batched updates", *generator, dist, n, gen);
+  delete generator;
+}
+
+/*
+ * Checks that the mvn statistics account for every sample and update when
+ * they are collected, and describe the forest in any build.
+ */
+static void mvn_stats_check(int m, int steps) {
+  default_engine gen(26);
+  std::vector<uint64_t> dist(m);
+  for (int i = 0; i < m; i ++)
+    dist[i] = 1 + gen() % 1000;
+  mvn generator(dist, 27);
+
+  for (int i = 0; i < steps; i ++)
+    generator.delta_update(generator.sample(), 1);
+
+  mvn_stats stats = generator.stats();
+  bool ok = stats.nodes >= (uint64_t) m && stats.levels >= 1 && stats.roots >= 1;
+#ifdef SAMPLING_MVN_STATS
+  uint64_t binned = 0;
+  for (int i = 0; i < mvn_stats::bins; i ++)
+    binned += stats.level_histogram[i];
+  ok = ok && stats.enabled && stats.samples == (uint64_t) steps && stats.updates == (uint64_t) steps &&
+       binned == stats.samples && stats.level_steps >= stats.samples && stats.queued >= stats.updates;
+#else
+  ok = ok && !stats.enabled;
+#endif
+
+  std::cout << "MVN stats:\n";
+  if (!ok) {
+    std::cout << "  MVN stats do not account for the operations FAIL\n";
+    failures ++;
+  }
+}
+
+/*
+ * Runs the adaptive sampler through a static phase, a Polya phase and a
+ * second static phase. The static phases should move it to the alias table,
+ * and the Polya phase, in which the table would be rebuilt on every sample,
+ * away from it. The frequencies are tested after each phase, with further
+ * migrations happening while they are drawn.
+ */
+static void adaptive_check(const std::string& name, int m, int steps, int n) {
+  default_engine gen(24);
+  std::vector<uint64_t> dist(m);
+  for (int i = 0; i < m; i ++)
+    dist[i] = gen() % 1000;
+  adaptive generator(dist, 25);
+
+  const char *names[] = { "static", "Polya", "static again" };
+
+  std::cout << name << " migration:\n";
+  for (int phase = 0; phase < 3; phase ++) {
+    for (int i = 0; i < steps; i ++) {
+      int r = generator.sample();
+      if (phase == 1) {
+        generator.delta_update(r, 1);
+        dist[r] ++;
+      }
+    }
+
+    if ((generator.backend() == adaptive_backend::vose) != (phase != 1)) {
+      std::cout << "  " << name << " " << names[phase] << " did not migrate to the expected backend FAIL\n";
+      failures ++;
+    }
+    check_frequencies(name + " " + names[phase], generator, dist, n, gen);
+  }
+}
+
+/*
+ * Tests the batched alias tables by drawing from the rows in turn. Each row's
+ * frequencies are compared with its weights, and the chi-squared and G
+ * statistics summed over the rows. The rows do not fill the last group of
+ * lanes, and include an all zero row, which is sampled uniformly, and one
+ * dominated by a single item. The tables built by the scalar and vector
+ * kernels must be identical.
+ */
+template<class C>
+static void batch_vose_check(const std::string& name, int rows, int k, int per_row) {
+  default_engine gen(20);
+  std::vector<typename C::weight_type> weights(rows * k);
+  for (auto &w : weights)
+    w = gen() % 3 == 0 ? 0 : gen() % 1000;
+  std::fill(weights.begin() + 2 * k, weights.begin() + 3 * k, 0);
+  std::fill(weights.begin() + 3 * k, weights.begin() + 4 * k, 1);
+  weights[3 * k + k / 2] = 100000;
+
+  C generator(weights, k, 21);
+  std::vector<typename C::index_type> order(rows * per_row);
+  for (size_t i = 0; i < order.size(); i ++)
+    order[i] = i % rows;
+  std::vector<typename C::index_type> out = generator.sample(order);
+
+  std::vector<double> observed(rows * k);
+  for (size_t i = 0; i < out.size(); i ++)
+    observed[order[i] * k + out[i]] ++;
+
+  double chi = 0;
+  double g = 0;
+  size_t bins = 1;
+  bool support = true;
+  for (int r = 0; r < rows; r ++) {
+    double total = 0;
+    for (int a = 0; a < k; a ++)
+      total += weights[r * k + a];
+    std::vector<double> row_observed(observed.begin() + r * k, observed.begin() + (r + 1) * k), row_expected(k);
+    for (int a = 0; a < k; a ++)
+      row_expected[a] = per_row * (total > 0 ? weights[r * k + a] / total : 1.0 / k);
+
+    std::vector<double> obs, exp;
+    support = support && pool_bins(row_observed, row_expected, obs, exp);
+    for (size_t i = 0; i < obs.size(); i ++) {
+      chi += (obs[i] - exp[i]) * (obs[i] - exp[i]) / exp[i];
+      if (obs[i] > 0)
+        g += 2 * obs[i] * std::log(obs[i] / exp[i]);
+    }
+    bins += obs.size() - 1;
+  }
+
+  std::cout << name << " (k = " << k << "):\n";
+  report(name + " per row chi-squared", support ? chi_squared_p(chi, bins) : 0);
+  report(name + " per row G-test", support ? chi_squared_p(g, bins) : 0);
+
+  std::vector<float> scalar_p(rows * k), vector_p(rows * k);
+  std::vector<typename C::index_type> scalar_alt(rows * k), vector_alt(rows * k);
+  C::build_with(weights, k, false, scalar_p.data(), scalar_alt.data());
+  if (C::build_with(weights, k, true, vector_p.data(), vector_alt.data()) && (scalar_p != vector_p || scalar_alt != vector_alt)) {
+    std::cout << "  " << name << " vector build differs from the scalar build FAIL\n";
+    failures ++;
+  }
+}
+
+/*
+ * Saves a sampler as an image, maps it back and tests the mapped sampler.
+ * Updating the mapped sampler must leave the file unchanged, and mapping the
+ * image as another sampler or weight type must fail.
+ */
+template<class C>
+static void image_check(const std::string& name, int m, int n) {
+  default_engine gen(17);
+  std::vector<uint64_t> dist(m);
+  for (int i = 0; i < m; i ++)
+    dist[i] = i % 7 == 0 ? 0 : gen() % 1000;
+
+  std::string path = "validate_image.tmp";
+  std::unique_ptr<C> built(build<C>(dist, 18));
+  built->save(path);
+
+  std::shared_ptr<mapped_image> image = std::make_shared<mapped_image>(path);
+  bool ok = image->verify();
+  {
+    C mapped(image, 19);
+    std::cout << name << " image:\n";
+    check_frequencies(name + " mapped", mapped, dist, n, gen);
+    mapped.update(1, 5000);
+    mapped.sample();
+  }
+  ok = ok && mapped_image(path).verify();
+
+  bool threw = false;
+  try {
+    basic_we<default_engine, float, uint32_t> other(image);
+  } catch (const std::runtime_error&) {
+    threw = true;
+  }
+  std::remove(path.c_str());
+
+  if (!ok || !threw) {
+    std::cout << "  " << name << " image was modified or accepted as another type FAIL\n";
+    failures ++;
+  }
+}
+
+typedef basic_we<default_engine, double, uint32_t> we_double;
+typedef basic_vose<default_engine, float, uint32_t> vose_float;
+
+/*
+ * Returns random logits with every seventh item at -infinity, and the
+ * probabilities they give at the given temperature.
+ */
+static std::vector<float> random_logits(int k, double temperature, std::vector<double>& probs) {
+  default_engine gen(20);
+  std::normal_distribution<float> normal(0, 2);
+  std::vector<float> logits(k);
+  for (int i = 0; i < k; i ++)
+    logits[i] = i % 7 == 3 ? -std::numeric_limits<float>::infinity() : normal(gen);
+
+  probs.resize(k);
+  double total = 0;
+  for (int i = 0; i < k; i ++)
+    total += probs[i] = std::exp(logits[i] / temperature);
+  for (double &p : probs)
+    p /= total;
+  return logits;
+}
+
+template<class C>
+static void logits_constructor_check(const std::string& name, int k, double temperature, int n) {
+  std::vector<double> probs;
+  std::vector<float> logits = random_logits(k, temperature, probs);
+  C generator(logit_span(logits), temperature, 21);
+
+  std::vector<double> observed(k), expected(k);
+  for (int i = 0; i < n; i ++)
+    observed[generator.sample()] ++;
+  for (int i = 0; i < k; i ++)
+    expected[i] = n * probs[i];
+  report(name + " from logits chi-squared", chi_squared_test(observed, expected));
+}
+
+/*
+ * Tests sample_from_logits drawing n samples per call, over k items spanning
+ * several blocks.
+ */
+static void sample_from_logits_check(int k, size_t per_call, int n) {
+  double temperature = 0.7;
+  std::vector<double> probs;
+  std::vector<float> logits = random_logits(k, temperature, probs);
+  default_engine gen(22);
+
+  std::vector<double> observed(k), expected(k);
+  bool ok = true;
+  for (int drawn = 0; drawn < n; drawn += per_call) {
+    for (int r : sample_from_logits(logit_span(logits), temperature, per_call, gen)) {
+      ok = ok && r >= 0 && r < k && probs[r] > 0;
+      if (ok)
+        observed[r] ++;
+    }
+  }
+  double total = 0;
+  for (double o : observed)
+    total += o;
+  for (int i = 0; i < k; i ++)
+    expected[i] = total * probs[i];
+
+  std::string name = "sample_from_logits k = " + std::to_string(k) + ", " + std::to_string(per_call) + " per call";
+  check_support(name, ok);
+  report(name + " chi-squared", chi_squared_test(observed, expected));
+}
+
+static void logits_checks() {
+  std::cout << "Logits:\n";
+
+  default_engine gen(23);
+  std::uniform_real_distribution<float> arg(-87, 0);
+  double worst = 0;
+  for (int i = 0; i < 100000; i ++) {
+    float x = arg(gen), y;
+    logit_exp(&x, 1, 0, 1, &y);
+    worst = std::max(worst, std::abs(y / std::exp((double) x) - 1));
+  }
+  if (worst > 1e-6) {
+    std::cout << "  logit_exp relative error " << worst << " FAIL\n";
+    failures ++;
+  }
+
+  logits_constructor_check<we_double>("WE (double)", 500, 0.7, 500000);
+  logits_constructor_check<we>("WE", 500, 0.7, 500000);
+  logits_constructor_check<vose_float>("Vose (float)", 500, 0.7, 500000);
+  logits_constructor_check<mvn>("MVN", 500, 0.7, 500000);
+  sample_from_logits_check(500, 1, 200000);
+  sample_from_logits_check(5000, 100, 500000);
+  sample_from_logits_check(500, 10000, 500000);
+
+  std::vector<float> tail(1500, -std::numeric_limits<float>::infinity());
+  for (int i = 0; i < 1000; i ++)
+    tail[i] = i % 3;
+  bool ok = true;
+  for (int r = 0; r < 100; r ++) {
+    for (int i : sample_from_logits(logit_span(tail), 1.0, 1000, gen))
+      ok = ok && i >= 0 && i < 1000;
+  }
+  check_support("sample_from_logits with an empty last block", ok);
+
+  std::vector<float> empty(10, -std::numeric_limits<float>::infinity());
+  bool threw = false;
+  try {
+    sample_from_logits(logit_span(empty), 1.0, 1, gen);
+  } catch (const std::invalid_argument&) {
+    threw = true;
+  }
+  if (!threw) {
+    std::cout << "  sample_from_logits accepted only infinite logits FAIL\n";
+    failures ++;
+  }
+}
+
+typedef std::function<std::vector<uint64_t>(uint64_t, const std::vector<long double>&, default_engine&)> multinomial_func;
+
+/*
+ * Runs a multinomial function reps times. The pooled counts are tested with
+ * chi-squared, since the sum of independent multinomials with the same
+ * probabilities is multinomial, and the marginal counts of each given range
+ * of categories with Kolmogorov-Smirnov against the binomial.
+ */
+static void multinomial_check(const std::string& name, uint64_t n, const std::vector<long double>& dist, int reps,
+                              const std::vector<std::pair<size_t, size_t>>& ranges, multinomial_func func) {
+  default_engine gen(11);
+  std::vector<double> pooled(dist.size());
+  std::vector<std::vector<uint64_t>> marginals(ranges.size());
+  bool sums = true;
+
+  for (int r = 0; r < reps; r ++) {
+    std::vector<uint64_t> counts = func(n, dist, gen);
+    uint64_t total = 0;
+    for (size_t i = 0; i < counts.size(); i ++) {
+      pooled[i] += counts[i];
+      total += counts[i];
+    }
+    sums = sums && total == n && counts.size() == dist.size();
+
+    for (size_t j = 0; j < ranges.size(); j ++) {
+      uint64_t count = 0;
+      for (size_t i = ranges[j].first; i < ranges[j].second; i ++)
+        count += counts[i];
+      marginals[j].push_back(count);
+    }
+  }
+
+  std::string label = name + " (n = " + std::to_string(n) + ", k = " + std::to_string(dist.size()) + ")";
+  if (!sums) {
+    std::cout << "  " << label << " counts do not sum to n FAIL\n";
+    failures ++;
+  }
+
+  std::vector<double> expected(dist.size());
+  for (size_t i = 0; i < dist.size(); i ++)
+    expected[i] = (double) n * reps * dist[i];
+  report(label + " chi-squared", chi_squared_test(pooled, expected));
+
+  for (size_t j = 0; j < ranges.size(); j ++) {
+    long double p = 0;
+    for (size_t i = ranges[j].first; i < ranges[j].second; i ++)
+      p += dist[i];
+    report(label + " KS [" + std::to_string(ranges[j].first) + ", " + std::to_string(ranges[j].second) + ")",
+           ks_binomial_test(marginals[j], n, p));
+  }
+}
+
+static std::vector<long double> random_dist(int k, uint64_t seed) {
+  default_engine gen(seed);
+  std::vector<long double> dist(k);
+  long double total = 0;
+  for (int i = 0; i < k; i ++) {
+    dist[i] = uniform01(gen);
+    total += dist[i];
+  }
+  for (int i = 0; i < k; i ++)
+    dist[i] /= total;
+  return dist;
+}
+
+static void multinomial_checks() {
+  std::vector<long double> dist = random_dist(20, 12);
+  size_t low = std::min_element(dist.begin(), dist.end()) - dist.begin();
+  size_t high = std::max_element(dist.begin(), dist.end()) - dist.begin();
+  std::vector<std::pair<size_t, size_t>> ranges = { { low, low + 1 }, { high, high + 1 }, { 0, 10 } };
+  thread_pool pool(2);
+
+  std::vector<std::pair<std::string, multinomial_func>> funcs = {
+    { "BTPE", [](uint64_t n, const std::vector<long double>& dist, default_engine& gen) { return btpe(n, dist, gen); } },
+    { "BTPE (streaming)", [](uint64_t n, const std::vector<long double>& dist, default_engine& gen) {
+      std::vector<uint64_t> counts(dist.size());
+      btpe_stream(n, dist.begin(), dist.end(), [&counts](uint64_t i, uint64_t count) { counts[i] += count; }, gen);
+      return counts;
+    } },
+    { "Parallel BTPE", [&pool](uint64_t n, const std::vector<long double>& dist, default_engine& gen) { return parallel_btpe(n, dist, gen(), pool); } },
+    { "Relles", [](uint64_t n, const std::vector<long double>& dist, default_engine& gen) { return relles(n, dist, gen); } },
+    { "Relles enhanced", [](uint64_t n, const std::vector<long double>& dist, default_engine& gen) { return relles_enhanced(n, dist, gen); } },
+  };
+
+  std::cout << "Multinomial:\n";
+  for (uint64_t n : { 10ULL, 1000ULL, 1000000ULL }) {
+    for (auto &func : funcs)
+      multinomial_check(func.first, n, dist, 2000, ranges, func.second);
+  }
+
+  /* btpe takes an int number of trials */
+  for (size_t i = 1; i < funcs.size(); i ++)
+    multinomial_check(funcs[i].first, 10000000000ULL, dist, 2000, ranges, funcs[i].second);
+
+  std::vector<std::pair<std::string, multinomial_func>> slow_funcs = {
+    { "Full uniform", [](uint64_t n, const std::vector<long double>& dist, default_engine& gen) { return full_uniform(n, dist, gen); } },
+    { "Full uniform binary search", [](uint64_t n, const std::vector<long double>& dist, default_engine& gen) { return full_uniform_bin_search(n, dist, gen); } },
+    { "Reverse binary search", [](uint64_t n, const std::vector<long double>& dist, default_engine& gen) { return reverse_bin_search(n, dist, gen); } },
+  };
+  for (uint64_t n : { 10ULL, 1000ULL }) {
+    for (auto &func : slow_funcs)
+      multinomial_check(func.first, n, dist, 2000, ranges, func.second);
+  }
+
+  /* Enough categories for the parallel sampler to split across blocks */
+  std::vector<long double> wide = random_dist(200000, 13);
+  std::vector<std::pair<size_t, size_t>> blocks = { { 0, 65536 }, { 65536, 131072 }, { 150000, 150001 } };
+  multinomial_check("Parallel BTPE", 1000000, wide, 200, blocks, funcs[2].second);
+  multinomial_check("BTPE (streaming)", 1000, wide, 200, blocks, funcs[1].second);
+}
+
+int main(int argc, char **argv) {
+  categorical_check<vose>("Vose");
+  vose_batch_check<vose>("Vose", 500, 500000);
+  categorical_check<vose32>("Vose (uint32_t)");
+  categorical_check<vose_float>("Vose (float)");
+  vose_batch_check<vose_float>("Vose (float)", 500, 500000);
+  categorical_check<dynamic_vose>("Dynamic Vose");
+  categorical_check<exact_vose>("Exact Vose");
+  categorical_check<exact_vose32>("Exact Vose (uint32_t)");
+  vose_batch_check<exact_vose>("Exact Vose", 500, 500000);
+  exact_vose_check(512, 500000);
+  batch_vose_check<batch_vose>("Batched Vose", 1003, 37, 2000);
+  batch_vose_check<batch_vose>("Batched Vose", 101, 256, 20000);
+  batch_vose_check<basic_batch_vose<default_engine, float, uint32_t>>("Batched Vose (float)", 2005, 8, 500);
+  categorical_check<we>("WE");
+  categorical_check<we32>("WE (uint32_t)");
+  categorical_check<we_double>("WE (double)");
+  categorical_check<bwe>("B-ary WE");
+  categorical_check<concurrent_we>("Concurrent WE");
+  concurrent_race_check(20000000);
+  categorical_check<mvn>("MVN");
+  categorical_check<mvn32>("MVN (uint32_t)");
+  mvn_stats_check(1000, 10000);
+  batch_update_check<we>("WE", 500, 40, 500000);
+  batch_update_check<we_double>("WE (double)", 500, 40, 500000);
+  batch_update_check<mvn>("MVN", 500, 40, 500000);
+  batch_update_check<mvn32>("MVN (uint32_t)", 500, 40, 500000);
+  categorical_check<bucket_sampler>("Bucket");
+  fixed_check<fixed_we<10>, 10>("Fixed WE (k = 10)");
+  fixed_check<fixed_we<64>, 64>("Fixed WE (k = 64)");
+  fixed_check<fixed_we<100>, 100>("Fixed WE (k = 100)");
+  fixed_check<basic_fixed_we<33, default_engine, double, uint32_t>, 33>("Fixed WE (double, k = 33)");
+  fixed_check<basic_fixed_we<300, default_engine, uint32_t, uint32_t>, 300>("Fixed WE (uint32_t, k = 300)");
+  fixed_check<basic_fixed_we<100, default_engine, double, uint32_t>, 100>("Fixed WE (double, k = 100)");
+  fixed_check<basic_fixed_we<65, default_engine, float, uint32_t>, 65>("Fixed WE (float, k = 65)");
+  fixed_check<fixed_vose<10>, 10>("Fixed Vose (k = 10)");
+  fixed_check<fixed_vose<100>, 100>("Fixed Vose (k = 100)");
+  categorical_check<adaptive>("Adaptive");
+  sharded_check<sharded_we>("Sharded WE", 1000, 16, 500000);
+  sharded_check<sharded_mvn>("Sharded MVN", 1000, 16, 500000);
+  sharded_check<sharded_vose>("Sharded Vose", 1000, 16, 500000);
+  sharded_check<basic_sharded<we32>>("Sharded WE (uint32_t)", 1000, 7, 500000);
+  adaptive_check("Adaptive", 20000, 400000, 2000000);
+  parallel_build_check<vose>("Vose", 150000, 20000000);
+  parallel_build_check<vose_float>("Vose (float)", 150000, 20000000);
+  parallel_build_check<exact_vose>("Exact Vose", 150000, 20000000);
+  parallel_build_check<we>("WE", 150000, 20000000);
+  parallel_build_check<we_double>("WE (double)", 150000, 20000000);
+  image_check<vose>("Vose", 500, 500000);
+  image_check<vose32>("Vose (uint32_t)", 500, 500000);
+  image_check<we>("WE", 500, 500000);
+  image_check<we32>("WE (uint32_t)", 500, 500000);
+  sample_without_replacement_checks<vose>("Vose");
+  sample_without_replacement_checks<vose_float>("Vose (float)");
+  sample_without_replacement_checks<dynamic_vose>("Dynamic Vose");
+  sample_without_replacement_checks<exact_vose>("Exact Vose");
+  sample_without_replacement_checks<we>("WE");
+  sample_without_replacement_checks<we32>("WE (uint32_t)");
+  sample_without_replacement_checks<we_double>("WE (double)");
+  sample_without_replacement_checks<bwe>("B-ary WE");
+  sample_without_replacement_checks<mvn>("MVN");
+  sample_without_replacement_checks<mvn32>("MVN (uint32_t)");
+  sample_without_replacement_checks<bucket_sampler>("Bucket");
+  sample_without_replacement_checks<adaptive>("Adaptive");
+  reservoir_check<reservoir>("Reservoir", 10000, 16, 1, 5000);
+  reservoir_check<reservoir>("Reservoir", 10000, 16, 4, 5000);
+  reservoir_check<basic_reservoir<default_engine, double, uint32_t>>("Reservoir (double)", 10000, 16, 4, 5000);
+  logits_checks();
+  multinomial_checks();
+
+  std::cout << (failures == 0 ? "All tests passed" : std::to_string(failures) + " tests failed") << "\n";
+  return failures;
+}
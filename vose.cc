@@ -1,56 +1,116 @@
-#include <queue>
+#include <algorithm>
+#include <cstring>
+#include "alias_sweep.h"
+#include "cpu.h"
+#include "thread_pool.h"
 #include "vose.h"
+#include "without_replacement.h"
 
-vose::vose(const std::vector<uint64_t> dist): gen(rd()), dist(dist), total(0) {
-  for (auto &entry : dist)
-    total += entry;
+#ifdef SAMPLING_X86
+#include <immintrin.h>
+#endif
+
+template<class URBG, class Weight, class Index>
+basic_vose<URBG, Weight, Index>::basic_vose(const std::vector<Weight> dist): basic_vose(dist, random_seed()) {
+}
+
+template<class URBG, class Weight, class Index>
+basic_vose<URBG, Weight, Index>::basic_vose(const std::vector<Weight> dist, uint64_t seed): basic_vose(dist, URBG(seed)) {
+}
+
+template<class URBG, class Weight, class Index>
+basic_vose<URBG, Weight, Index>::basic_vose(const std::vector<Weight> dist, const URBG& engine): dist(dist), gen(engine), pool(nullptr) {
   rebuild_alias_table();
 }
 
-void vose::rebuild_alias_table() {
-  std::deque<std::vector<vose_entry>::iterator> small;
-  std::deque<std::vector<vose_entry>::iterator> large;
+template<class URBG, class Weight, class Index>
+basic_vose<URBG, Weight, Index>::basic_vose(const std::vector<Weight> dist, uint64_t seed, thread_pool& pool): basic_vose(dist, URBG(seed), pool) {
+}
 
-  table.resize(dist.size());
-  stale_table = false;
+/*
+ * Builds the table on the pool, which is also used for rebuilds after
+ * updates. The table is the same as the serial constructor's.
+ */
+template<class URBG, class Weight, class Index>
+basic_vose<URBG, Weight, Index>::basic_vose(const std::vector<Weight> dist, const URBG& engine, thread_pool& pool): dist(dist), gen(engine), pool(&pool) {
+  rebuild_alias_table();
+}
 
-  if (total == 0)
-    return;
+template<class URBG, class Weight, class Index>
+basic_vose<URBG, Weight, Index>::basic_vose(logit_span logits, double temperature): basic_vose(logits, temperature, random_seed()) {
+}
 
-  const double slot_size = total / dist.size();
+template<class URBG, class Weight, class Index>
+basic_vose<URBG, Weight, Index>::basic_vose(logit_span logits, double temperature, uint64_t seed): basic_vose(logits, temperature, URBG(seed)) {
+}
 
-  for (int i = 0; i < dist.size(); i ++) {
-    table[i] = { (double) dist[i], -1 };
-    if (dist[i] > slot_size)
-      large.push_back(table.begin() + i);
-    if (dist[i] < slot_size)
-      small.push_back(table.begin() + i);
-  }
+/*
+ * Builds the table from logits, writing the weights straight into dist.
+ */
+template<class URBG, class Weight, class Index>
+basic_vose<URBG, Weight, Index>::basic_vose(logit_span logits, double temperature, const URBG& engine): dist(logits.size), gen(engine), pool(nullptr) {
+  logit_weights(logits, temperature, dist.data());
+  rebuild_alias_table();
+}
 
-  while (!small.empty() && !large.empty()) {
-    auto lg = large.front();
-    large.pop_front();
-    auto sm = small.front();
-    small.pop_front();
+template<class URBG, class Weight, class Index>
+basic_vose<URBG, Weight, Index>::basic_vose(std::shared_ptr<mapped_image> image): basic_vose(image, random_seed()) {
+}
 
-    lg->main_p -= (slot_size - sm->main_p);
-    sm->alt_i = std::distance(table.begin(), lg);
+template<class URBG, class Weight, class Index>
+basic_vose<URBG, Weight, Index>::basic_vose(std::shared_ptr<mapped_image> image, uint64_t seed): basic_vose(image, URBG(seed)) {
+}
 
-    if (lg->main_p > slot_size)
-      large.push_front(lg);
-    if (lg->main_p < slot_size)
-      small.push_front(lg);
-  }
+/*
+ * Maps the weights and alias table of a saved image without copying them.
+ */
+template<class URBG, class Weight, class Index>
+basic_vose<URBG, Weight, Index>::basic_vose(std::shared_ptr<mapped_image> image, const URBG& engine): gen(engine), stale_table(false), pool(nullptr) {
+  image->check(image_vose, image_type<Weight>(), image_type<Index>());
+  const image_header &header = image->header();
+  dist = image_array<Weight>(image, 0, header.k);
+  table = image_array<vose_entry>(image, 1, header.k);
+  total = header.total;
 }
 
-int vose::sample() {
+/*
+ * Saves the weights and alias table as an image, first rebuilding the table
+ * if updates have left it stale.
+ */
+template<class URBG, class Weight, class Index>
+void basic_vose<URBG, Weight, Index>::save(const std::string& path) {
+  if (stale_table)
+    rebuild_alias_table();
+
+  image_header header = make_image_header(image_vose, image_type<Weight>(), image_type<Index>(), dist.size(), total);
+  write_image(path, header, { { dist.data(), dist.size() * sizeof(Weight) }, { table.data(), table.size() * sizeof(vose_entry) } });
+}
+
+template<class URBG, class Weight, class Index>
+void basic_vose<URBG, Weight, Index>::rebuild_alias_table() {
+  if (table.size() != dist.size())
+    table = image_array<vose_entry>(dist.size());
+  stale_table = false;
+
+  alias_sweep<Weight> sweep(dist.data(), dist.size(), pool);
+  total = sweep.sum();
+  if (total == 0)
+    return;
+
+  parallel_for(pool, 0, dist.size(), alias_block, [this, &sweep](size_t lo, size_t hi) {
+    sweep.fill(lo, hi, table.data());
+  });
+}
+
+template<class URBG, class Weight, class Index>
+Index basic_vose<URBG, Weight, Index>::sample() {
   if (stale_table)
     rebuild_alias_table();
 
   std::uniform_real_distribution<> unif_dis(0.0, dist.size());
 
   double sample = unif_dis(gen);
-  int a = sample;
+  Index a = sample;
   double b = (sample - a) / dist.size() * total;
 
   if (b <= table[a].main_p)
@@ -59,7 +119,170 @@ int vose::sample() {
     return table[a].alt_i;
 }
 
-void vose::update(int idx, double value) {
+/*
+ * Batched sampling. Random words are drawn in blocks and handed to a kernel
+ * that resolves the alias choices for the whole block at once. Each word is
+ * turned into a uniform in [0, 1) by filling the mantissa of a double, so the
+ * scalar and vector kernels produce identical samples.
+ */
+static const size_t sample_block = 256;
+
+template<class Index>
+using sample_kernel = void (*)(const void *table, int k, double slot, const uint64_t *bits, Index *out, size_t n);
+
+template<class Entry, class Index>
+static void sample_block_scalar(const void *table_ptr, int k, double slot, const uint64_t *bits, Index *out, size_t n) {
+  const Entry *table = static_cast<const Entry*>(table_ptr);
+
+  for (size_t i = 0; i < n; i ++) {
+    uint64_t mantissa = (bits[i] >> 12) | 0x3FF0000000000000ULL;
+    double u;
+    std::memcpy(&u, &mantissa, sizeof(u));
+    double x = (u - 1.0) * k;
+    int a = x;
+    double b = (x - a) * slot;
+
+    out[i] = b <= table[a].main_p ? a : table[a].alt_i;
+  }
+}
+
+#ifdef SAMPLING_X86
+/*
+ * Gathers the thresholds of the given entries, widened to double. An entry
+ * spans two thresholds, so entry a starts at threshold 2a.
+ */
+__attribute__((target("avx2")))
+static inline __m256d gather_thresholds(const double *main_p, __m128i a) {
+  return _mm256_i32gather_pd(main_p, _mm_slli_epi32(a, 1), 8);
+}
+
+__attribute__((target("avx2")))
+static inline __m256d gather_thresholds(const float *main_p, __m128i a) {
+  return _mm256_cvtps_pd(_mm_i32gather_ps(main_p, _mm_slli_epi32(a, 1), 4));
+}
+
+__attribute__((target("avx2,avx512f,avx512vl")))
+static inline __m512d gather_thresholds(const double *main_p, __m256i a) {
+  return _mm512_i32gather_pd(_mm256_slli_epi32(a, 1), main_p, 8);
+}
+
+__attribute__((target("avx2,avx512f,avx512vl")))
+static inline __m512d gather_thresholds(const float *main_p, __m256i a) {
+  return _mm512_cvtps_pd(_mm256_i32gather_ps(main_p, _mm256_slli_epi32(a, 1), 4));
+}
+
+template<class Entry, class Index>
+__attribute__((target("avx2")))
+static void sample_block_avx2(const void *table_ptr, int k, double slot, const uint64_t *bits, Index *out, size_t n) {
+  static_assert(sizeof(Entry) == 2 * sizeof(Entry::main_p), "kernel assumes an entry spans two thresholds");
+  const Entry *table = static_cast<const Entry*>(table_ptr);
+  const int *alt_i = reinterpret_cast<const int*>(&table[0].alt_i);
+  const int alt_shift = sizeof(Entry) == 16 ? 2 : 1;
+
+  const __m256i exponent = _mm256_set1_epi64x(0x3FF0000000000000LL);
+  const __m256d one = _mm256_set1_pd(1.0);
+  const __m256d kd = _mm256_set1_pd(k);
+  const __m256d slotd = _mm256_set1_pd(slot);
+  const __m256i pack = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i r = _mm256_loadu_si256((const __m256i*) (bits + i));
+    __m256d u = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(_mm256_srli_epi64(r, 12), exponent)), one);
+    __m256d x = _mm256_mul_pd(u, kd);
+    __m128i a = _mm256_cvttpd_epi32(x);
+    __m256d b = _mm256_mul_pd(_mm256_sub_pd(x, _mm256_cvtepi32_pd(a)), slotd);
+
+    __m256d p = gather_thresholds(&table[0].main_p, a);
+    __m128i alt = _mm_i32gather_epi32(alt_i, _mm_slli_epi32(a, alt_shift), 4);
+    __m256i keep = _mm256_castpd_si256(_mm256_cmp_pd(b, p, _CMP_LE_OQ));
+    __m128i keep32 = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(keep, pack));
+
+    _mm_storeu_si128((__m128i*) (out + i), _mm_blendv_epi8(alt, a, keep32));
+  }
+
+  sample_block_scalar<Entry>(table_ptr, k, slot, bits + i, out + i, n - i);
+}
+
+template<class Entry, class Index>
+__attribute__((target("avx2,avx512f,avx512vl")))
+static void sample_block_avx512(const void *table_ptr, int k, double slot, const uint64_t *bits, Index *out, size_t n) {
+  static_assert(sizeof(Entry) == 2 * sizeof(Entry::main_p), "kernel assumes an entry spans two thresholds");
+  const Entry *table = static_cast<const Entry*>(table_ptr);
+  const int *alt_i = reinterpret_cast<const int*>(&table[0].alt_i);
+  const int alt_shift = sizeof(Entry) == 16 ? 2 : 1;
+
+  const __m512i exponent = _mm512_set1_epi64(0x3FF0000000000000LL);
+  const __m512d one = _mm512_set1_pd(1.0);
+  const __m512d kd = _mm512_set1_pd(k);
+  const __m512d slotd = _mm512_set1_pd(slot);
+
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m512i r = _mm512_loadu_si512((const void*) (bits + i));
+    __m512d u = _mm512_sub_pd(_mm512_castsi512_pd(_mm512_or_si512(_mm512_srli_epi64(r, 12), exponent)), one);
+    __m512d x = _mm512_mul_pd(u, kd);
+    __m256i a = _mm512_cvttpd_epi32(x);
+    __m512d b = _mm512_mul_pd(_mm512_sub_pd(x, _mm512_cvtepi32_pd(a)), slotd);
+
+    __m512d p = gather_thresholds(&table[0].main_p, a);
+    __m256i alt = _mm256_i32gather_epi32(alt_i, _mm256_slli_epi32(a, alt_shift), 4);
+    __mmask8 keep = _mm512_cmp_pd_mask(b, p, _CMP_LE_OQ);
+
+    _mm256_storeu_si256((__m256i*) (out + i), _mm256_mask_blend_epi32(keep, alt, a));
+  }
+
+  sample_block_scalar<Entry>(table_ptr, k, slot, bits + i, out + i, n - i);
+}
+#endif
+
+template<class Entry, class Index>
+static sample_kernel<Index> select_kernel() {
+#ifdef SAMPLING_X86
+  if (cpu_has_avx512())
+    return sample_block_avx512<Entry, Index>;
+  if (cpu_has_avx2())
+    return sample_block_avx2<Entry, Index>;
+#endif
+  return sample_block_scalar<Entry, Index>;
+}
+
+template<class URBG, class Weight, class Index>
+void basic_vose<URBG, Weight, Index>::sample_n(Index *out, size_t n) {
+  static_assert(URBG::min() == 0 && URBG::max() == UINT64_MAX, "batched sampling requires a 64 bit engine");
+  static const sample_kernel<Index> kernel = select_kernel<vose_entry, Index>();
+
+  if (stale_table)
+    rebuild_alias_table();
+
+  const double slot = total / dist.size();
+  uint64_t bits[sample_block];
+
+  while (n > 0) {
+    size_t block = std::min(n, sample_block);
+    for (size_t i = 0; i < block; i ++)
+      bits[i] = gen();
+
+    kernel(table.data(), dist.size(), slot, bits, out, block);
+    out += block;
+    n -= block;
+  }
+}
+
+template<class URBG, class Weight, class Index>
+void basic_vose<URBG, Weight, Index>::sample_n(std::vector<Index>& out) {
+  sample_n(out.data(), out.size());
+}
+
+template<class URBG, class Weight, class Index>
+std::vector<Index> basic_vose<URBG, Weight, Index>::sample_n(size_t n) {
+  std::vector<Index> out(n);
+  sample_n(out.data(), n);
+  return out;
+}
+
+template<class URBG, class Weight, class Index>
+void basic_vose<URBG, Weight, Index>::update(Index idx, Weight value) {
   total -= dist[idx];
   total += value;
   dist[idx] = value;
@@ -67,7 +290,37 @@ void vose::update(int idx, double value) {
   stale_table = true;
 }
 
-void vose::delta_update(int idx, double delta) {
+template<class URBG, class Weight, class Index>
+void basic_vose<URBG, Weight, Index>::delta_update(Index idx, Weight delta) {
   update(idx, dist[idx] + delta);
 }
 
+/*
+ * Draws m distinct items, each in proportion to its weight among the items
+ * not yet drawn, and returns them in draw order. Fewer are returned only if
+ * fewer than m items have positive weight. Items are drawn in batches with
+ * sample_n and repeats rejected. If repeats come to dominate, or m is above
+ * k / 8, the rest are drawn by exponential keys, as updates would rebuild
+ * the table.
+ */
+template<class URBG, class Weight, class Index>
+std::vector<Index> basic_vose<URBG, Weight, Index>::sample_without_replacement(int m) {
+  std::vector<Index> out;
+  if (m <= 0 || total <= 0)
+    return out;
+  out.reserve(m);
+
+  index_set seen(m);
+  if ((uint64_t) m * 8 < dist.size() &&
+      reject_repeats(m, [this](Index *batch, size_t n) { sample_n(batch, n); }, seen, out))
+    return out;
+
+  exponential_keys(dist.size(), [this, &seen](size_t i) { return seen.contains(i) ? Weight(0) : dist[i]; }, m, out, gen);
+  return out;
+}
+
+#define INSTANTIATE(URBG) template class basic_vose<URBG>;
+SAMPLING_ENGINES(INSTANTIATE)
+
+#define INSTANTIATE_WEIGHTS(Weight, Index) template class basic_vose<default_engine, Weight, Index>;
+SAMPLING_WEIGHT_TYPES(INSTANTIATE_WEIGHTS)
@@ -3,37 +3,82 @@
  * from categorical distributions with O(k) setup time. This method was
  * proposed in "A Linear Algorithm for Generating Random Numbers with a given
  * Distribution".
+ *
+ * The table stores each threshold in double precision, or in single
+ * precision for 4 byte weight types, where with uint32_t indices an entry
+ * takes 8 bytes rather than 16. Indices must be 32 bit integers, which the
+ * batched kernels gather directly.
+ *
+ * Tables can be built on a thread pool, giving the same table as the serial
+ * build. A built table can be saved as an image and mapped by later
+ * processes, as described in image.h.
  */
 
 #ifndef VOSE_H
 #define VOSE_H
 
+#include <memory>
 #include <random>
+#include <string>
+#include <type_traits>
 #include <vector>
+#include "image.h"
+#include "logits.h"
+#include "rng.h"
+#include "weights.h"
+
+class thread_pool;
+
+template<class URBG = default_engine, class Weight = uint64_t, class Index = int>
+class basic_vose {
+  static_assert(std::is_unsigned<Weight>::value || std::is_floating_point<Weight>::value,
+                "weights must be unsigned integers or floating point");
+  static_assert(std::is_integral<Index>::value && sizeof(Index) == 4, "indices must be 32 bit integers");
 
-class vose {
   private:
+    typedef typename std::conditional<sizeof(Weight) <= 4, float, double>::type threshold;
+
     struct vose_entry {
-      double main_p;
-      int alt_i;
+      threshold main_p;
+      Index alt_i;
     };
 
-    std::vector<uint64_t> dist;
-    std::vector<vose_entry> table;
-    std::random_device rd;
-    std::mt19937_64 gen;
+    image_array<Weight> dist;
+    image_array<vose_entry> table;
+    URBG gen;
     double total;
     bool stale_table;
+    thread_pool *pool;
 
     void rebuild_alias_table();
 
   public:
-    vose(const std::vector<uint64_t> dist);
+    typedef Weight weight_type;
+    typedef Index index_type;
 
-    int sample();
-    void update(int idx, double value);
-    void delta_update(int idx, double delta);
+    basic_vose(const std::vector<Weight> dist);
+    basic_vose(const std::vector<Weight> dist, uint64_t seed);
+    basic_vose(const std::vector<Weight> dist, const URBG& engine);
+    basic_vose(const std::vector<Weight> dist, uint64_t seed, thread_pool& pool);
+    basic_vose(const std::vector<Weight> dist, const URBG& engine, thread_pool& pool);
+    basic_vose(logit_span logits, double temperature = 1.0);
+    basic_vose(logit_span logits, double temperature, uint64_t seed);
+    basic_vose(logit_span logits, double temperature, const URBG& engine);
+    basic_vose(std::shared_ptr<mapped_image> image);
+    basic_vose(std::shared_ptr<mapped_image> image, uint64_t seed);
+    basic_vose(std::shared_ptr<mapped_image> image, const URBG& engine);
+    void save(const std::string& path);
+
+    Index sample();
+    void sample_n(Index *out, size_t n);
+    void sample_n(std::vector<Index>& out);
+    std::vector<Index> sample_n(size_t n);
+    void update(Index idx, Weight value);
+    void delta_update(Index idx, Weight delta);
+    std::vector<Index> sample_without_replacement(int m);
 };
 
-#endif
+typedef basic_vose<> vose;
+typedef basic_vose<default_engine, uint32_t, uint32_t> vose32;
 
+#endif
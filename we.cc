@@ -1,49 +1,351 @@
+#include <algorithm>
+#include "thread_pool.h"
 #include "we.h"
+#include "without_replacement.h"
 
-we::we(const std::vector<uint64_t>& dist): gen(rd()) {
-  levels = 2 + (int) std::floor(std::log2(dist.size() - 1));
-  round_size = 1ULL << (levels - 1);
-  tree = std::vector<uint64_t>(round_size * 2 - 1);
+template<class URBG, class Weight, class Index>
+basic_we<URBG, Weight, Index>::basic_we(const std::vector<Weight>& dist): basic_we(dist, random_seed()) {
+}
+
+template<class URBG, class Weight, class Index>
+basic_we<URBG, Weight, Index>::basic_we(const std::vector<Weight>& dist, uint64_t seed): basic_we(dist, URBG(seed)) {
+}
+
+template<class URBG, class Weight, class Index>
+basic_we<URBG, Weight, Index>::basic_we(const std::vector<Weight>& dist, const URBG& engine): gen(engine) {
+  set_levels(dist.size());
+  tree = image_array<Weight>(round_size * 2 - 1);
   std::copy(dist.begin(), dist.end(), tree.begin() + round_size - 1);
+  sum_levels(nullptr);
+}
 
-  for (int size = round_size / 2; size > 0; size /= 2)
-    for (int i = 0; i < size; i ++)
-      tree[size + i - 1] = tree[(size + i) * 2 - 1] + tree[(size + i) * 2];
+template<class URBG, class Weight, class Index>
+basic_we<URBG, Weight, Index>::basic_we(const std::vector<Weight>& dist, uint64_t seed, thread_pool& pool): basic_we(dist, URBG(seed), pool) {
 }
 
-int we::sample() {
-  std::uniform_int_distribution<uint64_t> dis(0, tree[0] - 1);
-  int targ = dis(gen);
-  int pos = 0;
-  for (int i = 0; i < levels - 1; i ++) {
-    if (targ < tree[pos * 2 + 1])
-      pos = pos * 2 + 1;
-    else {
-      targ -= tree[pos * 2 + 1];
-      pos = pos * 2 + 2;
-    }
+/*
+ * Copies the leaves and sums the tree on the pool, giving the same tree as
+ * the serial constructor.
+ */
+template<class URBG, class Weight, class Index>
+basic_we<URBG, Weight, Index>::basic_we(const std::vector<Weight>& dist, const URBG& engine, thread_pool& pool): gen(engine) {
+  set_levels(dist.size());
+  tree = image_array<Weight>(round_size * 2 - 1);
+  parallel_for(pool, 0, dist.size(), sum_block, [this, &dist](size_t lo, size_t hi) {
+    std::copy(dist.begin() + lo, dist.begin() + hi, tree.begin() + round_size - 1 + lo);
+  });
+  sum_levels(&pool);
+}
+
+template<class URBG, class Weight, class Index>
+basic_we<URBG, Weight, Index>::basic_we(logit_span logits, double temperature): basic_we(logits, temperature, random_seed()) {
+}
+
+template<class URBG, class Weight, class Index>
+basic_we<URBG, Weight, Index>::basic_we(logit_span logits, double temperature, uint64_t seed): basic_we(logits, temperature, URBG(seed)) {
+}
+
+/*
+ * Builds the tree from logits, writing the weights straight into the leaves.
+ */
+template<class URBG, class Weight, class Index>
+basic_we<URBG, Weight, Index>::basic_we(logit_span logits, double temperature, const URBG& engine): gen(engine) {
+  set_levels(logits.size);
+  tree = image_array<Weight>(round_size * 2 - 1);
+  logit_weights(logits, temperature, tree.data() + round_size - 1);
+  sum_levels(nullptr);
+}
+
+template<class URBG, class Weight, class Index>
+basic_we<URBG, Weight, Index>::basic_we(std::shared_ptr<mapped_image> image): basic_we(image, random_seed()) {
+}
+
+template<class URBG, class Weight, class Index>
+basic_we<URBG, Weight, Index>::basic_we(std::shared_ptr<mapped_image> image, uint64_t seed): basic_we(image, URBG(seed)) {
+}
+
+/*
+ * Maps the tree of a saved image without copying it.
+ */
+template<class URBG, class Weight, class Index>
+basic_we<URBG, Weight, Index>::basic_we(std::shared_ptr<mapped_image> image, const URBG& engine): gen(engine) {
+  image->check(image_we, image_type<Weight>(), image_type<Index>());
+  set_levels(image->header().k);
+  tree = image_array<Weight>(image, 0, round_size * 2 - 1);
+}
+
+/*
+ * Fills in the internal nodes from the leaves. With a pool, the subtrees of
+ * sum_block leaves are summed in parallel, each level by level, and the
+ * levels above them after. Every node is the sum of the same two children
+ * either way.
+ */
+template<class URBG, class Weight, class Index>
+void basic_we<URBG, Weight, Index>::sum_levels(thread_pool *pool) {
+  uint64_t top = round_size / 2;
+  if (pool && round_size > sum_block) {
+    parallel_for(pool, 0, round_size / sum_block, 1, [this](size_t lo, size_t hi) {
+      for (uint64_t size = round_size / 2, width = sum_block / 2; width > 0; size /= 2, width /= 2)
+        for (uint64_t i = lo * width; i < hi * width; i ++)
+          tree[size + i - 1] = tree[(size + i) * 2 - 1] + tree[(size + i) * 2];
+    });
+    top = round_size / sum_block / 2;
   }
-  pos -= round_size - 1;
 
-  return pos;
+  for (uint64_t size = top; size > 0; size /= 2)
+    for (uint64_t i = 0; i < size; i ++)
+      tree[size + i - 1] = tree[(size + i) * 2 - 1] + tree[(size + i) * 2];
+}
+
+template<class URBG, class Weight, class Index>
+void basic_we<URBG, Weight, Index>::set_levels(uint64_t k) {
+  levels = 2 + (int) std::floor(std::log2(k - 1));
+  round_size = 1ULL << (levels - 1);
+}
+
+/*
+ * Saves the tree as an image whose item count is the number of leaves.
+ */
+template<class URBG, class Weight, class Index>
+void basic_we<URBG, Weight, Index>::save(const std::string& path) const {
+  image_header header = make_image_header(image_we, image_type<Weight>(), image_type<Index>(), round_size, tree[0]);
+  write_image(path, header, { { tree.data(), tree.size() * sizeof(Weight) } });
+}
+
+/*
+ * Steps from an internal node to the child whose subtree holds the target,
+ * which is made relative to that subtree. Floating point sums may round so
+ * that the target overshoots the right subtree; an empty right subtree is
+ * then never entered, so items of zero weight are never drawn.
+ */
+template<class URBG, class Weight, class Index>
+uint64_t basic_we<URBG, Weight, Index>::descend(uint64_t pos, Weight& targ) const {
+  Weight left = tree[pos * 2 + 1];
+  if (targ < left || (!std::is_integral<Weight>::value && tree[pos * 2 + 2] == 0))
+    return pos * 2 + 1;
+  targ -= left;
+  return pos * 2 + 2;
+}
+
+template<class URBG, class Weight, class Index>
+Index basic_we<URBG, Weight, Index>::sample() {
+  Weight targ = uniform_target(tree[0], gen);
+  uint64_t pos = 0;
+  for (int i = 0; i < levels - 1; i ++)
+    pos = descend(pos, targ);
+
+  return pos - (round_size - 1);
 }
 
-void we::update(int idx, int value) {
+template<class URBG, class Weight, class Index>
+void basic_we<URBG, Weight, Index>::update(Index idx, Weight value) {
   tree[round_size + idx - 1] = value;
 
-  for (int i = (round_size + idx - 2) / 2; i != 0; i = (i - 1) / 2) {
+  for (uint64_t i = (round_size + idx - 2) / 2; i != 0; i = (i - 1) / 2) {
     tree[i] = tree[i * 2 + 1] + tree[i * 2 + 2];
   }
 
   tree[0] = tree[1] + tree[2];
 }
 
-void we::delta_update(int idx, int delta) {
+/*
+ * Adds the delta along the path to the root. Unsigned deltas wrap, so
+ * negative ones may be passed. Floating point sums are recomputed from the
+ * children instead, so that rounding does not accumulate over updates.
+ */
+template<class URBG, class Weight, class Index>
+void basic_we<URBG, Weight, Index>::delta_update(Index idx, Weight delta) {
+  if (!std::is_integral<Weight>::value) {
+    update(idx, tree[round_size + idx - 1] + delta);
+    return;
+  }
+
   tree[round_size + idx - 1] += delta;
 
-  for (int i = (round_size + idx - 2) / 2; i != 0; i = (i - 1) / 2) {
+  for (uint64_t i = (round_size + idx - 2) / 2; i != 0; i = (i - 1) / 2) {
     tree[i] += delta;
   }
 
   tree[0] += delta;
 }
+
+/*
+ * Recomputes every internal node above the given positions, which must all
+ * lie on the leaf level. Below the first level with as many nodes as there
+ * are positions, the paths rarely meet, and each is walked up on its own, a
+ * node shared by several being recomputed by each so that the last is
+ * correct. The levels above, where the paths do meet, are summed whole once,
+ * bottom up. This takes O(b log(k / b) + b) time for b positions, and no
+ * more than summing the whole tree.
+ */
+template<class URBG, class Weight, class Index>
+void basic_we<URBG, Weight, Index>::rebuild_paths(const std::vector<uint64_t>& nodes) {
+  int top = 0;
+  while (top < levels - 1 && (1ULL << top) < nodes.size())
+    top ++;
+
+  for (uint64_t pos : nodes) {
+    for (int depth = levels - 2; depth >= top; depth --) {
+      pos = (pos - 1) / 2;
+      tree[pos] = tree[pos * 2 + 1] + tree[pos * 2 + 2];
+    }
+  }
+
+  for (uint64_t size = (1ULL << top) / 2; size > 0; size /= 2)
+    for (uint64_t i = 0; i < size; i ++)
+      tree[size + i - 1] = tree[(size + i) * 2 - 1] + tree[(size + i) * 2];
+}
+
+/*
+ * Sets the weights of a batch of items, the last value given for an item
+ * taking effect, and then recomputes the ancestors of the changed leaves, in
+ * O(b log(k / b) + b) time for b updates. Batches too small to share more
+ * than the cached top of the tree are applied one at a time.
+ */
+template<class URBG, class Weight, class Index>
+void basic_we<URBG, Weight, Index>::update_batch(const std::pair<Index, Weight> *updates, size_t n) {
+  if (n < small_batch) {
+    for (size_t i = 0; i < n; i ++)
+      update(updates[i].first, updates[i].second);
+    return;
+  }
+
+  std::vector<uint64_t> nodes(n);
+  for (size_t i = 0; i < n; i ++) {
+    nodes[i] = round_size + updates[i].first - 1;
+    tree[nodes[i]] = updates[i].second;
+  }
+  rebuild_paths(nodes);
+}
+
+template<class URBG, class Weight, class Index>
+void basic_we<URBG, Weight, Index>::update_batch(const std::vector<std::pair<Index, Weight>>& updates) {
+  update_batch(updates.data(), updates.size());
+}
+
+/*
+ * Adds a batch of deltas, which may repeat an item, and recomputes the
+ * ancestors as update_batch does. Unsigned deltas wrap as in delta_update.
+ */
+template<class URBG, class Weight, class Index>
+void basic_we<URBG, Weight, Index>::delta_update_batch(const std::pair<Index, Weight> *updates, size_t n) {
+  if (n < small_batch) {
+    for (size_t i = 0; i < n; i ++)
+      delta_update(updates[i].first, updates[i].second);
+    return;
+  }
+
+  std::vector<uint64_t> nodes(n);
+  for (size_t i = 0; i < n; i ++) {
+    nodes[i] = round_size + updates[i].first - 1;
+    tree[nodes[i]] += updates[i].second;
+  }
+  rebuild_paths(nodes);
+}
+
+template<class URBG, class Weight, class Index>
+void basic_we<URBG, Weight, Index>::delta_update_batch(const std::vector<std::pair<Index, Weight>>& updates) {
+  delta_update_batch(updates.data(), updates.size());
+}
+
+/*
+ * Draws n samples with replacement, descending the tree for a group of
+ * samples at once, level by level, so that their cache misses overlap.
+ */
+template<class URBG, class Weight, class Index>
+void basic_we<URBG, Weight, Index>::sample_batch(Index *out, size_t n) {
+  static const int lanes = 16;
+
+  for (size_t base = 0; base < n; base += lanes) {
+    int count = std::min<size_t>(lanes, n - base);
+    Weight targ[lanes];
+    uint64_t pos[lanes];
+    for (int j = 0; j < count; j ++) {
+      targ[j] = uniform_target(tree[0], gen);
+      pos[j] = 0;
+    }
+
+    for (int i = 0; i < levels - 1; i ++) {
+      for (int j = 0; j < count; j ++) {
+        pos[j] = descend(pos[j], targ[j]);
+        if (i < levels - 2)
+          __builtin_prefetch(&tree[pos[j] * 2 + 1]);
+      }
+    }
+
+    for (int j = 0; j < count; j ++)
+      out[base + j] = pos[j] - (round_size - 1);
+  }
+}
+
+/*
+ * Draws m distinct items, each in proportion to its weight among the items
+ * not yet drawn, and returns them in draw order. Fewer are returned only if
+ * fewer than m items have positive weight.
+ *
+ * Items are first drawn in batches with repeats rejected, leaving the tree
+ * untouched. If repeats come to dominate, the items drawn so far are zeroed
+ * along their paths, the remainder are drawn one at a time and zeroed in
+ * turn, and all weights are restored afterwards in one pass over the shared
+ * ancestors. For m above k / 8, exponential keys over the leaves are used.
+ */
+template<class URBG, class Weight, class Index>
+std::vector<Index> basic_we<URBG, Weight, Index>::sample_without_replacement(int m) {
+  std::vector<Index> out;
+  if (m <= 0 || tree[0] == 0)
+    return out;
+  out.reserve(m);
+
+  if ((uint64_t) m * 8 >= round_size) {
+    exponential_keys(round_size, [this](size_t i) { return tree[round_size - 1 + i]; }, m, out, gen);
+    return out;
+  }
+
+  index_set seen(m);
+  if (reject_repeats(m, [this](Index *batch, size_t n) { sample_batch(batch, n); }, seen, out))
+    return out;
+
+  std::vector<Weight> taken(out.size());
+  for (size_t j = 0; j < out.size(); j ++) {
+    taken[j] = tree[round_size + out[j] - 1];
+    remove(out[j], taken[j]);
+  }
+
+  while (out.size() < m && tree[0] > 0) {
+    Index r = sample();
+    out.push_back(r);
+    taken.push_back(tree[round_size + r - 1]);
+    remove(r, taken.back());
+  }
+
+  std::vector<uint64_t> nodes(out.size());
+  for (size_t j = 0; j < out.size(); j ++) {
+    nodes[j] = round_size + out[j] - 1;
+    tree[nodes[j]] = taken[j];
+  }
+  rebuild_paths(nodes);
+
+  return out;
+}
+
+/*
+ * Subtracts the given weight along the path from an item's leaf to the root.
+ * Floating point weights remove the whole item, recomputing the path.
+ */
+template<class URBG, class Weight, class Index>
+void basic_we<URBG, Weight, Index>::remove(Index idx, Weight weight) {
+  if (!std::is_integral<Weight>::value) {
+    update(idx, 0);
+    return;
+  }
+
+  for (uint64_t i = round_size + idx - 1; i != 0; i = (i - 1) / 2)
+    tree[i] -= weight;
+  tree[0] -= weight;
+}
+
+#define INSTANTIATE(URBG) template class basic_we<URBG>;
+SAMPLING_ENGINES(INSTANTIATE)
+
+#define INSTANTIATE_WEIGHTS(Weight, Index) template class basic_we<default_engine, Weight, Index>;
+SAMPLING_WEIGHT_TYPES(INSTANTIATE_WEIGHTS)
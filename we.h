@@ -3,27 +3,83 @@
  * categorical random variables. The original algorithm was specified in
  * "An Efficient Method for Weighted Sampling without Replacement". This
  * implementation uses a fixed size, flattened tree representation.
+ *
+ * Internal nodes hold the sums of their subtrees in the weight type, so the
+ * total weight must be representable in it; with uint32_t weights the tree
+ * takes half the memory of the default.
+ *
+ * Batches of updates recompute the levels their paths share once.
+ *
+ * Trees can be built on a thread pool. A built tree can be saved as an image
+ * and mapped by later processes, as described in image.h.
  */
 #ifndef WE_H
 #define WE_H
 
+#include <memory>
 #include <random>
+#include <string>
+#include <type_traits>
+#include <utility>
 #include <vector>
+#include "image.h"
+#include "logits.h"
+#include "rng.h"
+#include "weights.h"
+
+class thread_pool;
+
+template<class URBG = default_engine, class Weight = uint64_t, class Index = int>
+class basic_we {
+  static_assert(std::is_unsigned<Weight>::value || std::is_floating_point<Weight>::value,
+                "weights must be unsigned integers or floating point");
+  static_assert(std::is_integral<Index>::value, "indices must be integers");
 
-class we {
   private:
     uint64_t levels;
     uint64_t round_size;
-    std::vector<uint64_t> tree;
-    std::random_device rd;
-    std::mt19937_64 gen;
+    image_array<Weight> tree;
+    URBG gen;
+
+    static const uint64_t sum_block = 1 << 16;
+    static const size_t small_batch = 64;
+
+    void set_levels(uint64_t k);
+    void sum_levels(thread_pool *pool);
+
+    uint64_t descend(uint64_t pos, Weight& targ) const;
+    void remove(Index idx, Weight weight);
+    void rebuild_paths(const std::vector<uint64_t>& nodes);
+    void sample_batch(Index *out, size_t n);
 
   public:
-    we(const std::vector<uint64_t>& dist);
-    int sample();
-    void update(int idx, int value);
-    void delta_update(int idx, int delta);
+    typedef Weight weight_type;
+    typedef Index index_type;
+
+    basic_we(const std::vector<Weight>& dist);
+    basic_we(const std::vector<Weight>& dist, uint64_t seed);
+    basic_we(const std::vector<Weight>& dist, const URBG& engine);
+    basic_we(const std::vector<Weight>& dist, uint64_t seed, thread_pool& pool);
+    basic_we(const std::vector<Weight>& dist, const URBG& engine, thread_pool& pool);
+    basic_we(logit_span logits, double temperature = 1.0);
+    basic_we(logit_span logits, double temperature, uint64_t seed);
+    basic_we(logit_span logits, double temperature, const URBG& engine);
+    basic_we(std::shared_ptr<mapped_image> image);
+    basic_we(std::shared_ptr<mapped_image> image, uint64_t seed);
+    basic_we(std::shared_ptr<mapped_image> image, const URBG& engine);
+    void save(const std::string& path) const;
+    Index sample();
+    void update(Index idx, Weight value);
+    void delta_update(Index idx, Weight delta);
+    void update_batch(const std::pair<Index, Weight> *updates, size_t n);
+    void update_batch(const std::vector<std::pair<Index, Weight>>& updates);
+    void delta_update_batch(const std::pair<Index, Weight> *updates, size_t n);
+    void delta_update_batch(const std::vector<std::pair<Index, Weight>>& updates);
+    std::vector<Index> sample_without_replacement(int m);
 };
 
+typedef basic_we<> we;
+typedef basic_we<default_engine, uint32_t, uint32_t> we32;
+
 #endif
 
@@ -0,0 +1,48 @@
+/*
+ * Support for the weight and index types of the categorical samplers. Weights
+ * may be any unsigned integer or floating point type, and indices any integer
+ * type. Integer weights are sampled exactly by we, mvn, bucket_sampler and
+ * exact_vose. vose and its variants compare a floating point uniform against
+ * floating point thresholds, so like floating point weights they are exact
+ * only up to rounding. Items of zero weight are never drawn.
+ *
+ * Besides uint64_t weights and int indices with every engine, the samplers
+ * are compiled with the default engine for each pair listed in
+ * SAMPLING_WEIGHT_TYPES, or SAMPLING_INTEGER_WEIGHT_TYPES for samplers that
+ * require integer weights.
+ */
+#ifndef WEIGHTS_H
+#define WEIGHTS_H
+
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <type_traits>
+#include "rng.h"
+
+#define SAMPLING_INTEGER_WEIGHT_TYPES(X) \
+  X(uint32_t, uint32_t) \
+  X(uint64_t, uint32_t)
+
+#define SAMPLING_WEIGHT_TYPES(X) \
+  SAMPLING_INTEGER_WEIGHT_TYPES(X) \
+  X(float, uint32_t) \
+  X(double, uint32_t) \
+  X(double, int)
+
+/*
+ * Draws a target uniformly from [0, total), for a positive total.
+ */
+template<class Weight, class URBG>
+typename std::enable_if<std::is_integral<Weight>::value, Weight>::type uniform_target(Weight total, URBG& gen) {
+  std::uniform_int_distribution<Weight> dis(0, total - 1);
+  return dis(gen);
+}
+
+template<class Weight, class URBG>
+typename std::enable_if<std::is_floating_point<Weight>::value, Weight>::type uniform_target(Weight total, URBG& gen) {
+  Weight targ = uniform01(gen) * total;
+  return targ < total ? targ : std::nextafter(total, Weight(0));
+}
+
+#endif
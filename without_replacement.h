@@ -0,0 +1,124 @@
+/*
+ * Helpers for weighted sampling without replacement, where m distinct items
+ * are drawn, each in proportion to its weight among the items not yet drawn.
+ *
+ * When the drawn items hold little of the total weight, the cheapest exact
+ * method is rejection: items are drawn with replacement and repeats are
+ * discarded, which leaves the sampler untouched. Otherwise items are removed
+ * as they are drawn, or for m approaching k, exponential keys are used,
+ * following Efraimidis and Spirakis' "Weighted Random Sampling with a
+ * Reservoir". Each item of positive weight w receives the key E / w for a
+ * standard exponential E, and the items with the m smallest keys, in
+ * increasing order of key, are distributed as m successive draws.
+ */
+#ifndef WITHOUT_REPLACEMENT_H
+#define WITHOUT_REPLACEMENT_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include "rng.h"
+
+/*
+ * A set of item indices sized for a known number of insertions, using open
+ * addressing with linear probing.
+ */
+class index_set {
+  private:
+    std::vector<uint64_t> slots;
+    uint64_t mask;
+
+    uint64_t slot(uint64_t idx) const {
+      return (idx * 0x9E3779B97F4A7C15ULL) >> 32 & mask;
+    }
+
+  public:
+    explicit index_set(size_t capacity) {
+      uint64_t size = 16;
+      while (size < capacity * 2)
+        size *= 2;
+      slots.assign(size, UINT64_MAX);
+      mask = size - 1;
+    }
+
+    /* Inserts the index, returning whether it was absent */
+    bool insert(uint64_t idx) {
+      for (uint64_t s = slot(idx); ; s = (s + 1) & mask) {
+        if (slots[s] == idx)
+          return false;
+        if (slots[s] == UINT64_MAX) {
+          slots[s] = idx;
+          return true;
+        }
+      }
+    }
+
+    bool contains(uint64_t idx) const {
+      for (uint64_t s = slot(idx); ; s = (s + 1) & mask) {
+        if (slots[s] == idx)
+          return true;
+        if (slots[s] == UINT64_MAX)
+          return false;
+      }
+    }
+};
+
+/*
+ * Appends new items to out until it holds m, drawing batches with
+ * replacement through draw(buffer, count) and discarding the items already
+ * in seen. The new items appear in the order of their first draw. Returns
+ * false, leaving out short, once more than half of a batch are repeats, at
+ * which point the caller should continue by another method.
+ */
+template<class Index, class Draw>
+bool reject_repeats(size_t m, Draw draw, index_set& seen, std::vector<Index>& out) {
+  std::vector<Index> batch;
+  while (out.size() < m) {
+    size_t need = m - out.size();
+    batch.resize(std::min<size_t>(4096, need + need / 4 + 8));
+    draw(batch.data(), batch.size());
+
+    size_t repeats = 0;
+    for (Index r : batch) {
+      if (!seen.insert(r)) {
+        repeats ++;
+        continue;
+      }
+      out.push_back(r);
+      if (out.size() == m)
+        return true;
+    }
+
+    if (repeats * 2 > batch.size())
+      return false;
+  }
+  return true;
+}
+
+/*
+ * Appends items of [0, k) with positive weight(i) to out by exponential
+ * keys until it holds m, in draw order. Fewer are appended only if fewer
+ * have positive weight.
+ */
+template<class Weight, class Index, class URBG>
+void exponential_keys(size_t k, Weight weight, size_t m, std::vector<Index>& out, URBG& gen) {
+  std::vector<std::pair<double, Index>> keys;
+  keys.reserve(k);
+  for (size_t i = 0; i < k; i ++) {
+    double w = weight(i);
+    if (w > 0)
+      keys.emplace_back(-std::log(uniform01(gen)) / w, i);
+  }
+
+  size_t need = std::min(m - std::min(m, out.size()), keys.size());
+  if (need < keys.size())
+    std::nth_element(keys.begin(), keys.begin() + need, keys.end());
+  std::sort(keys.begin(), keys.begin() + need);
+
+  for (size_t j = 0; j < need; j ++)
+    out.push_back(keys[j].second);
+}
+
+#endif